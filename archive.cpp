@@ -0,0 +1,498 @@
+#include "archive.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <utility>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace qchat {
+
+namespace {
+
+constexpr char SEG_MAGIC[8]={'Q','C','H','A','T','A','R','1'};
+constexpr std::size_t SEG_HEADER=16;          // magic, first seq
+constexpr std::size_t REC_HEAD=4+4+8+8+8+8+1; // length, crc, seq, epoch, from, to, kind
+constexpr std::size_t REC_TAIL=4;             // length again
+constexpr std::size_t REC_CRC_FROM=8;         // the crc covers seq through the line
+constexpr std::size_t MAX_RECORD=4u*1024u*1024u;
+constexpr std::size_t INDEX_ENTRY=3*sizeof(u64);
+constexpr std::size_t MAX_MAPS=32;
+
+template<class T>
+void put(std::string &out,const T &v) {
+	out.append(reinterpret_cast<const char*>(&v),sizeof(v));
+}
+
+template<class T>
+T get(const char *p) {
+	T v;
+	std::memcpy(&v,p,sizeof(v));
+	return v;
+}
+
+struct RecordView {
+	u64 seq{0};
+	u64 epochSeconds{0};
+	u64 from{0};
+	u64 to{0};
+	u8 kind{0};
+	std::string_view line;
+};
+
+// Parses the record at off in data[0,size); false if it is not whole and
+// intact.
+bool parseRecord(const char *data,std::size_t size,std::size_t off,RecordView &out,std::size_t &len) {
+	if(size-off<REC_HEAD+REC_TAIL)return false;
+	len=get<std::uint32_t>(data+off);
+	if(len<REC_HEAD+REC_TAIL || len>MAX_RECORD || len>size-off)return false;
+	if(get<std::uint32_t>(data+off+len-REC_TAIL)!=len)return false;
+	if(crc32(data+off+REC_CRC_FROM,len-REC_CRC_FROM-REC_TAIL)!=get<std::uint32_t>(data+off+4))return false;
+	const char *p=data+off+REC_CRC_FROM;
+	out.seq=get<u64>(p);
+	out.epochSeconds=get<u64>(p+8);
+	out.from=get<u64>(p+16);
+	out.to=get<u64>(p+24);
+	out.kind=static_cast<u8>(p[32]);
+	out.line=std::string_view(data+off+REC_HEAD,len-REC_HEAD-REC_TAIL);
+	return true;
+}
+
+bool visibleTo(u8 kind,u64 from,u64 to,u64 uid) {
+	if(kind==static_cast<u8>(Archive::Kind::Broadcast))return true;
+	return from==uid || to==uid;
+}
+
+bool writeAll(int fd,const std::string &data) {
+	std::size_t off=0;
+	while(off<data.size()){
+		ssize_t n=::write(fd,data.data()+off,data.size()-off);
+		if(n<0){
+			if(errno==EINTR)continue;
+			return false;
+		}
+		off+=static_cast<std::size_t>(n);
+	}
+	return true;
+}
+
+bool readFile(const std::string &path,std::string &out) {
+	int fd=::open(path.c_str(),O_RDONLY|O_CLOEXEC);
+	if(fd<0)return false;
+	out.clear();
+	char chunk[65536];
+	for(;;){
+		ssize_t n=::read(fd,chunk,sizeof(chunk));
+		if(n<0){
+			if(errno==EINTR)continue;
+			::close(fd);
+			return false;
+		}
+		if(n==0)break;
+		out.append(chunk,static_cast<std::size_t>(n));
+	}
+	::close(fd);
+	return true;
+}
+
+} // namespace
+
+// A read-only view of a segment. It may extend past the end of the file,
+// which is fine as long as only written bytes are read; the active segment
+// is mapped once at its full size and read as it grows.
+class Archive::Mapping {
+public:
+	Mapping(const char *base,std::size_t len):base_(base),len_(len) {}
+	~Mapping() {::munmap(const_cast<char*>(base_),len_);}
+	Mapping(const Mapping&)=delete;
+	Mapping &operator=(const Mapping&)=delete;
+
+	const char *data() const {return base_;}
+	std::size_t length() const {return len_;}
+
+private:
+	const char *base_;
+	std::size_t len_;
+};
+
+Archive::Archive(std::string dir,std::size_t segmentBytes,std::size_t keepSegments)
+	:dir_(std::move(dir)),segmentBytes_(segmentBytes),keepSegments_(keepSegments) {}
+
+Archive::~Archive() {
+	// the writer drains the queue and must be gone before the fds
+	if(writer_.joinable()){
+		writer_.request_stop();
+		writer_.join();
+	}
+	if(segFd_>=0){
+		::fdatasync(segFd_);
+		::close(segFd_);
+	}
+	if(idxFd_>=0)::close(idxFd_);
+}
+
+std::string Archive::segmentPath(u64 firstSeq,const char *ext) const {
+	char name[32];
+	std::snprintf(name,sizeof(name),"%016llx.%s",static_cast<unsigned long long>(firstSeq),ext);
+	return dir_+"/"+name;
+}
+
+bool Archive::open() {
+	if(::mkdir(dir_.c_str(),0755)<0 && errno!=EEXIST)return false;
+	DIR *d=::opendir(dir_.c_str());
+	if(d==nullptr)return false;
+	std::vector<u64> firsts;
+	while(dirent *e=::readdir(d)){
+		const std::string_view name(e->d_name);
+		if(name.size()!=20 || !name.ends_with(".seg"))continue;
+		u64 first=0;
+		bool hex=true;
+		for(char ch:name.substr(0,16)){
+			const int v=(ch>='0' && ch<='9')?ch-'0':(ch>='a' && ch<='f')?ch-'a'+10:-1;
+			if(v<0){
+				hex=false;
+				break;
+			}
+			first=(first<<4)|static_cast<u64>(v);
+		}
+		if(hex)firsts.push_back(first);
+	}
+	::closedir(d);
+	std::sort(firsts.begin(),firsts.end());
+
+	for(u64 first:firsts){
+		Segment seg;
+		seg.firstSeq=first;
+		seg.path=segmentPath(first,"seg");
+		struct stat st{};
+		if(::stat(seg.path.c_str(),&st)<0)return false;
+		seg.size=static_cast<std::size_t>(st.st_size);
+		segments_.push_back(std::move(seg));
+	}
+	if(segments_.empty()){
+		if(!startSegment(1))return false;
+	}else if(!recoverSegment(segments_.back())){
+		return false;
+	}
+	for(const Segment &seg:segments_)bytes_+=seg.size;
+	dropOldSegments();
+	writer_=std::jthread([this](std::stop_token stop){writerLoop(stop);});
+	return true;
+}
+
+// Finds the end of the newest segment from its last index entry, cuts off a
+// torn tail and reopens both files for appending.
+bool Archive::recoverSegment(Segment &seg) {
+	std::string data;
+	if(!readFile(seg.path,data))return false;
+	if(data.size()<SEG_HEADER || std::memcmp(data.data(),SEG_MAGIC,sizeof(SEG_MAGIC))!=0){
+		std::cerr<<"Archive segment "<<seg.path<<" has a bad header\n";
+		return false;
+	}
+	const std::string idxPath=segmentPath(seg.firstSeq,"idx");
+	std::string idx;
+	if(!readFile(idxPath,idx))idx.clear();
+	std::size_t entries=idx.size()/INDEX_ENTRY;
+	std::size_t off=SEG_HEADER;
+	u64 records=0;
+	u64 lastSeq=seg.firstSeq-1;
+	RecordView rec;
+	std::size_t len=0;
+	while(entries>0){
+		const std::size_t at=static_cast<std::size_t>(get<u64>(idx.data()+(entries-1)*INDEX_ENTRY+16));
+		if(at>=SEG_HEADER && parseRecord(data.data(),data.size(),at,rec,len)){
+			off=at;
+			records=(entries-1)*INDEX_EVERY;
+			break;
+		}
+		--entries; // points past what survived
+	}
+	while(parseRecord(data.data(),data.size(),off,rec,len)){
+		if(records%INDEX_EVERY==0 && records/INDEX_EVERY>=entries){
+			put(idxBuf_,rec.seq);
+			put(idxBuf_,rec.epochSeconds);
+			put(idxBuf_,static_cast<u64>(off));
+		}
+		lastSeq=rec.seq;
+		off+=len;
+		++records;
+	}
+	if(off<data.size()){
+		std::cerr<<"Archive segment "<<seg.path<<": dropping "<<(data.size()-off)<<" bytes of torn tail\n";
+	}
+
+	segFd_=::open(seg.path.c_str(),O_WRONLY|O_CLOEXEC);
+	idxFd_=::open(idxPath.c_str(),O_WRONLY|O_CREAT|O_CLOEXEC,0644);
+	if(segFd_<0 || idxFd_<0)return false;
+	if(::ftruncate(segFd_,static_cast<off_t>(off))<0)return false;
+	if(::ftruncate(idxFd_,static_cast<off_t>(entries*INDEX_ENTRY))<0)return false;
+	if(::lseek(segFd_,0,SEEK_END)<0 || ::lseek(idxFd_,0,SEEK_END)<0)return false;
+	if(!idxBuf_.empty()){
+		if(!writeAll(idxFd_,idxBuf_))return false;
+		idxBuf_.clear();
+	}
+	seg.size=off;
+	segSize_=off;
+	segRecords_=records;
+	nextSeq_=lastSeq+1;
+	return true;
+}
+
+bool Archive::startSegment(u64 firstSeq) {
+	Segment seg;
+	seg.firstSeq=firstSeq;
+	seg.path=segmentPath(firstSeq,"seg");
+	std::string header(SEG_MAGIC,sizeof(SEG_MAGIC));
+	put(header,firstSeq);
+	segFd_=::open(seg.path.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0644);
+	idxFd_=::open(segmentPath(firstSeq,"idx").c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0644);
+	if(segFd_<0 || idxFd_<0 || !writeAll(segFd_,header))return false;
+	seg.size=header.size();
+	segSize_=header.size();
+	segRecords_=0;
+	std::lock_guard<std::mutex> lock(mutex_);
+	bytes_+=seg.size;
+	segments_.push_back(std::move(seg));
+	return true;
+}
+
+// Deletes the oldest segments beyond keepSegments_. A reader that already
+// mapped one goes on reading it; new lookups stop at the oldest kept one.
+void Archive::dropOldSegments() {
+	if(keepSegments_==0)return;
+	std::vector<Segment> old;
+	u64 floor=0;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if(segments_.size()<=keepSegments_)return;
+		const auto kept=segments_.end()-static_cast<std::ptrdiff_t>(keepSegments_);
+		for(auto it=segments_.begin();it!=kept;++it){
+			bytes_-=it->size;
+			old.push_back(std::move(*it));
+		}
+		segments_.erase(segments_.begin(),kept);
+		floor=segments_.front().firstSeq;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mapMutex_);
+		mapFloor_=floor;
+		maps_.erase(maps_.begin(),maps_.lower_bound(floor));
+	}
+	for(const Segment &seg:old){
+		if(::unlink(seg.path.c_str())<0 && errno!=ENOENT)std::cerr<<"Archive could not delete "<<seg.path<<"\n";
+		::unlink(segmentPath(seg.firstSeq,"idx").c_str());
+	}
+}
+
+bool Archive::sealSegment() {
+	const bool ok=::fdatasync(segFd_)==0 && ::fdatasync(idxFd_)==0;
+	::close(segFd_);
+	::close(idxFd_);
+	segFd_=-1;
+	idxFd_=-1;
+	return ok;
+}
+
+void Archive::append(Kind kind,u64 from,u64 to,OutBuf line) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	Pending p;
+	p.seq=nextSeq_++;
+	p.epochSeconds=nowEpochSeconds();
+	p.kind=kind;
+	p.from=from;
+	p.to=to;
+	p.line=std::move(line);
+	pending_.push_back(std::move(p));
+	++messages_;
+	if(pending_.size()==1)cv_.notify_one();
+}
+
+void Archive::writerLoop(std::stop_token stop) {
+	std::unique_lock<std::mutex> lock(mutex_);
+	for(;;){
+		cv_.wait(lock,stop,[this]{return !pending_.empty();});
+		if(pending_.empty())break; // stopping, and drained
+		inflight_.swap(pending_);
+		lock.unlock();
+
+		// flushes buf_ to the active segment; on failure the segment is cut
+		// back so a half-written record never sits before later ones. The
+		// records leave inflight_ for recent() as the segment size that
+		// covers them is published.
+		u64 lost=0;
+		std::size_t buffered=0;
+		std::size_t encoded=0;
+		auto flush=[&]{
+			if(buf_.empty())return;
+			if(segFd_>=0 && writeAll(segFd_,buf_)){
+				segSize_+=buf_.size();
+				if(!idxBuf_.empty() && !writeAll(idxFd_,idxBuf_))std::cerr<<"Archive index write failed\n";
+			}else{
+				std::cerr<<"Archive write failed: "<<std::strerror(errno)<<"\n";
+				if(segFd_>=0 && ::ftruncate(segFd_,static_cast<off_t>(segSize_))<0)std::cerr<<"Archive truncate failed\n";
+				lost+=buffered;
+			}
+			buf_.clear();
+			idxBuf_.clear();
+			buffered=0;
+			std::lock_guard<std::mutex> g(mutex_);
+			bytes_+=segSize_-segments_.back().size;
+			segments_.back().size=segSize_;
+			inflightWritten_=encoded;
+		};
+		for(const Pending &p:inflight_){
+			std::string_view text(*p.line);
+			if(!text.empty() && text.back()=='\n')text.remove_suffix(1);
+			if(text.size()>MAX_RECORD-REC_HEAD-REC_TAIL)text=text.substr(0,MAX_RECORD-REC_HEAD-REC_TAIL);
+			const std::size_t len=REC_HEAD+text.size()+REC_TAIL;
+			if(segRecords_>0 && segSize_+buf_.size()+len>segmentBytes_){
+				flush();
+				if(!sealSegment())std::cerr<<"Archive segment sync failed\n";
+				if(startSegment(p.seq)){
+					dropOldSegments();
+				}else{
+					std::cerr<<"Archive could not start segment at "<<p.seq<<"\n";
+				}
+			}
+			if(segRecords_%INDEX_EVERY==0){
+				put(idxBuf_,p.seq);
+				put(idxBuf_,p.epochSeconds);
+				put(idxBuf_,static_cast<u64>(segSize_+buf_.size()));
+			}
+			const std::size_t at=buf_.size();
+			put(buf_,static_cast<std::uint32_t>(len));
+			put(buf_,std::uint32_t{0});
+			put(buf_,p.seq);
+			put(buf_,p.epochSeconds);
+			put(buf_,p.from);
+			put(buf_,p.to);
+			put(buf_,static_cast<u8>(p.kind));
+			buf_.append(text);
+			put(buf_,static_cast<std::uint32_t>(len));
+			const std::uint32_t crc=crc32(buf_.data()+at+REC_CRC_FROM,len-REC_CRC_FROM-REC_TAIL);
+			std::memcpy(buf_.data()+at+4,&crc,sizeof(crc));
+			++segRecords_;
+			++buffered;
+			++encoded;
+		}
+		flush();
+
+		lock.lock();
+		written_+=inflight_.size()-lost;
+		failed_+=lost;
+		inflight_.clear();
+		inflightWritten_=0;
+	}
+}
+
+std::shared_ptr<Archive::Mapping> Archive::mapping(const Segment &seg) {
+	std::lock_guard<std::mutex> lock(mapMutex_);
+	if(seg.firstSeq<mapFloor_)return nullptr;
+	auto it=maps_.find(seg.firstSeq);
+	if(it!=maps_.end() && it->second->length()>=seg.size)return it->second;
+	int fd=::open(seg.path.c_str(),O_RDONLY|O_CLOEXEC);
+	if(fd<0)return nullptr;
+	const std::size_t len=std::max(seg.size,segmentBytes_);
+	void *p=::mmap(nullptr,len,PROT_READ,MAP_SHARED,fd,0);
+	::close(fd);
+	if(p==MAP_FAILED)return nullptr;
+	auto m=std::make_shared<Mapping>(static_cast<const char*>(p),len);
+	maps_[seg.firstSeq]=m;
+	// readers still holding an evicted mapping keep it alive
+	while(maps_.size()>MAX_MAPS){
+		auto victim=maps_.begin();
+		if(victim->first==seg.firstSeq)++victim;
+		maps_.erase(victim);
+	}
+	return m;
+}
+
+// The segment before the one starting at firstSeq; false if there is none
+// left.
+bool Archive::segmentBefore(u64 firstSeq,Segment &out) const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it=std::lower_bound(segments_.begin(),segments_.end(),firstSeq,
+		[](const Segment &s,u64 seq){return s.firstSeq<seq;});
+	if(it==segments_.begin())return false;
+	out=*std::prev(it);
+	return true;
+}
+
+void Archive::recent(u64 uid,std::size_t n,const std::function<void(u64,std::string_view)> &fn) {
+	if(n==0)return;
+	std::vector<Pending> queued; // newest first
+	Segment seg;
+	bool haveSeg=false;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for(auto it=pending_.rbegin();it!=pending_.rend() && queued.size()<n;++it){
+			if(visibleTo(static_cast<u8>(it->kind),it->from,it->to,uid))queued.push_back(*it);
+		}
+		const auto unwritten=inflight_.rend()-static_cast<std::ptrdiff_t>(inflightWritten_);
+		for(auto it=inflight_.rbegin();it!=unwritten && queued.size()<n;++it){
+			if(visibleTo(static_cast<u8>(it->kind),it->from,it->to,uid))queued.push_back(*it);
+		}
+		// the active segment must match what was queued; older ones are
+		// sealed and fetched one by one only if the walk gets that far
+		if(queued.size()<n && !segments_.empty()){
+			seg=segments_.back();
+			haveSeg=true;
+		}
+	}
+
+	// walk the segments backwards using each record's trailing length
+	struct Found {
+		const Mapping *map;
+		std::size_t off;
+	};
+	std::vector<std::shared_ptr<Mapping>> held;
+	std::vector<Found> found; // newest first
+	for(bool more=haveSeg;more && queued.size()+found.size()<n;more=segmentBefore(seg.firstSeq,seg)){
+		std::shared_ptr<Mapping> m=mapping(seg);
+		if(!m)continue;
+		const char *data=m->data();
+		std::size_t end=seg.size;
+		while(end>=SEG_HEADER+REC_HEAD+REC_TAIL && queued.size()+found.size()<n){
+			const std::uint32_t len=get<std::uint32_t>(data+end-REC_TAIL);
+			if(len<REC_HEAD+REC_TAIL || len>end-SEG_HEADER)break;
+			const std::size_t off=end-len;
+			const char *p=data+off+REC_CRC_FROM;
+			if(visibleTo(static_cast<u8>(p[32]),get<u64>(p+16),get<u64>(p+24),uid))found.push_back(Found{m.get(),off});
+			end=off;
+		}
+		held.push_back(std::move(m));
+	}
+
+	for(auto it=found.rbegin();it!=found.rend();++it){
+		RecordView rec;
+		std::size_t len=0;
+		if(!parseRecord(it->map->data(),it->map->length(),it->off,rec,len))continue;
+		fn(rec.epochSeconds,rec.line);
+	}
+	for(auto it=queued.rbegin();it!=queued.rend();++it){
+		std::string_view text(*it->line);
+		if(!text.empty() && text.back()=='\n')text.remove_suffix(1);
+		fn(it->epochSeconds,text);
+	}
+}
+
+ArchiveStats Archive::stats() const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	ArchiveStats s;
+	s.messages=messages_;
+	s.written=written_;
+	s.failed=failed_;
+	s.segments=segments_.size();
+	s.bytes=bytes_;
+	return s;
+}
+
+} // namespace qchat
@@ -0,0 +1,138 @@
+#ifndef QCHAT_ARCHIVE_HPP
+#define QCHAT_ARCHIVE_HPP
+
+#include "chat_common.hpp"
+#include "out_queue.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace qchat {
+
+struct ArchiveStats {
+	u64 messages{0};     // appended since start
+	u64 written{0};      // of those, on disk
+	u64 failed{0};       // lost to write errors
+	u64 segments{0};
+	u64 bytes{0};        // in all segments
+};
+
+// Every chat message, appended to segment files in one directory:
+//
+//   <first seq, 16 hex digits>.seg   "QCHATAR1", u64 first seq, then records
+//   <first seq, 16 hex digits>.idx   {u64 seq, u64 epoch seconds, u64 offset}
+//                                    for every INDEX_EVERY-th record
+//
+// A record is u32 length, u32 crc, u64 seq, u64 epoch seconds, u64 from uid,
+// u64 to uid, u8 kind, the line, then the u32 length again so a segment can
+// be read from its end. Integers are in host byte order, as in the journal.
+//
+// append() only queues: a writer thread encodes what has piled up and hands
+// it to the kernel in one write, so senders never wait for the disk. Segments
+// are synced when they are sealed; a crash can lose the unsealed tail, which
+// is cut back to the last whole record on the next start using the index.
+//
+// With keepSegments set, starting a segment deletes the oldest ones beyond
+// that many, and with them the oldest history.
+class Archive {
+public:
+	enum class Kind : u8 {
+		Broadcast=0,
+		Private=1
+	};
+
+	Archive(std::string dir,std::size_t segmentBytes,std::size_t keepSegments=0);
+	~Archive();
+
+	Archive(const Archive&)=delete;
+	Archive &operator=(const Archive&)=delete;
+
+	// Creates dir if needed, recovers the newest segment and starts the
+	// writer.
+	bool open();
+
+	// Thread-safe and never blocks on I/O. line is the text-protocol line as
+	// sent; it is kept by reference until written.
+	void append(Kind kind,u64 from,u64 to,OutBuf line);
+
+	// Calls fn(epochSeconds,line) for the last n messages uid may read
+	// (broadcasts and its own private messages), oldest first. Thread-safe;
+	// messages still queued for the writer are included.
+	void recent(u64 uid,std::size_t n,const std::function<void(u64,std::string_view)> &fn);
+
+	ArchiveStats stats() const;
+
+private:
+	static constexpr std::size_t INDEX_EVERY=64;
+
+	struct Pending {
+		u64 seq{0};
+		u64 epochSeconds{0};
+		Kind kind{Kind::Broadcast};
+		u64 from{0};
+		u64 to{0};
+		OutBuf line;
+	};
+
+	struct Segment {
+		u64 firstSeq{0};
+		std::string path;
+		std::size_t size{0};   // readable bytes
+	};
+
+	class Mapping;
+
+	std::string dir_;
+	std::size_t segmentBytes_;
+	std::size_t keepSegments_;  // 0 = all
+
+	// mutex_ guards everything below up to the writer's own state
+	mutable std::mutex mutex_;
+	std::condition_variable_any cv_;
+	std::vector<Pending> pending_;
+	std::vector<Pending> inflight_;  // taken by the writer
+	std::size_t inflightWritten_{0}; // leading inflight_ entries now in segments_
+	std::vector<Segment> segments_;  // oldest first
+	u64 nextSeq_{1};
+	u64 messages_{0};
+	u64 written_{0};
+	u64 failed_{0};
+	u64 bytes_{0};
+
+	// writer thread only
+	int segFd_{-1};
+	int idxFd_{-1};
+	std::size_t segSize_{0};
+	u64 segRecords_{0};
+	std::string buf_;
+	std::string idxBuf_;
+
+	// mapped segments for recent(), by first seq
+	std::mutex mapMutex_;
+	std::map<u64,std::shared_ptr<Mapping>> maps_;
+	u64 mapFloor_{0};  // segments before this one are deleted
+
+	std::jthread writer_; // last: stops before anything it touches is destroyed
+
+	void writerLoop(std::stop_token stop);
+	bool startSegment(u64 firstSeq);
+	bool sealSegment();
+	bool recoverSegment(Segment &seg);
+	void dropOldSegments();
+	bool segmentBefore(u64 firstSeq,Segment &out) const;
+	std::shared_ptr<Mapping> mapping(const Segment &seg);
+	std::string segmentPath(u64 firstSeq,const char *ext) const;
+};
+
+} // namespace qchat
+
+#endif
@@ -0,0 +1,54 @@
+#include "bench_common.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+std::atomic<std::uint64_t> allocs{0};
+std::atomic<std::uint64_t> allocBytes{0};
+
+} // namespace
+
+namespace bench {
+
+HeapCount heapCount() {
+	return HeapCount{allocs.load(std::memory_order_relaxed),allocBytes.load(std::memory_order_relaxed)};
+}
+
+} // namespace bench
+
+// The array and nothrow forms forward to these in libstdc++, so the plain
+// and aligned versions cover every allocation the benches make.
+void *operator new(std::size_t n) {
+	allocs.fetch_add(1,std::memory_order_relaxed);
+	allocBytes.fetch_add(n,std::memory_order_relaxed);
+	if(void *p=std::malloc(n==0?1:n))return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void *p,std::size_t) noexcept {
+	std::free(p);
+}
+
+void *operator new(std::size_t n,std::align_val_t al) {
+	allocs.fetch_add(1,std::memory_order_relaxed);
+	allocBytes.fetch_add(n,std::memory_order_relaxed);
+	const std::size_t align=static_cast<std::size_t>(al);
+	// aligned_alloc wants a size that is a multiple of the alignment
+	if(void *p=std::aligned_alloc(align,(n+align-1)/align*align+(n==0?align:0)))return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p,std::align_val_t) noexcept {
+	std::free(p);
+}
+
+void operator delete(void *p,std::size_t,std::align_val_t) noexcept {
+	std::free(p);
+}
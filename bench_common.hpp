@@ -0,0 +1,71 @@
+#ifndef QCHAT_BENCH_COMMON_HPP
+#define QCHAT_BENCH_COMMON_HPP
+
+// Shared by the *_bench programs. Each prints one JSON object so runs from
+// different commits can be diffed; numbers are only meaningful from an
+// optimised build (-DCMAKE_BUILD_TYPE=Release).
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace bench {
+
+using Clock=std::chrono::steady_clock;
+
+#ifdef __OPTIMIZE__
+inline constexpr bool OPTIMIZED=true;
+#else
+inline constexpr bool OPTIMIZED=false;
+#endif
+
+inline double nsSince(Clock::time_point t0) {
+	return std::chrono::duration<double,std::nano>(Clock::now()-t0).count();
+}
+
+// Best ns per call of fn over five rounds, each repeating fn until it has
+// run for at least roundNs.
+template<class Fn>
+double bestNs(double roundNs,Fn &&fn) {
+	double best=1e300;
+	for(int round=0;round<5;++round){
+		std::size_t iters=0;
+		const auto t0=Clock::now();
+		double elapsed=0;
+		do{
+			fn();
+			++iters;
+			elapsed=nsSince(t0);
+		}while(elapsed<roundNs);
+		best=std::min(best,elapsed/static_cast<double>(iters));
+	}
+	return best;
+}
+
+// q-quantile of samples, which is sorted in place.
+inline double quantile(std::vector<double> &samples,double q) {
+	if(samples.empty())return 0;
+	std::sort(samples.begin(),samples.end());
+	const std::size_t i=static_cast<std::size_t>(q*static_cast<double>(samples.size()-1));
+	return samples[i];
+}
+
+// Heap traffic through the replaced global operator new in bench_common.cpp,
+// counted since the program started. Take the difference around the code
+// under test.
+struct HeapCount {
+	std::uint64_t allocs{0};
+	std::uint64_t bytes{0};
+};
+
+HeapCount heapCount();
+
+inline HeapCount operator-(HeapCount a,HeapCount b) {
+	return HeapCount{a.allocs-b.allocs,a.bytes-b.bytes};
+}
+
+} // namespace bench
+
+#endif
@@ -4,6 +4,7 @@
 #include <array>
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
 #include <chrono>
@@ -11,6 +12,11 @@
 #include <fstream>
 #include <sstream>
 #include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
 
 #include "qhash.hpp"
 
@@ -19,26 +25,92 @@ namespace qchat {
 using u8=qhash::u8;
 using u64=qhash::u64;
 
+// IPv4 addresses are stored IPv4-mapped (::ffff:a.b.c.d); all zero means
+// unknown.
+using IpAddr=std::array<u8,16>;
+
+inline IpAddr ipFromV4(const in_addr &a) {
+	IpAddr ip{};
+	ip[10]=0xFF;
+	ip[11]=0xFF;
+	std::memcpy(ip.data()+12,&a.s_addr,4);
+	return ip;
+}
+
+// Accepts dotted IPv4 or IPv6 text; anything else is unknown.
+inline IpAddr parseIp(std::string_view text) {
+	IpAddr ip{};
+	char buf[INET6_ADDRSTRLEN];
+	if(text.size()>=sizeof(buf))return ip;
+	std::memcpy(buf,text.data(),text.size());
+	buf[text.size()]='\0';
+	in_addr v4{};
+	if(::inet_pton(AF_INET,buf,&v4)==1)return ipFromV4(v4);
+	if(::inet_pton(AF_INET6,buf,ip.data())!=1)ip.fill(0);
+	return ip;
+}
+
+inline std::string formatIp(const IpAddr &ip) {
+	static constexpr u8 V4_PREFIX[12]={0,0,0,0,0,0,0,0,0,0,0xFF,0xFF};
+	if(std::all_of(ip.begin(),ip.end(),[](u8 b){return b==0;}))return "unknown";
+	char buf[INET6_ADDRSTRLEN];
+	const char *ptr=(std::memcmp(ip.data(),V4_PREFIX,12)==0)
+		?::inet_ntop(AF_INET,ip.data()+12,buf,sizeof(buf))
+		: ::inet_ntop(AF_INET6,ip.data(),buf,sizeof(buf));
+	return ptr!=nullptr?std::string(ptr):std::string("unknown");
+}
+
 struct LoginRecord {
 	u64 epochSeconds{};
-	std::string ip;
+	IpAddr ip{};
 };
 
-struct User {
-	u64 uid{};
-	std::string handle;       // unique, ASCII, no whitespace
-	std::string displayName;  // UTF-8, arbitrary
-	std::array<u8,64> passwordHash{};
-	bool allowMultiLogin{false};
-	std::vector<LoginRecord> history;
-};
+constexpr std::size_t MAX_LOGIN_HISTORY=32;
 
-struct DbState {
-	u64 nextUid{1};
-	std::unordered_map<u64,User> usersById;
-	std::unordered_map<std::string,u64> uidByHandle;
+// The last MAX_LOGIN_HISTORY logins, held inline; the oldest is overwritten.
+// Indexing is oldest first.
+class LoginHistory {
+public:
+	void push(const LoginRecord &rec) {
+		if(count_<MAX_LOGIN_HISTORY){
+			slots_[(head_+count_)%MAX_LOGIN_HISTORY]=rec;
+			++count_;
+		}else{
+			slots_[head_]=rec;
+			head_=static_cast<u8>((head_+1)%MAX_LOGIN_HISTORY);
+		}
+	}
+	std::size_t size() const {return count_;}
+	bool empty() const {return count_==0;}
+	const LoginRecord &operator[](std::size_t k) const {return slots_[(head_+k)%MAX_LOGIN_HISTORY];}
+
+private:
+	std::array<LoginRecord,MAX_LOGIN_HISTORY> slots_{};
+	u8 head_{0};
+	u8 count_{0};
 };
 
+// CRC-32 (IEEE 802.3, reflected polynomial)
+constexpr std::array<std::uint32_t,256> makeCrcTable() {
+	std::array<std::uint32_t,256> t{};
+	for(std::uint32_t i=0;i<256;++i){
+		std::uint32_t c=i;
+		for(int k=0;k<8;++k)c=(c&1u)?(0xEDB88320u^(c>>1)):(c>>1);
+		t[i]=c;
+	}
+	return t;
+}
+
+inline constexpr std::array<std::uint32_t,256> CRC_TABLE=makeCrcTable();
+
+inline std::uint32_t crc32(const char *p,std::size_t n) {
+	std::uint32_t c=0xFFFFFFFFu;
+	for(std::size_t i=0;i<n;++i){
+		c=CRC_TABLE[(c^static_cast<unsigned char>(p[i]))&0xFFu]^(c>>8);
+	}
+	return c^0xFFFFFFFFu;
+}
+
 inline u64 nowEpochSeconds() {
 	using namespace std::chrono;
 	return static_cast<u64>(duration_cast<seconds>(
@@ -46,16 +118,7 @@ inline u64 nowEpochSeconds() {
 	).count());
 }
 
-inline std::array<u8,64> hashPassword(const std::string &pw) {
-	return qhash::sha3_512_bytes(pw.data(),pw.size());
-}
-
-inline bool passwordMatches(const std::array<u8,64> &hash,const std::string &pw) {
-	auto h=hashPassword(pw);
-	return std::equal(h.begin(),h.end(),hash.begin());
-}
-
-inline bool isValidHandle(const std::string &h) {
+inline bool isValidHandle(std::string_view h) {
 	if(h.empty())return false;
 	for(char c:h){
 		unsigned char uc=static_cast<unsigned char>(c);
@@ -74,6 +137,40 @@ inline std::string trim(const std::string &s) {
 	return s.substr(b,e-b);
 }
 
+inline std::string_view trimView(std::string_view s) {
+	std::size_t b=0;
+	while(b<s.size() && static_cast<unsigned char>(s[b])<=32u)++b;
+	std::size_t e=s.size();
+	while(e>b && static_cast<unsigned char>(s[e-1])<=32u)--e;
+	return s.substr(b,e-b);
+}
+
+// Packs a command verb of up to 8 bytes into one integer so dispatch is a
+// single switch. Longer verbs map to 0, which no command uses; a verb never
+// starts with a NUL byte (trimView strips those), so packing is exact.
+constexpr u64 verbKey(std::string_view v) {
+	if(v.empty() || v.size()>8)return 0;
+	u64 k=0;
+	for(char ch:v)k=(k<<8)|static_cast<unsigned char>(ch);
+	return k;
+}
+
+// A protocol line split into its verb and the trimmed argument tail, both
+// views into the line. verb is empty for a blank line.
+struct Command {
+	std::string_view verb;
+	std::string_view rest;
+};
+
+inline Command splitCommand(std::string_view line) {
+	const std::string_view trimmed=trimView(line);
+	const std::size_t sp=trimmed.find(' ');
+	Command cmd;
+	cmd.verb=trimmed.substr(0,sp);
+	if(sp!=std::string_view::npos)cmd.rest=trimView(trimmed.substr(sp+1));
+	return cmd;
+}
+
 inline std::vector<std::string> splitTokens(const std::string &line,std::size_t maxTokens) {
 	std::vector<std::string> out;
 	out.reserve(maxTokens);
@@ -93,128 +190,26 @@ inline std::vector<std::string> splitTokens(const std::string &line,std::size_t
 	return out;
 }
 
-// Binary persistence (simple, local-endian, not portable across architectures)
-class DbFile {
-public:
-	explicit DbFile(const std::string &path):path_(path) {}
-
-	bool load(DbState &state) {
-		std::ifstream in(path_,std::ios::binary);
-		if(!in.good())return true; // treat as empty DB
-		char magic[8];
-		in.read(magic,8);
-		if(!in.good())return false;
-		const char expected[8]={'Q','C','H','A','T','D','B','1'};
-		for(std::size_t i=0;i<8;++i){
-			if(magic[i]!=expected[i])return false;
-		}
-		u64 nextUid=0;
-		in.read(reinterpret_cast<char*>(&nextUid),sizeof(nextUid));
-		if(!in.good())return false;
-		state.nextUid=nextUid;
-
-		u64 userCount=0;
-		in.read(reinterpret_cast<char*>(&userCount),sizeof(userCount));
-		if(!in.good())return false;
-
-		state.usersById.clear();
-		state.uidByHandle.clear();
-
-		for(u64 idx=0;idx<userCount;++idx){
-			User u{};
-			if(!readString(in,u.handle))return false;
-			if(!readString(in,u.displayName))return false;
-			u64 uid=0;
-			in.read(reinterpret_cast<char*>(&uid),sizeof(uid));
-			if(!in.good())return false;
-			u.uid=uid;
-			u8 multi=0;
-			in.read(reinterpret_cast<char*>(&multi),sizeof(multi));
-			if(!in.good())return false;
-			u.allowMultiLogin=(multi!=0u);
-			in.read(reinterpret_cast<char*>(u.passwordHash.data()),u.passwordHash.size());
-			if(!in.good())return false;
-
-			u64 histCount=0;
-			in.read(reinterpret_cast<char*>(&histCount),sizeof(histCount));
-			if(!in.good())return false;
-			u.history.clear();
-			u.history.reserve(static_cast<std::size_t>(histCount));
-			for(u64 hi=0;hi<histCount;++hi){
-				LoginRecord rec{};
-				in.read(reinterpret_cast<char*>(&rec.epochSeconds),sizeof(rec.epochSeconds));
-				if(!in.good())return false;
-				if(!readString(in,rec.ip))return false;
-				u.history.push_back(rec);
-			}
-
-			state.uidByHandle[u.handle]=u.uid;
-			state.usersById.emplace(u.uid,std::move(u));
-		}
-		return true;
-	}
-
-	bool save(const DbState &state) {
-		std::ofstream out(path_,std::ios::binary|std::ios::trunc);
-		if(!out.good())return false;
-		const char magic[8]={'Q','C','H','A','T','D','B','1'};
-		out.write(magic,8);
-		if(!out.good())return false;
-		out.write(reinterpret_cast<const char*>(&state.nextUid),sizeof(state.nextUid));
-		if(!out.good())return false;
-		u64 userCount=static_cast<u64>(state.usersById.size());
-		out.write(reinterpret_cast<const char*>(&userCount),sizeof(userCount));
-		if(!out.good())return false;
-		for(const auto &kv:state.usersById){
-			const User &u=kv.second;
-			if(!writeString(out,u.handle))return false;
-			if(!writeString(out,u.displayName))return false;
-			out.write(reinterpret_cast<const char*>(&u.uid),sizeof(u.uid));
-			if(!out.good())return false;
-			u8 multi=u.allowMultiLogin?1u:0u;
-			out.write(reinterpret_cast<const char*>(&multi),sizeof(multi));
-			if(!out.good())return false;
-			out.write(reinterpret_cast<const char*>(u.passwordHash.data()),u.passwordHash.size());
-			if(!out.good())return false;
-			u64 histCount=static_cast<u64>(u.history.size());
-			out.write(reinterpret_cast<const char*>(&histCount),sizeof(histCount));
-			if(!out.good())return false;
-			for(const LoginRecord &rec:u.history){
-				out.write(reinterpret_cast<const char*>(&rec.epochSeconds),sizeof(rec.epochSeconds));
-				if(!out.good())return false;
-				if(!writeString(out,rec.ip))return false;
-			}
-		}
-		return true;
-	}
-
-private:
-	std::string path_;
-
-	static bool writeString(std::ofstream &out,const std::string &s) {
-		u64 len=static_cast<u64>(s.size());
-		out.write(reinterpret_cast<const char*>(&len),sizeof(len));
-		if(!out.good())return false;
-		if(len>0u){
-			out.write(s.data(),static_cast<std::streamsize>(len));
-			if(!out.good())return false;
-		}
-		return true;
+// Allocation-free splitTokens: views into line, the last token taking the
+// rest of the line. Returns how many of out were filled.
+template<std::size_t N>
+std::size_t splitTokens(std::string_view line,std::array<std::string_view,N> &out) {
+	std::size_t n=0;
+	std::size_t i=0;
+	while(i<line.size() && n+1<N){
+		while(i<line.size() && static_cast<unsigned char>(line[i])<=32u)++i;
+		if(i>=line.size())break;
+		std::size_t j=i;
+		while(j<line.size() && static_cast<unsigned char>(line[j])>32u)++j;
+		out[n++]=line.substr(i,j-i);
+		i=j;
 	}
-
-	static bool readString(std::ifstream &in,std::string &s) {
-		u64 len=0;
-		in.read(reinterpret_cast<char*>(&len),sizeof(len));
-		if(!in.good())return false;
-		if(len>1024u*1024u)return false; // sanity limit 1MB
-		s.clear();
-		if(len==0u)return true;
-		s.resize(static_cast<std::size_t>(len));
-		in.read(&s[0],static_cast<std::streamsize>(len));
-		if(!in.good())return false;
-		return true;
+	while(i<line.size() && static_cast<unsigned char>(line[i])<=32u)++i;
+	if(i<line.size() && n<N){
+		out[n++]=line.substr(i);
 	}
-};
+	return n;
+}
 
 } // namespace qchat
 
@@ -1,4 +1,7 @@
 #include "client.hpp"
+#include "chat_common.hpp"
+#include "line_buffer.hpp"
+#include "proto_bin.hpp"
 #include "tui.hpp"
 
 #include <iostream>
@@ -12,12 +15,14 @@
 
 namespace qchat {
 
-Client::Client(const std::string &host,unsigned short port,Tui &tui)
+Client::Client(const std::string &host,unsigned short port,Tui &tui,bool binary)
 	:host_(host),
 	port_(port),
 	sock_(-1),
 	running_(false),
-	tui_(tui) {}
+	tui_(tui),
+	wantBinary_(binary),
+	mode_(Mode::Text) {}
 
 Client::~Client() {
 	stop();
@@ -60,6 +65,11 @@ void Client::start() {
 		if(!connectToServer())return;
 	}
 	running_=true;
+	if(wantBinary_){
+		std::lock_guard<std::mutex> lock(sendMutex_);
+		static constexpr char hello[]="PROTO BIN\n";
+		if(sendAll(sock_,hello,sizeof(hello)-1))mode_=Mode::Handshake;
+	}
 	recvThread_=std::jthread([this](){recvLoop();});
 }
 
@@ -91,19 +101,87 @@ bool Client::sendAll(int fd,const char *data,std::size_t len) {
 
 void Client::sendLine(const std::string &line) {
 	if(sock_<0)return;
-	std::string out=line;
-	if(out.empty() || out.back()!='\n')out.push_back('\n');
 	std::lock_guard<std::mutex> lock(sendMutex_);
-	if(!sendAll(sock_,out.data(),out.size())){
+	if(mode_==Mode::Handshake){
+		pending_.push_back(line);
+		return;
+	}
+	if(!sendLocked(line)){
 		tui_.onServerLine("Error sending data, disconnecting");
 		stop();
 	}
 }
 
+// Caller holds sendMutex_.
+bool Client::sendLocked(const std::string &line) {
+	if(mode_==Mode::Binary){
+		std::string frame=encodeRequest(line);
+		return sendAll(sock_,frame.data(),frame.size());
+	}
+	std::string out=line;
+	if(out.empty() || out.back()!='\n')out.push_back('\n');
+	return sendAll(sock_,out.data(),out.size());
+}
+
+// The commands with their own opcodes travel as fields; anything else is
+// wrapped verbatim in a Command frame.
+std::string Client::encodeRequest(std::string_view line) {
+	const std::string_view text=trimView(line);
+	std::array<std::string_view,4> toks;
+	const std::size_t n=splitTokens(text,toks);
+	std::string payload;
+	BinOp op=BinOp::Command;
+	if(n==4 && toks[0]=="SIGNUP"){
+		op=BinOp::Signup;
+		appendBinField(payload,toks[1]);
+		appendBinField(payload,toks[2]);
+		payload.append(toks[3]);
+	}else if(n>=3 && toks[0]=="LOGIN"){
+		op=BinOp::Login;
+		appendBinField(payload,toks[1]);
+		payload.append(toks[2]);
+	}else if(n>=2 && toks[0]=="MSGALL"){
+		op=BinOp::MsgAll;
+		payload.append(text.substr(static_cast<std::size_t>(toks[1].data()-text.data())));
+	}else if(n>=3 && toks[0]=="MSGTO"){
+		op=BinOp::MsgTo;
+		appendBinField(payload,toks[1]);
+		payload.append(text.substr(static_cast<std::size_t>(toks[2].data()-text.data())));
+	}else{
+		payload.append(text);
+	}
+	std::string frame;
+	frame.reserve(BIN_HEADER_SIZE+payload.size());
+	appendBinHeader(frame,op,payload.size());
+	frame.append(payload);
+	return frame;
+}
+
+void Client::finishHandshake(bool accepted) {
+	std::lock_guard<std::mutex> lock(sendMutex_);
+	mode_=accepted?Mode::Binary:Mode::Text;
+	for(const std::string &line:pending_){
+		if(!sendLocked(line))break;
+	}
+	pending_.clear();
+}
+
 void Client::recvLoop() {
-	std::string buf;
-	buf.reserve(1024);
-	char tmp[1024];
+	LineBuffer lines;
+	FrameBuffer frames;
+	bool binary=false;
+	bool handshake=wantBinary_;
+	auto showReply=[this](std::string_view text){
+		// binary bodies may span lines; the TUI shows one per row
+		std::size_t pos=0;
+		for(;;){
+			std::size_t nl=text.find('\n',pos);
+			tui_.onServerLine(std::string(text.substr(pos,nl-pos)));
+			if(nl==std::string_view::npos)break;
+			pos=nl+1;
+		}
+	};
+	char tmp[4096];
 	while(running_){
 		ssize_t n=::recv(sock_,tmp,sizeof(tmp),0);
 		if(n<0){
@@ -115,13 +193,33 @@ void Client::recvLoop() {
 			tui_.onServerLine("Server closed connection");
 			break;
 		}
-		buf.append(tmp,tmp+static_cast<std::size_t>(n));
-		for(;;){
-			std::size_t pos=buf.find('\n');
-			if(pos==std::string::npos)break;
-			std::string line=buf.substr(0,pos);
-			buf.erase(0,pos+1);
-			tui_.onServerLine(line);
+		const std::size_t len=static_cast<std::size_t>(n);
+		std::size_t off=0;
+		while(off<len){
+			if(binary){
+				off+=frames.feed(tmp+off,len-off,[&](FrameBuffer::Event ev,BinOp op,std::string_view payload){
+					if(ev==FrameBuffer::Event::Frame)showReply(decodeBinReply(op,payload));
+					return true;
+				});
+				continue;
+			}
+			off+=lines.feed(tmp+off,len-off,[&](LineBuffer::Event ev,std::string_view line){
+				if(ev!=LineBuffer::Event::Line)return true;
+				tui_.onServerLine(std::string(line));
+				if(!handshake)return true;
+				// the reply to PROTO BIN is the first OK/ERR line
+				if(line.starts_with("OK ")){
+					handshake=false;
+					binary=true;
+					finishHandshake(true);
+					return false;
+				}
+				if(line.starts_with("ERR")){
+					handshake=false;
+					finishHandshake(false);
+				}
+				return true;
+			});
 		}
 	}
 	running_=false;
@@ -3,8 +3,10 @@
 
 #include <atomic>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <mutex>
+#include <vector>
 
 namespace qchat {
 
@@ -12,7 +14,8 @@ class Tui;
 
 class Client {
 public:
-	Client(const std::string &host,unsigned short port,Tui &tui);
+	// binary: negotiate the framed protocol (PROTO BIN) after connecting
+	Client(const std::string &host,unsigned short port,Tui &tui,bool binary=false);
 	~Client();
 
 	bool connectToServer();
@@ -30,7 +33,19 @@ private:
 	Tui &tui_;
 	std::mutex sendMutex_;
 
+	enum class Mode {
+		Text,
+		Handshake, // PROTO BIN sent, lines held in pending_ until it is answered
+		Binary
+	};
+	bool wantBinary_;
+	Mode mode_;                        // guarded by sendMutex_
+	std::vector<std::string> pending_; // guarded by sendMutex_
+
 	void recvLoop();
+	void finishHandshake(bool accepted);
+	bool sendLocked(const std::string &line);
+	static std::string encodeRequest(std::string_view line);
 	static bool sendAll(int fd,const char *data,std::size_t len);
 };
 
@@ -12,8 +12,18 @@ int main(int argc,char **argv) {
 	if(argc>=3){
 		port=static_cast<unsigned short>(std::stoi(argv[2]));
 	}
+	bool binary=false;
+	if(argc>=4){
+		std::string proto=argv[3];
+		if(proto=="bin"){
+			binary=true;
+		}else if(proto!="text"){
+			std::cerr<<"Unknown protocol '"<<proto<<"' (expected text or bin)\n";
+			return 1;
+		}
+	}
 	qchat::Tui tui;
-	qchat::Client client(host,port,tui);
+	qchat::Client client(host,port,tui,binary);
 	tui.setClient(&client);
 	client.start();
 	tui.runMainLoop();
@@ -0,0 +1,168 @@
+// Durable signup throughput and latency against the group-commit window,
+// printed as one JSON object:
+//
+//   commit_bench [--dir PATH] [--threads N] [--ms N] > before.json
+//
+// Each row opens a fresh journal in --dir (default ".", so run it on the
+// filesystem the server uses; tmpfs makes fdatasync free). --threads
+// appenders each loop the way a signup does: take the DB lock, append a
+// UserCreated record, drop the lock, then wait until the record is durable.
+// Latency is from taking the lock to seeing the record durable.
+//
+// write_through  no group commit: each record written as it is made and
+//                never synced, as before group commit (not durable); the
+//                server's --commit-window=off
+// group          the server's committer at --commit-window=window_us,
+//                --commit-batch left at its default of 256. Window 0 syncs
+//                as soon as the committer is free, so it still batches
+//                whatever arrived during the previous sync.
+
+#include "bench_common.hpp"
+#include "journal.hpp"
+#include "user_store.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+using bench::Clock;
+using qchat::u64;
+
+struct Mode {
+	const char *name;
+	bool grouped;
+	std::size_t windowUs;
+	std::size_t maxRecords;
+};
+
+struct Result {
+	std::size_t signups{0};
+	double seconds{0};
+	std::vector<double> latencyUs;
+	qchat::JournalCommitStats stats;
+};
+
+bool run(const std::string &path,const Mode &mode,std::size_t threads,double ms,Result &out) {
+	::unlink(path.c_str());
+	::unlink((path+".next").c_str());
+	qchat::DbState state;
+	qchat::Journal journal(path);
+	if(!journal.open(state))return false;
+
+	std::mutex dbMutex;
+	std::mutex durableMutex;
+	std::condition_variable durableCv;
+	if(mode.grouped){
+		journal.startGroupCommit(std::chrono::microseconds(mode.windowUs),mode.maxRecords,[&](u64){
+			std::lock_guard<std::mutex> lock(durableMutex);
+			durableCv.notify_all();
+		});
+	}
+
+	std::vector<std::vector<double>> latency(threads);
+	std::vector<std::thread> workers;
+	const auto t0=Clock::now();
+	const auto deadline=t0+std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double,std::milli>(ms));
+	std::atomic<bool> failed{false};
+	for(std::size_t t=0;t<threads;++t){
+		workers.emplace_back([&,t]{
+			qchat::UserAuth auth;
+			const std::string name="Bench User";
+			while(Clock::now()<deadline){
+				const auto started=Clock::now();
+				u64 seq=0;
+				{
+					std::lock_guard<std::mutex> lock(dbMutex);
+					auth.uid=state.nextUid++;
+					auth.handle="user"+std::to_string(auth.uid);
+					if(!journal.userCreated(auth,name)){
+						failed.store(true);
+						return;
+					}
+					seq=journal.lastSeq();
+				}
+				{
+					std::unique_lock<std::mutex> lock(durableMutex);
+					durableCv.wait(lock,[&]{return journal.durableSeq()>=seq;});
+				}
+				latency[t].push_back(bench::nsSince(started)/1e3);
+			}
+		});
+	}
+	for(std::thread &w:workers)w.join();
+	out.seconds=bench::nsSince(t0)/1e9;
+	out.stats=journal.commitStats();
+	out.latencyUs.clear();
+	for(auto &l:latency)out.latencyUs.insert(out.latencyUs.end(),l.begin(),l.end());
+	out.signups=out.latencyUs.size();
+	return !failed.load();
+}
+
+} // namespace
+
+int main(int argc,char **argv) {
+	std::string dir=".";
+	std::size_t threads=16;
+	double ms=2000;
+	for(int i=1;i<argc;++i){
+		const std::string arg=argv[i];
+		if(arg=="--dir" && i+1<argc){
+			dir=argv[++i];
+		}else if(arg=="--threads" && i+1<argc){
+			threads=std::strtoull(argv[++i],nullptr,10);
+		}else if(arg=="--ms" && i+1<argc){
+			ms=std::strtod(argv[++i],nullptr);
+		}else{
+			std::fprintf(stderr,"Usage: %s [--dir PATH] [--threads N] [--ms N]\n",argv[0]);
+			return 1;
+		}
+	}
+	if(threads==0)threads=1;
+	const std::string path=dir+"/commit_bench.journal";
+
+	static constexpr Mode MODES[]={
+		{"write_through",false,0,0},
+		{"group",true,0,256},
+		{"group",true,250,256},
+		{"group",true,1000,256},
+		{"group",true,2000,256},
+		{"group",true,5000,256},
+	};
+
+	std::printf("{\n  \"optimized\": %s,\n  \"compiler\": \"%s\",\n  \"threads\": %zu,\n",
+		bench::OPTIMIZED?"true":"false",__VERSION__,threads);
+	std::printf("  \"commit\": [");
+	bool first=true;
+	int status=0;
+	for(const Mode &mode:MODES){
+		Result r;
+		if(!run(path,mode,threads,ms,r)){
+			std::fprintf(stderr,"journal at %s failed\n",path.c_str());
+			status=1;
+			break;
+		}
+		const double perBatch=r.stats.batches>0?static_cast<double>(r.stats.records)/static_cast<double>(r.stats.batches):0;
+		const std::string window=mode.grouped?std::to_string(mode.windowUs):"\"off\"";
+		std::printf("%s\n    {\"mode\": \"%s\", \"window_us\": %s, \"signups\": %zu, \"signups_s\": %.0f, "
+			"\"p50_us\": %.0f, \"p99_us\": %.0f, \"records_per_sync\": %.1f, \"sync_avg_us\": %llu}",
+			first?"":",",mode.name,window.c_str(),r.signups,static_cast<double>(r.signups)/r.seconds,
+			bench::quantile(r.latencyUs,0.5),bench::quantile(r.latencyUs,0.99),perBatch,
+			static_cast<unsigned long long>(r.stats.syncAvgUs));
+		first=false;
+		std::fflush(stdout);
+	}
+	std::printf("\n  ]\n}\n");
+	::unlink(path.c_str());
+	::unlink((path+".next").c_str());
+	return status;
+}
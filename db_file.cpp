@@ -0,0 +1,460 @@
+#include "db_file.hpp"
+#include "user_store.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace qchat {
+
+namespace {
+
+template<class T>
+T loadLe(const char *p) {
+	T v;
+	std::memcpy(&v,p,sizeof(v));
+	if constexpr(std::endian::native==std::endian::big)v=std::byteswap(v);
+	return v;
+}
+
+template<class T>
+void storeLe(char *p,T v) {
+	if constexpr(std::endian::native==std::endian::big)v=std::byteswap(v);
+	std::memcpy(p,&v,sizeof(v));
+}
+
+constexpr u64 align8(u64 n) {
+	return (n+7u)&~u64{7};
+}
+
+// true if [off,off+count*size) lies inside a file of fileSize bytes
+bool sectionFits(u64 off,u64 count,u64 size,u64 fileSize) {
+	if(off>fileSize || (off&7u)!=0)return false;
+	if(count!=0 && size>(fileSize-off)/count)return false;
+	return true;
+}
+
+bool writeDurably(const std::string &path,const std::string &bytes) {
+	int fd=::open(path.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0644);
+	if(fd<0)return false;
+	std::size_t off=0;
+	while(off<bytes.size()){
+		ssize_t n=::write(fd,bytes.data()+off,bytes.size()-off);
+		if(n<0){
+			if(errno==EINTR)continue;
+			::close(fd);
+			return false;
+		}
+		off+=static_cast<std::size_t>(n);
+	}
+	const bool synced=::fsync(fd)==0;
+	return ::close(fd)==0 && synced;
+}
+
+// makes a rename in the directory durable
+bool syncParentDir(const std::string &path) {
+	const std::size_t slash=path.find_last_of('/');
+	const std::string dir=(slash==std::string::npos)?std::string("."):(slash==0?std::string("/"):path.substr(0,slash));
+	int fd=::open(dir.c_str(),O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if(fd<0)return false;
+	const bool synced=::fsync(fd)==0;
+	::close(fd);
+	return synced;
+}
+
+bool readString(std::ifstream &in,std::string &s) {
+	u64 len=0;
+	in.read(reinterpret_cast<char*>(&len),sizeof(len));
+	if(!in.good())return false;
+	if(len>1024u*1024u)return false; // sanity limit 1MB
+	s.clear();
+	if(len==0u)return true;
+	s.resize(static_cast<std::size_t>(len));
+	in.read(&s[0],static_cast<std::streamsize>(len));
+	if(!in.good())return false;
+	return true;
+}
+
+} // namespace
+
+u64 snap::handleHash(std::string_view handle) {
+	u64 h=1469598103934665603ull; // FNV-1a 64
+	for(char c:handle){
+		h^=static_cast<unsigned char>(c);
+		h*=1099511628211ull;
+	}
+	return h;
+}
+
+SnapshotView::~SnapshotView() {
+	unmap();
+}
+
+SnapshotView::SnapshotView(SnapshotView &&other) noexcept {
+	*this=std::move(other);
+}
+
+SnapshotView &SnapshotView::operator=(SnapshotView &&other) noexcept {
+	if(this!=&other){
+		unmap();
+		base_=std::exchange(other.base_,nullptr);
+		size_=std::exchange(other.size_,0);
+		version_=other.version_;
+		userSize_=other.userSize_;
+		userCount_=std::exchange(other.userCount_,0);
+		users_=other.users_;
+		history_=other.history_;
+		historyCount_=other.historyCount_;
+		index_=other.index_;
+		indexSlots_=other.indexSlots_;
+		pool_=other.pool_;
+		poolSize_=other.poolSize_;
+	}
+	return *this;
+}
+
+void SnapshotView::unmap() {
+	if(base_!=nullptr)::munmap(const_cast<char*>(base_),size_);
+	base_=nullptr;
+	size_=0;
+	userCount_=0;
+}
+
+bool SnapshotView::open(const std::string &path) {
+	unmap();
+	int fd=::open(path.c_str(),O_RDONLY|O_CLOEXEC);
+	if(fd<0)return false;
+	struct stat st{};
+	if(::fstat(fd,&st)<0 || static_cast<u64>(st.st_size)<snap::HEADER_SIZE){
+		::close(fd);
+		return false;
+	}
+	const std::size_t size=static_cast<std::size_t>(st.st_size);
+	void *p=::mmap(nullptr,size,PROT_READ,MAP_PRIVATE,fd,0);
+	::close(fd);
+	if(p==MAP_FAILED)return false;
+	base_=static_cast<const char*>(p);
+	size_=size;
+
+	const u64 users=loadLe<u64>(base_+snap::H_USER_COUNT);
+	const u64 usersOff=loadLe<u64>(base_+snap::H_USERS_OFF);
+	const u64 historyOff=loadLe<u64>(base_+snap::H_HISTORY_OFF);
+	const u64 historyCount=loadLe<u64>(base_+snap::H_HISTORY_COUNT);
+	const u64 indexOff=loadLe<u64>(base_+snap::H_INDEX_OFF);
+	const u64 indexSlots=loadLe<u64>(base_+snap::H_INDEX_SLOTS);
+	const u64 poolOff=loadLe<u64>(base_+snap::H_POOL_OFF);
+	const u64 poolSize=loadLe<u64>(base_+snap::H_POOL_SIZE);
+	const u64 version=loadLe<u64>(base_+snap::H_VERSION);
+	const std::size_t userSize=version<5?snap::USER4_SIZE:snap::USER_SIZE;
+	const bool ok=std::memcmp(base_,"QCHATDB",7)==0
+		&& version>=3 && version<=snap::VERSION && base_[7]==static_cast<char>('0'+version)
+		&& loadLe<u64>(base_+snap::H_FILE_SIZE)==size
+		&& sectionFits(usersOff,users,userSize,size)
+		&& sectionFits(historyOff,historyCount,snap::HISTORY_SIZE,size)
+		&& sectionFits(indexOff,indexSlots,sizeof(u64),size)
+		&& sectionFits(poolOff,poolSize,1,size)
+		&& std::has_single_bit(indexSlots) && indexSlots>users && users<0xFFFFFFFFu;
+	if(!ok){
+		unmap();
+		return false;
+	}
+	version_=version;
+	userSize_=userSize;
+	userCount_=static_cast<std::size_t>(users);
+	users_=base_+usersOff;
+	history_=base_+historyOff;
+	historyCount_=static_cast<std::size_t>(historyCount);
+	index_=base_+indexOff;
+	indexSlots_=static_cast<std::size_t>(indexSlots);
+	pool_=base_+poolOff;
+	poolSize_=static_cast<std::size_t>(poolSize);
+	// findUid() binary-searches and UserStore sizes its columns from the
+	// last uid, so the records must be in strictly ascending uid order
+	u64 prev=0;
+	for(std::size_t i=0;i<userCount_;++i){
+		const u64 id=uid(i);
+		if(id<=prev || (version_>=5 && !passwordHash(i).params.valid())){
+			unmap();
+			return false;
+		}
+		prev=id;
+	}
+	return true;
+}
+
+u64 SnapshotView::nextUid() const {
+	return loadLe<u64>(base_+snap::H_NEXT_UID);
+}
+
+u64 SnapshotView::journalSeq() const {
+	return loadLe<u64>(base_+snap::H_JOURNAL_SEQ);
+}
+
+std::optional<std::size_t> SnapshotView::findHandle(std::string_view h) const {
+	const u64 hv=snap::handleHash(h);
+	const u64 mask=indexSlots_-1;
+	u64 slot=hv&mask;
+	for(std::size_t probes=0;probes<indexSlots_;++probes){
+		const u64 e=loadLe<u64>(index_+slot*sizeof(u64));
+		if(e==0)return std::nullopt;
+		const std::size_t idx=static_cast<std::size_t>(e&0xFFFFFFFFu)-1;
+		if((e>>32)==(hv>>32) && idx<userCount_ && handle(idx)==h)return idx;
+		slot=(slot+1)&mask;
+	}
+	return std::nullopt;
+}
+
+std::optional<std::size_t> SnapshotView::findUid(u64 id) const {
+	std::size_t lo=0;
+	std::size_t hi=userCount_;
+	while(lo<hi){
+		const std::size_t mid=lo+(hi-lo)/2;
+		if(uid(mid)<id){
+			lo=mid+1;
+		}else{
+			hi=mid;
+		}
+	}
+	if(lo<userCount_ && uid(lo)==id)return lo;
+	return std::nullopt;
+}
+
+std::string_view SnapshotView::poolString(u64 off,u64 len) const {
+	if(off>poolSize_ || len>poolSize_-off)return std::string_view();
+	return std::string_view(pool_+off,static_cast<std::size_t>(len));
+}
+
+u64 SnapshotView::uid(std::size_t i) const {
+	return loadLe<u64>(user(i)+snap::U_UID);
+}
+
+std::string_view SnapshotView::handle(std::size_t i) const {
+	const char *r=user(i);
+	return poolString(loadLe<u64>(r+snap::U_HANDLE_OFF),loadLe<std::uint32_t>(r+snap::U_HANDLE_LEN));
+}
+
+std::string_view SnapshotView::displayName(std::size_t i) const {
+	const char *r=user(i);
+	return poolString(loadLe<u64>(r+snap::U_DISPLAY_OFF),loadLe<std::uint32_t>(r+snap::U_DISPLAY_LEN));
+}
+
+PasswordHash SnapshotView::passwordHash(std::size_t i) const {
+	const char *r=user(i);
+	PasswordHash h;
+	std::memcpy(h.digest.data(),r+snap::U_HASH,h.digest.size());
+	if(version_>=5){
+		h.params.kind=static_cast<KdfParams::Kind>(r[snap::U_KDF]);
+		h.params.memLog2=static_cast<u8>(r[snap::U_KDF_MEM]);
+		h.params.passes=static_cast<u8>(r[snap::U_KDF_PASSES]);
+		std::memcpy(h.salt.data(),r+snap::U_SALT,h.salt.size());
+	}
+	return h;
+}
+
+bool SnapshotView::allowMultiLogin(std::size_t i) const {
+	return (static_cast<u8>(user(i)[snap::U_FLAGS])&1u)!=0;
+}
+
+std::size_t SnapshotView::historyCount(std::size_t i) const {
+	const char *r=user(i);
+	const u64 first=loadLe<u64>(r+snap::U_HISTORY_FIRST);
+	const u64 n=loadLe<std::uint32_t>(r+snap::U_HISTORY_COUNT);
+	if(first>historyCount_ || n>historyCount_-first)return 0;
+	return static_cast<std::size_t>(n);
+}
+
+LoginRecord SnapshotView::history(std::size_t i,std::size_t k) const {
+	const u64 first=loadLe<u64>(user(i)+snap::U_HISTORY_FIRST);
+	const char *r=history_+(first+k)*snap::HISTORY_SIZE;
+	LoginRecord rec;
+	rec.epochSeconds=loadLe<u64>(r+snap::R_EPOCH);
+	if(version_==3){
+		rec.ip=parseIp(poolString(loadLe<u64>(r+snap::R3_IP_OFF),loadLe<std::uint32_t>(r+snap::R3_IP_LEN)));
+	}else{
+		std::memcpy(rec.ip.data(),r+snap::R_IP,rec.ip.size());
+	}
+	return rec;
+}
+
+bool DbFile::load(DbState &state) {
+	char magic[8]={};
+	{
+		std::ifstream in(path_,std::ios::binary);
+		if(!in.good())return true; // treat as empty DB
+		in.read(magic,8);
+		if(!in.good())return false;
+	}
+	if(std::memcmp(magic,"QCHATDB",7)!=0 || magic[7]<'3' || magic[7]>'5')return loadLegacy(state);
+
+	SnapshotView view;
+	if(!view.open(path_))return false;
+	state.nextUid=view.nextUid();
+	state.journalSeq=view.journalSeq();
+	state.users.attach(std::move(view));
+	return true;
+}
+
+bool DbFile::loadLegacy(DbState &state) {
+	std::ifstream in(path_,std::ios::binary);
+	if(!in.good())return true;
+	char magic[8];
+	in.read(magic,8);
+	if(!in.good())return false;
+	if(std::memcmp(magic,"QCHATDB",7)!=0)return false;
+	if(magic[7]!='1' && magic[7]!='2')return false;
+	u64 nextUid=0;
+	in.read(reinterpret_cast<char*>(&nextUid),sizeof(nextUid));
+	if(!in.good())return false;
+	state.nextUid=nextUid;
+	state.journalSeq=0;
+	if(magic[7]=='2'){
+		in.read(reinterpret_cast<char*>(&state.journalSeq),sizeof(state.journalSeq));
+		if(!in.good())return false;
+	}
+
+	u64 userCount=0;
+	in.read(reinterpret_cast<char*>(&userCount),sizeof(userCount));
+	if(!in.good())return false;
+
+	// everything lands as dirty and is written out by the next snapshot
+	state.users.attach(SnapshotView());
+
+	for(u64 idx=0;idx<userCount;++idx){
+		UserAuth a;
+		UserProfile p;
+		if(!readString(in,a.handle))return false;
+		if(!readString(in,p.displayName))return false;
+		in.read(reinterpret_cast<char*>(&a.uid),sizeof(a.uid));
+		if(!in.good() || a.uid==0)return false;
+		u8 multi=0;
+		in.read(reinterpret_cast<char*>(&multi),sizeof(multi));
+		if(!in.good())return false;
+		a.allowMultiLogin=(multi!=0u);
+		in.read(reinterpret_cast<char*>(a.passwordHash.digest.data()),a.passwordHash.digest.size());
+		if(!in.good())return false;
+
+		u64 histCount=0;
+		in.read(reinterpret_cast<char*>(&histCount),sizeof(histCount));
+		if(!in.good())return false;
+		for(u64 hi=0;hi<histCount;++hi){
+			LoginRecord rec{};
+			std::string ip;
+			in.read(reinterpret_cast<char*>(&rec.epochSeconds),sizeof(rec.epochSeconds));
+			if(!in.good())return false;
+			if(!readString(in,ip))return false;
+			rec.ip=parseIp(ip);
+			p.history.push(rec);
+		}
+		state.users.add(std::move(a),std::move(p),0);
+	}
+	return true;
+}
+
+std::string DbFile::encode(const DbState &state) {
+	DbImage image;
+	image.nextUid=state.nextUid;
+	image.journalSeq=state.journalSeq;
+	state.users.freeze(image);
+	return encode(image);
+}
+
+std::string DbFile::encode(const DbImage &image) {
+	const std::vector<u64> &users=image.uids;
+	std::vector<UserStore::ProfileRef> profiles;
+	profiles.reserve(users.size());
+	std::size_t historyCount=0;
+	u64 poolSize=0;
+	for(std::size_t i=0;i<users.size();++i){
+		profiles.push_back(image.profileRef(users[i]));
+		const UserStore::ProfileRef &p=profiles.back();
+		historyCount+=p.historyCount();
+		poolSize+=image.handles[i].size()+p.displayName().size();
+	}
+	u64 slots=16;
+	while(slots<2*users.size())slots<<=1;
+
+	const u64 usersOff=snap::HEADER_SIZE;
+	const u64 historyOff=usersOff+users.size()*snap::USER_SIZE;
+	const u64 indexOff=historyOff+historyCount*snap::HISTORY_SIZE;
+	const u64 poolOff=indexOff+slots*sizeof(u64);
+	const u64 fileSize=align8(poolOff+poolSize);
+
+	std::string out(static_cast<std::size_t>(fileSize),'\0');
+	char *p=out.data();
+	std::memcpy(p,"QCHATDB5",8);
+	storeLe(p+snap::H_VERSION,snap::VERSION);
+	storeLe(p+snap::H_FILE_SIZE,fileSize);
+	storeLe(p+snap::H_NEXT_UID,image.nextUid);
+	storeLe(p+snap::H_JOURNAL_SEQ,image.journalSeq);
+	storeLe(p+snap::H_USER_COUNT,static_cast<u64>(users.size()));
+	storeLe(p+snap::H_USERS_OFF,usersOff);
+	storeLe(p+snap::H_HISTORY_OFF,historyOff);
+	storeLe(p+snap::H_HISTORY_COUNT,static_cast<u64>(historyCount));
+	storeLe(p+snap::H_INDEX_OFF,indexOff);
+	storeLe(p+snap::H_INDEX_SLOTS,slots);
+	storeLe(p+snap::H_POOL_OFF,poolOff);
+	storeLe(p+snap::H_POOL_SIZE,poolSize);
+
+	u64 poolUsed=0;
+	auto addString=[&](std::string_view s){
+		const u64 off=poolUsed;
+		if(!s.empty())std::memcpy(p+poolOff+poolUsed,s.data(),s.size());
+		poolUsed+=s.size();
+		return off;
+	};
+	u64 nextHistory=0;
+	for(std::size_t i=0;i<users.size();++i){
+		const u64 uid=users[i];
+		const std::string_view handle=image.handles[i];
+		const PasswordHash &hash=image.hashes[i];
+		const UserStore::ProfileRef &prof=profiles[i];
+		const std::string_view display=prof.displayName();
+		const std::size_t hist=prof.historyCount();
+		char *r=p+usersOff+i*snap::USER_SIZE;
+		storeLe(r+snap::U_UID,uid);
+		storeLe(r+snap::U_HANDLE_OFF,addString(handle));
+		storeLe(r+snap::U_HANDLE_LEN,static_cast<std::uint32_t>(handle.size()));
+		storeLe(r+snap::U_DISPLAY_OFF,addString(display));
+		storeLe(r+snap::U_DISPLAY_LEN,static_cast<std::uint32_t>(display.size()));
+		std::memcpy(r+snap::U_HASH,hash.digest.data(),hash.digest.size());
+		storeLe(r+snap::U_HISTORY_FIRST,nextHistory);
+		storeLe(r+snap::U_HISTORY_COUNT,static_cast<std::uint32_t>(hist));
+		r[snap::U_FLAGS]=static_cast<char>(image.multiLogin[i]);
+		r[snap::U_KDF]=static_cast<char>(hash.params.kind);
+		r[snap::U_KDF_MEM]=static_cast<char>(hash.params.memLog2);
+		r[snap::U_KDF_PASSES]=static_cast<char>(hash.params.passes);
+		std::memcpy(r+snap::U_SALT,hash.salt.data(),hash.salt.size());
+		for(std::size_t k=0;k<hist;++k){
+			const LoginRecord rec=prof.history(k);
+			char *h=p+historyOff+nextHistory*snap::HISTORY_SIZE;
+			storeLe(h+snap::R_EPOCH,rec.epochSeconds);
+			std::memcpy(h+snap::R_IP,rec.ip.data(),rec.ip.size());
+			++nextHistory;
+		}
+
+		const u64 hv=snap::handleHash(handle);
+		u64 slot=hv&(slots-1);
+		while(loadLe<u64>(p+indexOff+slot*sizeof(u64))!=0)slot=(slot+1)&(slots-1);
+		storeLe(p+indexOff+slot*sizeof(u64),((hv>>32)<<32)|static_cast<u64>(i+1));
+	}
+	return out;
+}
+
+bool DbFile::saveEncoded(const std::string &bytes) {
+	const std::string tmpPath=path_+".tmp";
+	if(!writeDurably(tmpPath,bytes))return false;
+	if(std::rename(tmpPath.c_str(),path_.c_str())!=0)return false;
+	return syncParentDir(path_);
+}
+
+} // namespace qchat
@@ -0,0 +1,166 @@
+#ifndef QCHAT_DB_FILE_HPP
+#define QCHAT_DB_FILE_HPP
+
+#include "chat_common.hpp"
+#include "password_kdf.hpp"
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace qchat {
+
+struct DbState;
+struct DbImage;
+
+// QCHATDB5 snapshot, laid out to be mmapped and read in place. Every integer
+// is little-endian; sections are 8-byte aligned.
+//
+//   header     HEADER_SIZE bytes at the H_* offsets below
+//   users      userCount fixed-size records sorted by uid
+//   history    login records, each user's run contiguous
+//   index      open-addressed handle table: u64 slots, 0 = empty, else
+//              (FNV-1a(handle) high 32 bits << 32) | (user index + 1)
+//   pool       handle and display name bytes, referenced by offset
+//
+// QCHATDB4 differs only in its user records, which are USER4_SIZE bytes and
+// end at the flags: every hash in it is unsalted SHA3. QCHATDB3 also keeps
+// the ip of history records as text in the pool. Both are still read.
+//
+// Nothing is parsed at open beyond the header; lookups by handle probe the
+// stored index and lookups by uid binary-search the user records.
+namespace snap {
+
+constexpr std::size_t HEADER_SIZE=128;
+constexpr std::size_t USER_SIZE=128;
+constexpr std::size_t USER4_SIZE=112;    // QCHATDB3/4
+constexpr std::size_t HISTORY_SIZE=24;
+constexpr u64 VERSION=5;
+
+// header field offsets
+constexpr std::size_t H_VERSION=8;
+constexpr std::size_t H_FILE_SIZE=16;
+constexpr std::size_t H_NEXT_UID=24;
+constexpr std::size_t H_JOURNAL_SEQ=32;
+constexpr std::size_t H_USER_COUNT=40;
+constexpr std::size_t H_USERS_OFF=48;
+constexpr std::size_t H_HISTORY_OFF=56;
+constexpr std::size_t H_HISTORY_COUNT=64;
+constexpr std::size_t H_INDEX_OFF=72;
+constexpr std::size_t H_INDEX_SLOTS=80;
+constexpr std::size_t H_POOL_OFF=88;
+constexpr std::size_t H_POOL_SIZE=96;
+
+// user record field offsets
+constexpr std::size_t U_UID=0;
+constexpr std::size_t U_HANDLE_OFF=8;
+constexpr std::size_t U_DISPLAY_OFF=16;
+constexpr std::size_t U_HANDLE_LEN=24;   // u32
+constexpr std::size_t U_DISPLAY_LEN=28;  // u32
+constexpr std::size_t U_HASH=32;         // 64 bytes, the digest
+constexpr std::size_t U_HISTORY_FIRST=96;
+constexpr std::size_t U_HISTORY_COUNT=104; // u32
+constexpr std::size_t U_FLAGS=108;       // u8, bit 0 = multi-login
+constexpr std::size_t U_KDF=109;         // u8, KdfParams::Kind
+constexpr std::size_t U_KDF_MEM=110;     // u8, KdfParams::memLog2
+constexpr std::size_t U_KDF_PASSES=111;  // u8
+constexpr std::size_t U_SALT=112;        // KDF_SALT_SIZE bytes
+
+// history record field offsets
+constexpr std::size_t R_EPOCH=0;
+constexpr std::size_t R_IP=8;            // 16 bytes, IpAddr
+constexpr std::size_t R3_IP_OFF=8;       // QCHATDB3: ip text in the pool
+constexpr std::size_t R3_IP_LEN=16;      // u32
+
+u64 handleHash(std::string_view handle);
+
+} // namespace snap
+
+// Read-only mapping of a QCHATDB3/4/5 file. Accessors take a user index in
+// [0,userCount()); strings point into the mapping and live as long as it.
+class SnapshotView {
+public:
+	SnapshotView()=default;
+	~SnapshotView();
+	SnapshotView(SnapshotView &&other) noexcept;
+	SnapshotView &operator=(SnapshotView &&other) noexcept;
+	SnapshotView(const SnapshotView&)=delete;
+	SnapshotView &operator=(const SnapshotView&)=delete;
+
+	// Maps path and checks the header, section bounds, that uids are
+	// strictly ascending from 1 and the KDF settings of every user.
+	bool open(const std::string &path);
+	bool isOpen() const {return base_!=nullptr;}
+
+	u64 nextUid() const;
+	u64 journalSeq() const;
+	std::size_t userCount() const {return userCount_;}
+
+	std::optional<std::size_t> findHandle(std::string_view handle) const;
+	std::optional<std::size_t> findUid(u64 uid) const;
+
+	u64 uid(std::size_t i) const;
+	std::string_view handle(std::size_t i) const;
+	std::string_view displayName(std::size_t i) const;
+	PasswordHash passwordHash(std::size_t i) const;
+	bool allowMultiLogin(std::size_t i) const;
+	std::size_t historyCount(std::size_t i) const;
+	LoginRecord history(std::size_t i,std::size_t k) const;
+
+private:
+	const char *base_{nullptr};
+	std::size_t size_{0};
+	u64 version_{0};
+	std::size_t userSize_{snap::USER_SIZE};
+	std::size_t userCount_{0};
+	const char *users_{nullptr};
+	const char *history_{nullptr};
+	std::size_t historyCount_{0};
+	const char *index_{nullptr};
+	std::size_t indexSlots_{0};
+	const char *pool_{nullptr};
+	std::size_t poolSize_{0};
+
+	const char *user(std::size_t i) const {return users_+i*userSize_;}
+	std::string_view poolString(u64 off,u64 len) const;
+	void unmap();
+};
+
+// Snapshot file. Saves write QCHATDB5; loads also accept QCHATDB3/4 and the older
+// stream-of-fields QCHATDB1/2 (local-endian). Saves go to a temporary file
+// that is synced and renamed over the old one, so a crash never leaves a
+// half-written snapshot.
+class DbFile {
+public:
+	explicit DbFile(const std::string &path):path_(path) {}
+
+	// A QCHATDB3/4/5 file stays mapped and backs state.users; older formats are
+	// read into memory.
+	bool load(DbState &state);
+	// Maps the file as written by the last save.
+	bool open(SnapshotView &view) const {return view.open(path_);}
+
+	bool save(const DbState &state) {
+		return saveEncoded(encode(state));
+	}
+
+	// Serialises state in snapshot format.
+	static std::string encode(const DbState &state);
+	// The same from a frozen copy, with no DB lock held; profiles still in
+	// the old snapshot may be paged in from disk here.
+	static std::string encode(const DbImage &image);
+
+	// Writes an encoded snapshot to a temp file, syncs it and renames it over
+	// the old one, so a crash leaves either the old or the new snapshot.
+	bool saveEncoded(const std::string &bytes);
+
+private:
+	std::string path_;
+
+	bool loadLegacy(DbState &state);
+};
+
+} // namespace qchat
+
+#endif
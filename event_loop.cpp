@@ -0,0 +1,353 @@
+#include "event_loop.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cerrno>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <unistd.h>
+
+namespace qchat {
+
+bool parseIoBackend(const std::string &name,IoBackend &out) {
+	if(name=="epoll"){
+		out=IoBackend::Epoll;
+		return true;
+	}
+	if(name=="uring" || name=="io_uring"){
+		out=IoBackend::Uring;
+		return true;
+	}
+	return false;
+}
+
+namespace {
+
+class EpollLoop final : public EventLoop {
+public:
+	explicit EpollLoop(Handler &handler):handler_(handler) {}
+
+	~EpollLoop() override {
+		if(epollFd_>=0)::close(epollFd_);
+	}
+
+	const char *name() const override {return "epoll";}
+
+	bool init(int listenFd) override {
+		listenFd_=listenFd;
+		epollFd_=::epoll_create1(EPOLL_CLOEXEC);
+		if(epollFd_<0){
+			std::perror("epoll_create1");
+			return false;
+		}
+		epoll_event ev{};
+		ev.events=EPOLLIN;
+		ev.data.fd=listenFd_;
+		if(::epoll_ctl(epollFd_,EPOLL_CTL_ADD,listenFd_,&ev)<0){
+			std::perror("epoll_ctl");
+			return false;
+		}
+		return true;
+	}
+
+	bool addNotifier(int fd) override {
+		epoll_event ev{};
+		ev.events=EPOLLIN;
+		ev.data.fd=fd;
+		if(::epoll_ctl(epollFd_,EPOLL_CTL_ADD,fd,&ev)<0){
+			std::perror("epoll_ctl");
+			return false;
+		}
+		notifiers_.push_back(fd);
+		return true;
+	}
+
+	bool addClient(int fd,OutQueue &out) override {
+		// EPOLLOUT is edge-triggered too, so it only fires when a full
+		// socket buffer drains and costs nothing while we keep up.
+		epoll_event ev{};
+		ev.events=EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET;
+		ev.data.fd=fd;
+		if(::epoll_ctl(epollFd_,EPOLL_CTL_ADD,fd,&ev)<0){
+			std::perror("epoll_ctl");
+			return false;
+		}
+		if(slots_.size()<=static_cast<std::size_t>(fd))slots_.resize(static_cast<std::size_t>(fd)+1);
+		Slot &sl=slots_[static_cast<std::size_t>(fd)];
+		sl=Slot{};
+		sl.out=&out;
+		return true;
+	}
+
+	void removeClient(int fd) override {
+		if(!isLive(fd))return;
+		Slot &sl=slots_[static_cast<std::size_t>(fd)];
+		sl.out=nullptr;
+		// The kernel may still transmit from zerocopy pages after close(),
+		// and no completion will tell us when it is done. Keep the buffers
+		// alive for a grace period instead.
+		if(!sl.zcInflight.empty()){
+			Orphans o;
+			o.expires=std::chrono::steady_clock::now()+ZC_ORPHAN_GRACE;
+			for(ZcSend &z:sl.zcInflight){
+				for(OutBuf &b:z.pins)o.pins.push_back(std::move(b));
+			}
+			orphans_.push_back(std::move(o));
+			sl.zcInflight.clear();
+		}
+		::epoll_ctl(epollFd_,EPOLL_CTL_DEL,fd,nullptr);
+	}
+
+	void flush(int fd) override {
+		if(!isLive(fd))return;
+		Slot &sl=slots_[static_cast<std::size_t>(fd)];
+		if(sl.pending)return;
+		sl.pending=true;
+		pending_.push_back(fd);
+	}
+
+	void setZeroCopy(std::size_t minBytes) override {zcMin_=minBytes;}
+
+	bool poll(int timeoutMs) override {
+		// sockets left with unread input must not wait for a new edge
+		if(!backlog_.empty())timeoutMs=0;
+		int ret=::epoll_wait(epollFd_,events_.data(),static_cast<int>(events_.size()),timeoutMs);
+		if(ret<0){
+			if(errno==EINTR)return true;
+			std::perror("epoll_wait");
+			return false;
+		}
+		for(int i=0;i<ret;++i){
+			const epoll_event &ev=events_[static_cast<std::size_t>(i)];
+			int fd=ev.data.fd;
+			if(fd==listenFd_){
+				acceptAll();
+				continue;
+			}
+			if(isNotifier(fd)){
+				std::uint64_t cnt=0;
+				if(::read(fd,&cnt,sizeof(cnt))<0 && errno!=EINTR)std::perror("read");
+				handler_.onNotify(fd);
+				continue;
+			}
+			if(!isLive(fd))continue;
+			// EPOLLERR also signals zerocopy completions on the error queue
+			if((ev.events&EPOLLERR) && !reapZeroCopy(fd)){
+				handler_.onHangup(fd);
+				continue;
+			}
+			if(ev.events&(EPOLLIN|EPOLLRDHUP)){
+				drain(fd);
+			}else if(ev.events&EPOLLHUP){
+				handler_.onHangup(fd);
+				continue;
+			}
+			if((ev.events&EPOLLOUT) && isLive(fd))write(fd);
+		}
+		std::vector<int> carried;
+		carried.swap(backlog_);
+		for(int fd:carried){
+			if(isLive(fd))drain(fd);
+		}
+		flushPending();
+		if(!orphans_.empty())expireOrphans();
+		return true;
+	}
+
+private:
+	Handler &handler_;
+	int listenFd_{-1};
+	int epollFd_{-1};
+	std::array<epoll_event,256> events_{};
+	// Buffers handed to one MSG_ZEROCOPY sendmsg, released when the kernel
+	// reports that send's sequence number as complete.
+	struct ZcSend {
+		std::uint32_t seq{0};
+		std::vector<OutBuf> pins;
+	};
+	struct Slot {
+		OutQueue *out{nullptr};
+		bool pending{false};
+		bool zcTried{false};     // SO_ZEROCOPY attempted on this socket
+		bool zc{false};          // ...and accepted
+		std::uint32_t zcNext{0}; // sequence number of the next zerocopy send
+		std::deque<ZcSend> zcInflight;
+	};
+	struct Orphans {
+		std::chrono::steady_clock::time_point expires;
+		std::vector<OutBuf> pins;
+	};
+	static constexpr std::size_t MAX_IOV=64;
+	static constexpr std::chrono::seconds ZC_ORPHAN_GRACE{60};
+	// Input read from one socket per wakeup. A client flooding us gets its
+	// turn again on the next poll(), after everyone's output was flushed.
+	static constexpr std::size_t READ_BUDGET=64*1024;
+
+	std::vector<Slot> slots_;   // indexed by fd
+	std::vector<int> pending_;  // fds with data queued since the last flush
+	std::vector<int> backlog_;  // fds that hit READ_BUDGET before EAGAIN
+	std::vector<int> notifiers_;
+	std::size_t zcMin_{0};
+	std::deque<Orphans> orphans_;
+
+	bool isLive(int fd) const {
+		return fd>=0 && static_cast<std::size_t>(fd)<slots_.size() && slots_[static_cast<std::size_t>(fd)].out!=nullptr;
+	}
+
+	bool isNotifier(int fd) const {
+		for(int n:notifiers_){
+			if(n==fd)return true;
+		}
+		return false;
+	}
+
+	void acceptAll() {
+		for(;;){
+			sockaddr_in addr{};
+			socklen_t alen=sizeof(addr);
+			int fd=::accept4(listenFd_,reinterpret_cast<sockaddr*>(&addr),&alen,SOCK_NONBLOCK|SOCK_CLOEXEC);
+			if(fd<0){
+				if(errno==EINTR)continue;
+				if(errno!=EAGAIN && errno!=EWOULDBLOCK)std::perror("accept");
+				return;
+			}
+			handler_.onAccept(fd,addr);
+		}
+	}
+
+	// Edge-triggered: read until EAGAIN, or remember the socket in backlog_
+	// so the rest is picked up without waiting for another edge.
+	void drain(int fd) {
+		char buf[4096];
+		std::size_t budget=READ_BUDGET;
+		while(isLive(fd)){
+			if(budget==0){
+				backlog_.push_back(fd);
+				return;
+			}
+			ssize_t n=::recv(fd,buf,sizeof(buf),0);
+			if(n<0){
+				if(errno==EINTR)continue;
+				if(errno==EAGAIN || errno==EWOULDBLOCK)return;
+				handler_.onHangup(fd);
+				return;
+			}
+			if(n==0){
+				handler_.onHangup(fd);
+				return;
+			}
+			budget-=(static_cast<std::size_t>(n)<budget)?static_cast<std::size_t>(n):budget;
+			handler_.onData(fd,buf,static_cast<std::size_t>(n));
+		}
+	}
+
+	void flushPending() {
+		// write() may hang up a client, whose handler may queue more output
+		while(!pending_.empty()){
+			std::vector<int> fds;
+			fds.swap(pending_);
+			for(int fd:fds){
+				if(!isLive(fd))continue;
+				slots_[static_cast<std::size_t>(fd)].pending=false;
+				write(fd);
+			}
+		}
+	}
+
+	// Writes as much of the queue as the socket takes; the rest waits for
+	// the next EPOLLOUT edge.
+	void write(int fd) {
+		Slot &sl=slots_[static_cast<std::size_t>(fd)];
+		OutQueue &out=*sl.out;
+		iovec iov[MAX_IOV];
+		OutBuf pins[MAX_IOV];
+		while(!out.empty()){
+			const bool zc=zcMin_>0 && out.bytes()>=zcMin_ && enableZeroCopy(sl,fd);
+			// sendmsg rather than writev: same gather write, but MSG_NOSIGNAL
+			msghdr msg{};
+			msg.msg_iov=iov;
+			msg.msg_iovlen=out.fillIov(iov,MAX_IOV,zc?pins:nullptr);
+			ssize_t r=::sendmsg(fd,&msg,MSG_NOSIGNAL|(zc?MSG_ZEROCOPY:0));
+			if(r<0 && zc && errno==ENOBUFS){
+				// out of optmem for pinned pages; this batch gets copied
+				r=::sendmsg(fd,&msg,MSG_NOSIGNAL);
+			}else if(r>=0 && zc){
+				ZcSend z;
+				z.seq=sl.zcNext++;
+				z.pins.assign(pins,pins+msg.msg_iovlen);
+				sl.zcInflight.push_back(std::move(z));
+			}
+			if(zc){
+				for(std::size_t i=0;i<msg.msg_iovlen;++i)pins[i].reset();
+			}
+			if(r<0){
+				if(errno==EINTR)continue;
+				if(errno==EAGAIN || errno==EWOULDBLOCK)return;
+				handler_.onHangup(fd);
+				return;
+			}
+			out.consume(static_cast<std::size_t>(r));
+		}
+	}
+
+	bool enableZeroCopy(Slot &sl,int fd) {
+		if(!sl.zcTried){
+			sl.zcTried=true;
+			int one=1;
+			sl.zc=::setsockopt(fd,SOL_SOCKET,SO_ZEROCOPY,&one,sizeof(one))==0;
+		}
+		return sl.zc;
+	}
+
+	// Drains zerocopy completions from fd's error queue. Returns false if the
+	// socket has a real error pending.
+	bool reapZeroCopy(int fd) {
+		Slot &sl=slots_[static_cast<std::size_t>(fd)];
+		for(;;){
+			char control[128];
+			msghdr msg{};
+			msg.msg_control=control;
+			msg.msg_controllen=sizeof(control);
+			if(::recvmsg(fd,&msg,MSG_ERRQUEUE|MSG_DONTWAIT)<0){
+				if(errno==EINTR)continue;
+				if(errno!=EAGAIN && errno!=EWOULDBLOCK)return false;
+				int err=0;
+				socklen_t len=sizeof(err);
+				::getsockopt(fd,SOL_SOCKET,SO_ERROR,&err,&len);
+				return err==0;
+			}
+			for(cmsghdr *cm=CMSG_FIRSTHDR(&msg);cm!=nullptr;cm=CMSG_NXTHDR(&msg,cm)){
+				if(!((cm->cmsg_level==SOL_IP && cm->cmsg_type==IP_RECVERR) ||
+					(cm->cmsg_level==SOL_IPV6 && cm->cmsg_type==IPV6_RECVERR)))continue;
+				const auto *ee=reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cm));
+				if(ee->ee_origin!=SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno!=0)return false;
+				// [ee_info, ee_data] is the range of completed sends
+				while(!sl.zcInflight.empty() &&
+					static_cast<std::int32_t>(sl.zcInflight.front().seq-ee->ee_data)<=0){
+					sl.zcInflight.pop_front();
+				}
+			}
+		}
+	}
+
+	void expireOrphans() {
+		const auto now=std::chrono::steady_clock::now();
+		while(!orphans_.empty() && orphans_.front().expires<=now)orphans_.pop_front();
+	}
+};
+
+} // namespace
+
+std::unique_ptr<EventLoop> makeEpollLoop(EventLoop::Handler &handler) {
+	return std::make_unique<EpollLoop>(handler);
+}
+
+} // namespace qchat
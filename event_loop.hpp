@@ -0,0 +1,64 @@
+#ifndef QCHAT_EVENT_LOOP_HPP
+#define QCHAT_EVENT_LOOP_HPP
+
+#include "out_queue.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+struct sockaddr_in;
+
+namespace qchat {
+
+enum class IoBackend {
+	Epoll,
+	Uring
+};
+
+bool parseIoBackend(const std::string &name,IoBackend &out);
+
+// I/O backend driving the server. The loop owns accept/recv/send on the
+// sockets it is given and reports results through a Handler; the server only
+// sees accepted fds, received bytes and hangups.
+class EventLoop {
+public:
+	class Handler {
+	public:
+		virtual ~Handler()=default;
+		virtual void onAccept(int fd,const sockaddr_in &addr)=0;
+		virtual void onData(int fd,const char *data,std::size_t len)=0;
+		virtual void onHangup(int fd)=0;
+		virtual void onNotify(int fd)=0;
+	};
+
+	virtual ~EventLoop()=default;
+
+	virtual const char *name() const=0;
+	virtual bool init(int listenFd)=0;
+	// Watches a blocking eventfd; the loop consumes its counter and then
+	// calls onNotify(fd). Used to wake the reactor from other threads.
+	virtual bool addNotifier(int fd)=0;
+	// out must stay valid until removeClient(fd); the loop drains it into the
+	// socket whenever the socket can take more data.
+	virtual bool addClient(int fd,OutQueue &out)=0;
+	// Stops delivering events for fd; the caller still owns and closes it.
+	virtual void removeClient(int fd)=0;
+	// New data was queued on fd's OutQueue. Writes are batched until the
+	// end of the current poll() so one syscall carries many lines.
+	virtual void flush(int fd)=0;
+	// Sends of at least minBytes use MSG_ZEROCOPY where the backend supports
+	// it; 0 (the default) always copies.
+	virtual void setZeroCopy(std::size_t minBytes)=0;
+	// Waits up to timeoutMs and dispatches whatever became ready.
+	// Returns false on a fatal backend error.
+	virtual bool poll(int timeoutMs)=0;
+};
+
+std::unique_ptr<EventLoop> makeEpollLoop(EventLoop::Handler &handler);
+// Returns nullptr when the running kernel lacks the io_uring features we use.
+std::unique_ptr<EventLoop> makeUringLoop(EventLoop::Handler &handler);
+
+} // namespace qchat
+
+#endif
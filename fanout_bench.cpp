@@ -0,0 +1,124 @@
+// Broadcast fan-out cost per message, printed as one JSON object:
+//
+//   fanout_bench [--max-receivers N] [--min-ms N] > before.json
+//
+// Each broadcast queues one line on every receiver's OutQueue and then
+// drains the queues the way the event loops do (fillIov, consume), without
+// the send syscalls. One receiver in four speaks the binary protocol.
+//
+// shared     the server's path: makeWireLine once, the same OutBuf queued
+//            on every connection
+// per_copy   the path before it: the line copied and framed separately for
+//            each receiver
+//
+// allocs and heap_bytes count operator new calls per broadcast, averaged over
+// 64 broadcasts so the deque block each queue takes every 32 lines shows up
+// at its real rate. bytes_copied is the size of every line buffer a
+// broadcast builds, text line with its '\n' or binary frame: one of each on
+// the shared path, one per receiver on per_copy. Both paths start from the
+// line already built, as cmdMsgAll hands it over.
+
+#include "bench_common.hpp"
+#include "hub.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <sys/uio.h>
+
+namespace {
+
+using bench::HeapCount;
+using qchat::OutBuf;
+using qchat::OutQueue;
+
+volatile std::size_t sink;
+
+bool isBinary(std::size_t receiver) {
+	return receiver%4==3;
+}
+
+void drain(std::vector<OutQueue> &queues) {
+	iovec iov[64];
+	for(OutQueue &q:queues){
+		while(!q.empty()){
+			const std::size_t n=q.fillIov(iov,64);
+			std::size_t bytes=0;
+			for(std::size_t i=0;i<n;++i)bytes+=iov[i].iov_len;
+			sink=sink+bytes;
+			q.consume(bytes);
+		}
+	}
+}
+
+// Each path returns the bytes it copied into line buffers.
+std::size_t shared(std::vector<OutQueue> &queues,const std::string &msg) {
+	const qchat::WireLine line=qchat::makeWireLine(msg);
+	for(std::size_t i=0;i<queues.size();++i)queues[i].push(isBinary(i)?line.bin:line.text);
+	drain(queues);
+	return line.text->size()+line.bin->size();
+}
+
+std::size_t perCopy(std::vector<OutQueue> &queues,const std::string &msg) {
+	std::size_t copied=0;
+	for(std::size_t i=0;i<queues.size();++i){
+		OutBuf buf=isBinary(i)?qchat::makeBinLine(msg):qchat::makeLine(msg);
+		copied+=buf->size();
+		queues[i].push(std::move(buf));
+	}
+	drain(queues);
+	return copied;
+}
+
+template<class Fn>
+void printRow(bool &first,const char *path,std::size_t receivers,std::size_t lineBytes,double roundNs,
+		std::vector<OutQueue> &queues,const std::string &msg,Fn fn) {
+	static constexpr std::size_t COUNTED=64;
+	const std::size_t copied=fn(queues,msg); // first touch grows the queues' deques
+	const HeapCount before=bench::heapCount();
+	for(std::size_t i=0;i<COUNTED;++i)fn(queues,msg);
+	const HeapCount used=bench::heapCount()-before;
+	const double ns=bench::bestNs(roundNs,[&]{fn(queues,msg);});
+	std::printf("%s\n    {\"path\": \"%s\", \"receivers\": %zu, \"line_bytes\": %zu, \"allocs\": %.2f, "
+		"\"heap_bytes\": %.0f, \"bytes_copied\": %zu, \"ns\": %.0f, \"ns_per_receiver\": %.1f}",
+		first?"":",",path,receivers,lineBytes,static_cast<double>(used.allocs)/COUNTED,
+		static_cast<double>(used.bytes)/COUNTED,copied,ns,ns/static_cast<double>(receivers));
+	first=false;
+}
+
+} // namespace
+
+int main(int argc,char **argv) {
+	std::size_t maxReceivers=10000;
+	double minMs=200;
+	for(int i=1;i<argc;++i){
+		const std::string arg=argv[i];
+		if(arg=="--max-receivers" && i+1<argc){
+			maxReceivers=std::strtoull(argv[++i],nullptr,10);
+		}else if(arg=="--min-ms" && i+1<argc){
+			minMs=std::strtod(argv[++i],nullptr);
+		}else{
+			std::fprintf(stderr,"Usage: %s [--max-receivers N] [--min-ms N]\n",argv[0]);
+			return 1;
+		}
+	}
+	const double roundNs=minMs*1e6/5;
+
+	std::printf("{\n  \"optimized\": %s,\n  \"compiler\": \"%s\",\n",bench::OPTIMIZED?"true":"false",__VERSION__);
+	std::printf("  \"broadcast\": [");
+	bool first=true;
+	for(std::size_t receivers:{std::size_t{10},std::size_t{100},std::size_t{1000},std::size_t{10000}}){
+		if(receivers>maxReceivers)break;
+		std::vector<OutQueue> queues(receivers);
+		for(std::size_t lineBytes:{std::size_t{64},std::size_t{1024}}){
+			std::string msg="FROM Alice (@alice): ";
+			msg.resize(lineBytes,'x');
+			printRow(first,"shared",receivers,lineBytes,roundNs,queues,msg,shared);
+			printRow(first,"per_copy",receivers,lineBytes,roundNs,queues,msg,perCopy);
+		}
+	}
+	std::printf("\n  ]\n}\n");
+	return 0;
+}
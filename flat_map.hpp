@@ -0,0 +1,328 @@
+#ifndef QCHAT_FLAT_MAP_HPP
+#define QCHAT_FLAT_MAP_HPP
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace qchat {
+
+// Hashes for FlatMap. The low bits pick a group and the top 7 bits are kept
+// per slot, so both ends need to be well mixed.
+template<class K>
+struct FlatHash;
+
+template<>
+struct FlatHash<std::uint64_t> {
+	std::size_t operator()(std::uint64_t x) const {
+		x^=x>>33;
+		x*=0xff51afd7ed558ccdull;
+		x^=x>>33;
+		x*=0xc4ceb9fe1a85ec53ull;
+		x^=x>>33;
+		return static_cast<std::size_t>(x);
+	}
+};
+
+template<>
+struct FlatHash<std::string_view> {
+	using is_transparent=void;
+	std::size_t operator()(std::string_view s) const {
+		return FlatHash<std::uint64_t>()(std::hash<std::string_view>()(s));
+	}
+};
+
+// Transparent: std::string keys can be looked up by string_view.
+template<>
+struct FlatHash<std::string>:FlatHash<std::string_view> {};
+
+// Open-addressing hash map in the Swiss-table layout: one control byte per
+// slot (empty, deleted, or 7 bits of the hash), probed 16 at a time, with the
+// entries in a separate flat array. Lookups touch one control group and
+// usually one entry; there is no per-entry allocation.
+//
+// Inserting may move every entry, so pointers and iterators into the map do
+// not survive an insert. Erasing leaves the others in place.
+template<class K,class V,class Hash=FlatHash<K>,class Eq=std::equal_to<>>
+class FlatMap {
+public:
+	using value_type=std::pair<K,V>;
+
+	template<bool Const>
+	class Iter {
+	public:
+		using Ref=std::conditional_t<Const,const value_type&,value_type&>;
+		using Ptr=std::conditional_t<Const,const value_type*,value_type*>;
+
+		Iter()=default;
+		Iter(const std::int8_t *ctrl,Ptr slot,const std::int8_t *end):ctrl_(ctrl),slot_(slot),end_(end) {skip();}
+		operator Iter<true>() const {return Iter<true>(ctrl_,slot_,end_);}
+
+		Ref operator*() const {return *slot_;}
+		Ptr operator->() const {return slot_;}
+		Iter &operator++() {
+			++ctrl_;
+			++slot_;
+			skip();
+			return *this;
+		}
+		bool operator==(const Iter &o) const {return slot_==o.slot_;}
+
+	private:
+		template<class,class,class,class> friend class FlatMap;
+		const std::int8_t *ctrl_{nullptr};
+		Ptr slot_{nullptr};
+		const std::int8_t *end_{nullptr};
+
+		void skip() {
+			while(ctrl_!=end_ && *ctrl_<0){
+				++ctrl_;
+				++slot_;
+			}
+		}
+	};
+
+	using iterator=Iter<false>;
+	using const_iterator=Iter<true>;
+
+	FlatMap()=default;
+	~FlatMap() {release();}
+
+	FlatMap(FlatMap &&other) noexcept {swap(other);}
+	FlatMap &operator=(FlatMap &&other) noexcept {
+		if(this!=&other){
+			FlatMap tmp(std::move(other));
+			swap(tmp);
+		}
+		return *this;
+	}
+	FlatMap(const FlatMap&)=delete;
+	FlatMap &operator=(const FlatMap&)=delete;
+
+	std::size_t size() const {return size_;}
+	bool empty() const {return size_==0;}
+	std::size_t capacity() const {return capacity_;}
+	// Bytes held by the table itself (not by what the entries own).
+	std::size_t tableBytes() const {return capacity_*(sizeof(value_type)+1);}
+
+	iterator begin() {return iterator(ctrl_,slots_,ctrl_+capacity_);}
+	iterator end() {return iterator(ctrl_+capacity_,slots_+capacity_,ctrl_+capacity_);}
+	const_iterator begin() const {return const_iterator(ctrl_,slots_,ctrl_+capacity_);}
+	const_iterator end() const {return const_iterator(ctrl_+capacity_,slots_+capacity_,ctrl_+capacity_);}
+
+	template<class Q>
+	iterator find(const Q &key) {
+		const std::size_t i=findIndex(key);
+		return i==NPOS?end():iterator(ctrl_+i,slots_+i,ctrl_+capacity_);
+	}
+	template<class Q>
+	const_iterator find(const Q &key) const {
+		const std::size_t i=findIndex(key);
+		return i==NPOS?end():const_iterator(ctrl_+i,slots_+i,ctrl_+capacity_);
+	}
+	template<class Q>
+	bool contains(const Q &key) const {return findIndex(key)!=NPOS;}
+
+	template<class KK,class... Args>
+	std::pair<iterator,bool> try_emplace(KK &&key,Args&&... args) {
+		const std::size_t h=Hash()(key);
+		std::size_t i=findIndex(key,h);
+		if(i!=NPOS)return {iterator(ctrl_+i,slots_+i,ctrl_+capacity_),false};
+		if(capacity_==0 || (size_+deleted_+1)*8>capacity_*7)grow();
+		i=insertSlot(h);
+		::new(static_cast<void*>(slots_+i)) value_type(std::piecewise_construct,
+			std::forward_as_tuple(std::forward<KK>(key)),
+			std::forward_as_tuple(std::forward<Args>(args)...));
+		++size_;
+		return {iterator(ctrl_+i,slots_+i,ctrl_+capacity_),true};
+	}
+
+	template<class KK>
+	V &operator[](KK &&key) {return try_emplace(std::forward<KK>(key)).first->second;}
+
+	void erase(const_iterator it) {
+		const std::size_t i=static_cast<std::size_t>(it.ctrl_-ctrl_);
+		slots_[i].~value_type();
+		// a group with an empty slot never made a probe continue past it
+		const std::size_t g=i&~(GROUP-1);
+		if(matchEmpty(ctrl_+g)!=0){
+			ctrl_[i]=EMPTY;
+		}else{
+			ctrl_[i]=DELETED;
+			++deleted_;
+		}
+		--size_;
+	}
+
+	template<class Q> requires (!std::is_convertible_v<const Q&,const_iterator>)
+	bool erase(const Q &key) {
+		const std::size_t i=findIndex(key);
+		if(i==NPOS)return false;
+		erase(const_iterator(ctrl_+i,slots_+i,ctrl_+capacity_));
+		return true;
+	}
+
+	void clear() {
+		destroyAll();
+		if(capacity_!=0)std::memset(ctrl_,EMPTY,capacity_);
+		size_=0;
+		deleted_=0;
+	}
+
+	void reserve(std::size_t n) {
+		std::size_t cap=GROUP;
+		while(cap*7<n*8)cap<<=1;
+		if(cap>capacity_)rehash(cap);
+	}
+
+	void swap(FlatMap &o) noexcept {
+		std::swap(ctrl_,o.ctrl_);
+		std::swap(slots_,o.slots_);
+		std::swap(capacity_,o.capacity_);
+		std::swap(size_,o.size_);
+		std::swap(deleted_,o.deleted_);
+	}
+
+private:
+	static constexpr std::size_t GROUP=16;
+	static constexpr std::size_t NPOS=~std::size_t{0};
+	static constexpr std::int8_t EMPTY=-128;
+	static constexpr std::int8_t DELETED=-2;
+
+	std::int8_t *ctrl_{nullptr};
+	value_type *slots_{nullptr};
+	std::size_t capacity_{0};   // 0 or a power of two >= GROUP
+	std::size_t size_{0};
+	std::size_t deleted_{0};
+
+	static std::int8_t h2(std::size_t h) {return static_cast<std::int8_t>(h>>(sizeof(std::size_t)*8-7));}
+
+	static unsigned matchByte(const std::int8_t *g,std::int8_t b) {
+#ifdef __SSE2__
+		const __m128i v=_mm_loadu_si128(reinterpret_cast<const __m128i*>(g));
+		return static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v,_mm_set1_epi8(b))));
+#else
+		unsigned m=0;
+		for(std::size_t k=0;k<GROUP;++k)m|=static_cast<unsigned>(g[k]==b)<<k;
+		return m;
+#endif
+	}
+
+	static unsigned matchEmpty(const std::int8_t *g) {return matchByte(g,EMPTY);}
+
+	// empty or deleted
+	static unsigned matchFree(const std::int8_t *g) {
+#ifdef __SSE2__
+		const __m128i v=_mm_loadu_si128(reinterpret_cast<const __m128i*>(g));
+		return static_cast<unsigned>(_mm_movemask_epi8(v));
+#else
+		unsigned m=0;
+		for(std::size_t k=0;k<GROUP;++k)m|=static_cast<unsigned>(g[k]<0)<<k;
+		return m;
+#endif
+	}
+
+	template<class Q>
+	std::size_t findIndex(const Q &key) const {return findIndex(key,Hash()(key));}
+
+	// Groups are probed triangularly (g, g+1, g+3, ...), which visits every
+	// group once for a power-of-two count.
+	template<class Q>
+	std::size_t findIndex(const Q &key,std::size_t h) const {
+		if(capacity_==0)return NPOS;
+		const std::size_t mask=capacity_-1;
+		const std::int8_t tag=h2(h);
+		std::size_t pos=(h*GROUP)&mask;
+		for(std::size_t step=GROUP;;step+=GROUP){
+			const std::int8_t *g=ctrl_+pos;
+			for(unsigned m=matchByte(g,tag);m!=0;m&=m-1){
+				const std::size_t i=pos+static_cast<std::size_t>(std::countr_zero(m));
+				if(Eq()(slots_[i].first,key))return i;
+			}
+			if(matchEmpty(g)!=0 || step>capacity_)return NPOS;
+			pos=(pos+step)&mask;
+		}
+	}
+
+	// First free slot on h's probe sequence; marks it used.
+	std::size_t insertSlot(std::size_t h) {
+		const std::size_t mask=capacity_-1;
+		std::size_t pos=(h*GROUP)&mask;
+		for(std::size_t step=GROUP;;step+=GROUP){
+			const unsigned m=matchFree(ctrl_+pos);
+			if(m!=0){
+				const std::size_t i=pos+static_cast<std::size_t>(std::countr_zero(m));
+				if(ctrl_[i]==DELETED)--deleted_;
+				ctrl_[i]=h2(h);
+				return i;
+			}
+			pos=(pos+step)&mask;
+		}
+	}
+
+	void grow() {
+		// mostly tombstones: rebuild at the same size
+		if(capacity_!=0 && size_*2<capacity_){
+			rehash(capacity_);
+		}else{
+			rehash(capacity_==0?GROUP:capacity_*2);
+		}
+	}
+
+	void rehash(std::size_t cap) {
+		std::int8_t *oldCtrl=ctrl_;
+		value_type *oldSlots=slots_;
+		const std::size_t oldCap=capacity_;
+		ctrl_=static_cast<std::int8_t*>(::operator new(cap,std::align_val_t{GROUP}));
+		slots_=static_cast<value_type*>(::operator new(cap*sizeof(value_type),std::align_val_t{alignof(value_type)}));
+		std::memset(ctrl_,EMPTY,cap);
+		capacity_=cap;
+		deleted_=0;
+		for(std::size_t i=0;i<oldCap;++i){
+			if(oldCtrl[i]<0)continue;
+			const std::size_t j=insertSlot(Hash()(oldSlots[i].first));
+			::new(static_cast<void*>(slots_+j)) value_type(std::move(oldSlots[i]));
+			oldSlots[i].~value_type();
+		}
+		if(oldCap!=0){
+			::operator delete(oldCtrl,std::align_val_t{GROUP});
+			::operator delete(oldSlots,std::align_val_t{alignof(value_type)});
+		}
+	}
+
+	void destroyAll() {
+		if constexpr(!std::is_trivially_destructible_v<value_type>){
+			for(std::size_t i=0;i<capacity_;++i){
+				if(ctrl_[i]>=0)slots_[i].~value_type();
+			}
+		}
+	}
+
+	void release() {
+		if(capacity_==0)return;
+		destroyAll();
+		::operator delete(ctrl_,std::align_val_t{GROUP});
+		::operator delete(slots_,std::align_val_t{alignof(value_type)});
+		ctrl_=nullptr;
+		slots_=nullptr;
+		capacity_=0;
+		size_=0;
+		deleted_=0;
+	}
+};
+
+} // namespace qchat
+
+#endif
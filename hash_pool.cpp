@@ -0,0 +1,161 @@
+#include "hash_pool.hpp"
+#include "server.hpp"
+
+namespace qchat {
+
+HashPool::HashPool(std::size_t threads,std::size_t capacity,KdfParams kdf)
+	:capacity_(capacity>0?capacity:1),kdf_(kdf) {
+	if(threads==0)threads=1;
+	threads_.reserve(threads);
+	for(std::size_t i=0;i<threads;++i){
+		threads_.emplace_back([this](){worker();});
+	}
+}
+
+HashPool::~HashPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stopping_=true;
+	}
+	cv_.notify_all();
+	for(std::thread &t:threads_)t.join();
+}
+
+bool HashPool::submit(std::shared_ptr<HashJob> job) {
+	job->queued=std::chrono::steady_clock::now();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if(queue_.size()>=capacity_){
+			rejected_.fetch_add(1,std::memory_order_relaxed);
+			return false;
+		}
+		queue_.push_back(std::move(job));
+		if(queue_.size()>peakDepth_)peakDepth_=queue_.size();
+	}
+	cv_.notify_one();
+	return true;
+}
+
+HashPoolStats HashPool::stats() const {
+	HashPoolStats s;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		s.depth=queue_.size();
+		s.peakDepth=peakDepth_;
+	}
+	s.completed=completed_.load(std::memory_order_relaxed);
+	s.rejected=rejected_.load(std::memory_order_relaxed);
+	if(s.completed>0){
+		s.waitAvgUs=waitTotalUs_.load(std::memory_order_relaxed)/s.completed;
+		s.runAvgUs=runTotalUs_.load(std::memory_order_relaxed)/s.completed;
+	}
+	s.maxUs=maxUs_.load(std::memory_order_relaxed);
+	s.upgraded=upgraded_.load(std::memory_order_relaxed);
+	s.kdf=kdf_;
+	return s;
+}
+
+bool HashPool::batchable(const HashJob &job) {
+	return job.op==HashJob::Op::Login && !job.checked && job.expected.params.kind==KdfParams::Kind::Sha3;
+}
+
+bool HashPool::needsRehash(const HashJob &job) const {
+	return job.op==HashJob::Op::Login && job.matched && job.expected.params.cost()<kdf_.cost();
+}
+
+void HashPool::worker() {
+	using namespace std::chrono;
+	std::vector<std::shared_ptr<HashJob>> jobs;
+	for(;;){
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cv_.wait(lock,[this](){return stopping_ || !queue_.empty();});
+			if(stopping_)return;
+			jobs.push_back(std::move(queue_.front()));
+			queue_.pop_front();
+			if(batchable(*jobs.front())){
+				while(!queue_.empty() && jobs.size()<MAX_BATCH && batchable(*queue_.front())){
+					jobs.push_back(std::move(queue_.front()));
+					queue_.pop_front();
+				}
+			}
+		}
+		const auto started=steady_clock::now();
+		if(batchable(*jobs.front())){
+			checkSha3(jobs);
+		}else{
+			run(*jobs.front());
+		}
+		const auto finished=steady_clock::now();
+
+		// a batch costs each of its jobs an equal share
+		const u64 runUs=static_cast<u64>(duration_cast<microseconds>(finished-started).count())/jobs.size();
+		std::size_t requeued=0;
+		for(std::shared_ptr<HashJob> &job:jobs){
+			job->waitUs+=static_cast<u64>(duration_cast<microseconds>(started-job->queued).count());
+			job->runUs+=runUs;
+			if(!job->rehashed && needsRehash(*job)){
+				job->queued=finished;
+				std::lock_guard<std::mutex> lock(mutex_);
+				queue_.insert(queue_.begin()+static_cast<std::ptrdiff_t>(requeued++),std::move(job));
+			}else{
+				finish(std::move(job));
+			}
+		}
+		if(requeued>1)cv_.notify_all();
+		jobs.clear();
+	}
+}
+
+void HashPool::finish(std::shared_ptr<HashJob> job) {
+	waitTotalUs_.fetch_add(job->waitUs,std::memory_order_relaxed);
+	runTotalUs_.fetch_add(job->runUs,std::memory_order_relaxed);
+	const u64 totalUs=job->waitUs+job->runUs;
+	u64 prev=maxUs_.load(std::memory_order_relaxed);
+	while(prev<totalUs && !maxUs_.compare_exchange_weak(prev,totalUs,std::memory_order_relaxed)){}
+	completed_.fetch_add(1,std::memory_order_relaxed);
+
+	ShardMsg msg;
+	msg.kind=ShardMsg::Kind::HashDone;
+	msg.job=std::move(job);
+	Server *owner=msg.job->owner;
+	owner->post(std::move(msg));
+}
+
+// Legacy logins, checked together in vector lanes.
+void HashPool::checkSha3(std::vector<std::shared_ptr<HashJob>> &jobs) {
+	std::vector<std::string_view> pws;
+	pws.reserve(jobs.size());
+	for(const std::shared_ptr<HashJob> &job:jobs)pws.push_back(job->password);
+	std::vector<std::array<u8,64>> hashes(jobs.size());
+	sha3Passwords(pws,hashes);
+	for(std::size_t i=0;i<jobs.size();++i){
+		jobs[i]->matched=digestsEqual(hashes[i],jobs[i]->expected.digest);
+		jobs[i]->checked=true;
+	}
+}
+
+void HashPool::run(HashJob &job) {
+	if(job.op!=HashJob::Op::Signup && !job.checked){
+		job.matched=passwordMatches(job.expected,job.password);
+		job.checked=true;
+	}
+	switch(job.op){
+	case HashJob::Op::Signup:
+		job.matched=true;
+		job.newHash=hashPassword(job.password,kdf_);
+		break;
+	case HashJob::Op::Login:
+		if(needsRehash(job)){
+			job.newHash=hashPassword(job.password,kdf_);
+			job.rehashed=true;
+			upgraded_.fetch_add(1,std::memory_order_relaxed);
+		}
+		break;
+	case HashJob::Op::ChPass:
+		if(job.matched)job.newHash=hashPassword(job.newPassword,kdf_);
+		break;
+	}
+}
+
+} // namespace qchat
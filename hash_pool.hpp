@@ -0,0 +1,128 @@
+#ifndef QCHAT_HASH_POOL_HPP
+#define QCHAT_HASH_POOL_HPP
+
+#include "chat_common.hpp"
+#include "password_kdf.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace qchat {
+
+class Server;
+
+// One password hash/verify request. The reactor fills in the inputs and the
+// context it needs to resume the command; a worker fills in the outputs and
+// posts the job back to owner.
+struct HashJob {
+	enum class Op {
+		Signup, // hash password
+		Login,  // verify password against expected, rehash it if expected is weak
+		ChPass  // verify password against expected, hash newPassword
+	};
+	Op op{Op::Login};
+
+	// reactor side
+	Server *owner{nullptr};
+	int fd{-1};
+	u64 connId{0};
+	u64 uid{0};
+	std::string handle;
+	std::string display;
+
+	// inputs
+	std::string password;
+	std::string newPassword;
+	PasswordHash expected;
+
+	// outputs
+	PasswordHash newHash;  // to store: always for Signup and a matched ChPass
+	bool matched{false};
+	bool rehashed{false};  // Login: newHash upgrades expected to the pool's KDF
+
+	// pool side
+	std::chrono::steady_clock::time_point queued;
+	bool checked{false};   // password already verified, only hashing is left
+	u64 waitUs{0};
+	u64 runUs{0};
+};
+
+struct HashPoolStats {
+	std::size_t depth{0};      // jobs waiting right now
+	std::size_t peakDepth{0};
+	u64 completed{0};
+	u64 rejected{0};           // submit() calls refused by a full queue
+	u64 waitAvgUs{0};          // time spent queued
+	u64 runAvgUs{0};           // time spent hashing
+	u64 maxUs{0};              // worst queued+hashing time
+	u64 upgraded{0};           // logins rehashed under the current KDF
+	KdfParams kdf;
+};
+
+// Fixed set of threads doing password hashing so slow hashes never run on a
+// reactor. The queue is bounded; a full queue is reported to the caller
+// rather than growing without limit during a login storm.
+//
+// Anything that runs the KDF is taken one job at a time, so a burst spreads
+// over all workers instead of queueing behind one. Only logins against
+// unsalted SHA3 hashes are batched: a worker takes up to MAX_BATCH of them
+// that wait next to each other and checks them in one multi-buffer call.
+//
+// New hashes use kdf. A login checked against a hash that costs less than
+// kdf is hashed again under it, so accounts move to the current settings
+// the next time they log in. A batched login that needs this goes back to
+// the front of the queue as a job of its own.
+class HashPool {
+public:
+	HashPool(std::size_t threads,std::size_t capacity,KdfParams kdf);
+	~HashPool();
+
+	HashPool(const HashPool&)=delete;
+	HashPool &operator=(const HashPool&)=delete;
+
+	// Returns false if the queue is full. On success the job is handed back
+	// through job->owner->post() once done.
+	bool submit(std::shared_ptr<HashJob> job);
+
+	HashPoolStats stats() const;
+
+private:
+	static constexpr std::size_t MAX_BATCH=16;
+
+	std::size_t capacity_;
+	KdfParams kdf_;
+	mutable std::mutex mutex_;
+	std::condition_variable cv_;
+	std::deque<std::shared_ptr<HashJob>> queue_;
+	bool stopping_{false};
+	std::vector<std::thread> threads_;
+
+	std::size_t peakDepth_{0};       // guarded by mutex_
+	std::atomic<u64> completed_{0};
+	std::atomic<u64> rejected_{0};
+	std::atomic<u64> waitTotalUs_{0};
+	std::atomic<u64> runTotalUs_{0};
+	std::atomic<u64> maxUs_{0};
+	std::atomic<u64> upgraded_{0};
+
+	static bool batchable(const HashJob &job);
+	bool needsRehash(const HashJob &job) const;
+
+	void worker();
+	void checkSha3(std::vector<std::shared_ptr<HashJob>> &jobs);
+	void run(HashJob &job);
+	void finish(std::shared_ptr<HashJob> job);
+};
+
+} // namespace qchat
+
+#endif
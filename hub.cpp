@@ -0,0 +1,238 @@
+#include "hub.hpp"
+#include "hash_pool.hpp"
+#include "server.hpp"
+
+#include <chrono>
+#include <iostream>
+
+namespace qchat {
+
+Hub::Hub(const std::string &dbPath,const HubOptions &opts)
+	:dbPath_(dbPath),
+	dbFile_(dbPath),
+	journal_(dbPath+".journal"),
+	opts_(opts) {
+	db_.users.setCacheLimit(opts.profileCacheBytes);
+}
+
+Hub::~Hub()=default;
+
+bool Hub::init() {
+	const KdfParams kdf=calibrateKdf(std::chrono::milliseconds(opts_.kdfBudgetMs));
+	std::cout<<"Password KDF: "<<(std::size_t{1}<<kdf.memLog2)<<" KiB, "<<static_cast<unsigned>(kdf.passes)
+		<<" pass(es) within "<<opts_.kdfBudgetMs<<" ms\n";
+	hashPool_=std::make_unique<HashPool>(opts_.hashThreads,opts_.hashQueue,kdf);
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if(!dbFile_.load(db_)){
+			std::cerr<<"Failed to load DB from "<<dbPath_<<"\n";
+			return false;
+		}
+		if(!journal_.open(db_)){
+			std::cerr<<"Failed to open journal for "<<dbPath_<<"\n";
+			return false;
+		}
+		// fold what was replayed into the snapshot so the next start is quick
+		if(journal_.sizeBytes()>0 || journal_.rotating() || db_.users.hasDirty())compact();
+		if(opts_.offlineCapBytes>0){
+			offline_=std::make_unique<OfflineQueue>(dbPath_+".offline",opts_.offlineCapBytes);
+			if(!offline_->open()){
+				std::cerr<<"Failed to open offline queue for "<<dbPath_<<"\n";
+				return false;
+			}
+		}
+	}
+	if(opts_.archiveSegmentBytes>0){
+		const std::string dir=opts_.archiveDir.empty()?dbPath_+".archive":opts_.archiveDir;
+		archive_=std::make_unique<Archive>(dir,opts_.archiveSegmentBytes,opts_.archiveKeepSegments);
+		if(!archive_->open()){
+			std::cerr<<"Failed to open chat archive in "<<dir<<"\n";
+			return false;
+		}
+	}
+	if(opts_.groupCommit){
+		notifiedSeq_=journal_.durableSeq();
+		journal_.startGroupCommit(std::chrono::microseconds(opts_.commitWindowUs),opts_.commitBatch,
+			[this](u64 seq){notifyDurable(seq);});
+	}
+	if(opts_.snapshotInterval>0 || opts_.snapshotJournalBytes>0 || offline_){
+		compactor_=std::jthread([this](std::stop_token stop){compactorLoop(stop);});
+	}
+	return true;
+}
+
+void Hub::addShard(Server *shard) {
+	shards_.push_back(shard);
+}
+
+void Hub::postOthers(std::size_t from,const ShardMsg &msg) {
+	for(std::size_t i=0;i<shards_.size();++i){
+		if(i==from)continue;
+		shards_[i]->post(msg);
+	}
+}
+
+void Hub::postSessions(std::size_t from,u64 uid,const ShardMsg &msg) {
+	auto it=online_.find(uid);
+	if(it==online_.end())return;
+	const std::vector<std::size_t> &shards=it->second;
+	for(std::size_t i=0;i<shards.size();++i){
+		const std::size_t s=shards[i];
+		if(s==from)continue;
+		// several sessions on one shard still get a single message
+		bool seen=false;
+		for(std::size_t j=0;j<i;++j){
+			if(shards[j]==s){
+				seen=true;
+				break;
+			}
+		}
+		if(!seen)shards_[s]->post(msg);
+	}
+}
+
+bool Hub::compact() {
+	db_.journalSeq=journal_.lastSeq();
+	if(!dbFile_.save(db_)){
+		std::cerr<<"Warning: failed to save DB\n";
+		return false;
+	}
+	SnapshotView view;
+	if(dbFile_.open(view))db_.users.snapshotWritten(std::move(view),db_.journalSeq);
+	// a crash before this point replays nothing twice: the snapshot
+	// records journalSeq and older records are skipped
+	if(!journal_.finishRotate())return false;
+	return journal_.reset();
+}
+
+// Only shards with a reply waiting on a seq past the previous batch are
+// woken. Pairs with Server::awaitDurable(): the durable seq is stored before
+// awaitedSeq() is read here, and the shard stores awaitedSeq before reading
+// the durable seq, so a waiter is never missed by both sides.
+void Hub::notifyDurable(u64 seq) {
+	ShardMsg msg;
+	msg.kind=ShardMsg::Kind::Durable;
+	msg.seq=seq;
+	for(Server *shard:shards_){
+		if(shard->awaitedSeq()>notifiedSeq_)shard->post(msg);
+	}
+	notifiedSeq_=seq;
+}
+
+SnapshotStats Hub::snapshotStats() const {
+	SnapshotStats s;
+	s.count=snapCount_.load(std::memory_order_relaxed);
+	s.failed=snapFailed_.load(std::memory_order_relaxed);
+	s.lastUs=snapLastUs_.load(std::memory_order_relaxed);
+	s.lastBytes=snapLastBytes_.load(std::memory_order_relaxed);
+	s.totalBytes=snapTotalBytes_.load(std::memory_order_relaxed);
+	return s;
+}
+
+// Wakes once a second to sync the offline queue and check the journal size;
+// the interval timer only fires if something was journaled since the last
+// snapshot.
+void Hub::compactorLoop(std::stop_token stop) {
+	using namespace std::chrono;
+	auto last=steady_clock::now();
+	std::unique_lock<std::mutex> lock(compactorMutex_);
+	while(!stop.stop_requested()){
+		compactorCv_.wait_for(lock,stop,seconds(1),[](){return false;});
+		if(stop.stop_requested())break;
+		if(offline_ && !offline_->sync())std::cerr<<"Warning: failed to sync offline queue\n";
+		std::size_t journalBytes=0;
+		bool pending=false;
+		{
+			std::lock_guard<std::mutex> dbLock(mutex_);
+			journalBytes=journal_.sizeBytes();
+			pending=journal_.rotating();
+		}
+		const bool bySize=opts_.snapshotJournalBytes>0 && journalBytes>=opts_.snapshotJournalBytes;
+		const bool byTime=opts_.snapshotInterval>0 && (journalBytes>0 || pending)
+			&& steady_clock::now()-last>=seconds(opts_.snapshotInterval);
+		if(!bySize && !byTime)continue;
+		snapshotInBackground();
+		last=steady_clock::now();
+	}
+}
+
+// Holds mutex() only to switch the journal and freeze the state: the auth
+// columns and the profiles changed since the last snapshot are copied, the
+// rest stays in the old snapshot. The encode, which pages those profiles
+// in, and the write, fsync and rename run with the reactors free to
+// continue.
+bool Hub::snapshotInBackground() {
+	using namespace std::chrono;
+	const auto started=steady_clock::now();
+	if(!journal_.prepareRotate()){
+		snapFailed_.fetch_add(1,std::memory_order_relaxed);
+		return false;
+	}
+	DbImage image;
+	u64 seq=0;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if(!journal_.rotate()){
+			snapFailed_.fetch_add(1,std::memory_order_relaxed);
+			return false;
+		}
+		db_.journalSeq=journal_.lastSeq();
+		seq=db_.journalSeq;
+		image.nextUid=db_.nextUid;
+		image.journalSeq=seq;
+		db_.users.freeze(image);
+	}
+	const std::string bytes=DbFile::encode(image);
+	// the old journal stays in place until the snapshot replacing it is
+	// durable; records written meanwhile land in the next file
+	if(!dbFile_.saveEncoded(bytes) || !journal_.finishRotate()){
+		std::cerr<<"Warning: background snapshot of "<<dbPath_<<" failed\n";
+		snapFailed_.fetch_add(1,std::memory_order_relaxed);
+		return false;
+	}
+	// profiles changed up to seq can now be paged back in from the new file
+	SnapshotView view;
+	if(dbFile_.open(view)){
+		std::lock_guard<std::mutex> lock(mutex_);
+		db_.users.snapshotWritten(std::move(view),seq);
+	}
+	const u64 us=static_cast<u64>(duration_cast<microseconds>(steady_clock::now()-started).count());
+	snapLastUs_.store(us,std::memory_order_relaxed);
+	snapLastBytes_.store(bytes.size(),std::memory_order_relaxed);
+	snapTotalBytes_.fetch_add(bytes.size(),std::memory_order_relaxed);
+	snapCount_.fetch_add(1,std::memory_order_relaxed);
+	return true;
+}
+
+unsigned Hub::sessionsOf(u64 uid) const {
+	auto it=online_.find(uid);
+	if(it==online_.end())return 0;
+	return static_cast<unsigned>(it->second.size());
+}
+
+void Hub::sessionOpened(u64 uid,std::size_t shard) {
+	online_[uid].push_back(shard);
+}
+
+void Hub::sessionClosed(u64 uid,std::size_t shard) {
+	auto it=online_.find(uid);
+	if(it==online_.end())return;
+	std::vector<std::size_t> &shards=it->second;
+	for(std::size_t i=0;i<shards.size();++i){
+		if(shards[i]==shard){
+			shards[i]=shards.back();
+			shards.pop_back();
+			break;
+		}
+	}
+	if(shards.empty())online_.erase(it);
+}
+
+std::vector<u64> Hub::onlineUsers() const {
+	std::vector<u64> out;
+	out.reserve(online_.size());
+	for(const auto &kv:online_)out.push_back(kv.first);
+	return out;
+}
+
+} // namespace qchat
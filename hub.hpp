@@ -0,0 +1,169 @@
+#ifndef QCHAT_HUB_HPP
+#define QCHAT_HUB_HPP
+
+#include "archive.hpp"
+#include "chat_common.hpp"
+#include "db_file.hpp"
+#include "journal.hpp"
+#include "offline_queue.hpp"
+#include "out_queue.hpp"
+#include "proto_bin.hpp"
+#include "user_store.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace qchat {
+
+class HashPool;
+class Server;
+struct HashJob;
+
+// A fan-out line, encoded once for each wire protocol and shared by every
+// recipient on every shard.
+struct WireLine {
+	OutBuf text;
+	OutBuf bin;
+};
+
+// The binary-protocol frame for a reply line; a trailing newline is dropped.
+inline OutBuf makeBinLine(std::string_view line) {
+	if(!line.empty() && line.back()=='\n')line.remove_suffix(1);
+	return std::make_shared<const std::string>(encodeBinReply(line));
+}
+
+inline WireLine makeWireLine(std::string line) {
+	WireLine w;
+	w.bin=makeBinLine(line);
+	w.text=makeLine(std::move(line));
+	return w;
+}
+
+// Work handed from one reactor shard to another through its mailbox.
+struct ShardMsg {
+	enum class Kind {
+		Broadcast, // send line to every connection on the shard
+		Deliver,   // send line to every session of uid on the shard
+		HashDone,  // a HashPool worker finished job
+		Durable    // journal records up to seq are on disk
+	};
+	Kind kind{Kind::Broadcast};
+	u64 uid{0};
+	u64 seq{0};
+	WireLine line; // shared with the sending shard's own queues, never copied
+	std::shared_ptr<HashJob> job;
+};
+
+struct HubOptions {
+	std::size_t hashThreads{2};
+	std::size_t hashQueue{1024};
+	std::size_t kdfBudgetMs{50};  // one password check, KDF calibrated to it at startup
+	std::size_t snapshotInterval{300};                // seconds, 0 = never on a timer
+	std::size_t snapshotJournalBytes{16u*1024u*1024u}; // 0 = no size trigger
+	bool groupCommit{true};           // false = write through without syncing
+	std::size_t commitWindowUs{2000}; // group commit window, 0 = sync at once
+	std::size_t commitBatch{256};     // records that close a batch early
+	std::size_t profileCacheBytes{64u*1024u*1024u}; // clean profiles kept in memory
+	std::string archiveDir;                            // empty = <db>.archive
+	std::size_t archiveSegmentBytes{64u*1024u*1024u}; // 0 = no archive
+	std::size_t archiveKeepSegments{0};               // newest kept, 0 = all
+	std::size_t offlineCapBytes{64u*1024u};           // per user, 0 = no offline queue
+};
+
+struct SnapshotStats {
+	u64 count{0};
+	u64 failed{0};
+	u64 lastUs{0};     // duration of the last snapshot, encode through rename
+	u64 lastBytes{0};
+	u64 totalBytes{0};
+};
+
+// State shared by all reactor shards: the user database (guarded by
+// mutex()), the list of shards for cross-shard delivery and the password
+// hashing pool.
+class Hub {
+public:
+	Hub(const std::string &dbPath,const HubOptions &opts);
+	~Hub();
+
+	bool init();
+
+	// Register every shard before any of them starts running.
+	void addShard(Server *shard);
+	std::size_t shardCount() const {return shards_.size();}
+	// Created by init().
+	HashPool &hashPool() {return *hashPool_;}
+	// Chat history; null when disabled. Thread-safe, needs no mutex().
+	Archive *archive() {return archive_.get();}
+	// Queues msg on every shard except `from`.
+	void postOthers(std::size_t from,const ShardMsg &msg);
+	// Queues msg on every shard other than `from` that holds a session of
+	// uid. Requires mutex().
+	void postSessions(std::size_t from,u64 uid,const ShardMsg &msg);
+
+	// Thread-safe: last journal seq that is durable.
+	u64 durableSeq() const {return journal_.durableSeq();}
+	JournalCommitStats commitStats() const {return journal_.commitStats();}
+
+	// Everything below requires mutex() to be held.
+	std::mutex &mutex() {return mutex_;}
+	DbState &db() {return db_;}
+	// Every mutation of db() must be recorded here as well.
+	Journal &journal() {return journal_;}
+	// Private messages waiting for offline users; null when disabled.
+	OfflineQueue *offline() {return offline_.get();}
+	// Writes a full snapshot and empties the journal, all under mutex().
+	// Only for startup; afterwards the compactor thread does it.
+	bool compact();
+	// Lock-free; safe to call with or without mutex().
+	SnapshotStats snapshotStats() const;
+
+	unsigned sessionsOf(u64 uid) const;
+	void sessionOpened(u64 uid,std::size_t shard);
+	void sessionClosed(u64 uid,std::size_t shard);
+	// uids with at least one session, in no particular order
+	std::vector<u64> onlineUsers() const;
+
+private:
+	std::string dbPath_;
+	std::mutex mutex_;
+	DbState db_;
+	DbFile dbFile_;
+	Journal journal_;
+	// uid -> shard of each live session (one entry per session)
+	std::unordered_map<u64,std::vector<std::size_t>> online_;
+	std::vector<Server*> shards_;
+	std::unique_ptr<HashPool> hashPool_;
+	std::unique_ptr<Archive> archive_;
+	std::unique_ptr<OfflineQueue> offline_;
+
+	HubOptions opts_;
+	std::atomic<u64> snapCount_{0};
+	std::atomic<u64> snapFailed_{0};
+	std::atomic<u64> snapLastUs_{0};
+	std::atomic<u64> snapLastBytes_{0};
+	std::atomic<u64> snapTotalBytes_{0};
+	std::mutex compactorMutex_;
+	std::condition_variable_any compactorCv_;
+	std::jthread compactor_; // last: stops before anything it touches is destroyed
+
+	u64 notifiedSeq_{0}; // committer thread only
+
+	void compactorLoop(std::stop_token stop);
+	void notifyDurable(u64 seq);
+	bool snapshotInBackground();
+};
+
+} // namespace qchat
+
+#endif
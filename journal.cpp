@@ -0,0 +1,452 @@
+#include "journal.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace qchat {
+
+namespace {
+
+constexpr std::size_t HEADER_SIZE=8;                // u32 length, u32 crc
+constexpr std::size_t MIN_BODY=1+sizeof(u64);      // type, seq
+constexpr std::size_t MAX_BODY=4u*1024u*1024u;
+
+template<class T>
+void put(std::string &out,const T &v) {
+	out.append(reinterpret_cast<const char*>(&v),sizeof(v));
+}
+
+void putString(std::string &out,std::string_view s) {
+	put(out,static_cast<std::uint32_t>(s.size()));
+	out.append(s);
+}
+
+void putHash(std::string &out,const PasswordHash &h) {
+	out.append(reinterpret_cast<const char*>(h.digest.data()),h.digest.size());
+	out.append(reinterpret_cast<const char*>(h.salt.data()),h.salt.size());
+	put(out,static_cast<u8>(h.params.kind));
+	put(out,h.params.memLog2);
+	put(out,h.params.passes);
+}
+
+// Bounds-checked cursor over one record body.
+class Reader {
+public:
+	explicit Reader(std::string_view data):rest_(data) {}
+
+	bool ok() const {return ok_;}
+
+	template<class T>
+	T get() {
+		T v{};
+		if(rest_.size()<sizeof(T)){
+			ok_=false;
+			return v;
+		}
+		std::memcpy(&v,rest_.data(),sizeof(T));
+		rest_.remove_prefix(sizeof(T));
+		return v;
+	}
+
+	std::string getString() {
+		const std::uint32_t n=get<std::uint32_t>();
+		if(!ok_ || rest_.size()<n){
+			ok_=false;
+			return std::string();
+		}
+		std::string s(rest_.substr(0,n));
+		rest_.remove_prefix(n);
+		return s;
+	}
+
+	void getBytes(u8 *out,std::size_t n) {
+		if(rest_.size()<n){
+			ok_=false;
+			return;
+		}
+		std::memcpy(out,rest_.data(),n);
+		rest_.remove_prefix(n);
+	}
+
+	// withKdf false for the record types from before salted hashes
+	PasswordHash getHash(bool withKdf) {
+		PasswordHash h;
+		getBytes(h.digest.data(),h.digest.size());
+		if(withKdf){
+			getBytes(h.salt.data(),h.salt.size());
+			h.params.kind=static_cast<KdfParams::Kind>(get<u8>());
+			h.params.memLog2=get<u8>();
+			h.params.passes=get<u8>();
+			if(!h.params.valid())ok_=false;
+		}
+		return h;
+	}
+
+private:
+	std::string_view rest_;
+	bool ok_{true};
+};
+
+} // namespace
+
+Journal::Journal(const std::string &path):path_(path),nextPath_(path+".next") {}
+
+Journal::~Journal() {
+	// the committer flushes what is left and must be gone before the fds
+	if(committer_.joinable()){
+		committer_.request_stop();
+		committer_.join();
+	}
+	if(fd_>=0)::close(fd_);
+	if(spareFd_>=0)::close(spareFd_);
+	if(retiredFd_>=0)::close(retiredFd_);
+}
+
+bool Journal::open(DbState &state) {
+	lastSeq_=state.journalSeq;
+	std::size_t good=0;
+	if(!replay(path_,state,good))return false;
+	// a compaction was cut short: keep appending to the newer file and let
+	// the next compaction finish the rotation
+	if(::access(nextPath_.c_str(),F_OK)==0){
+		if(!replay(nextPath_,state,good))return false;
+		rotating_=true;
+		return openForAppend(nextPath_,good);
+	}
+	return openForAppend(path_,good);
+}
+
+bool Journal::openForAppend(const std::string &path,std::size_t goodBytes) {
+	fd_=::open(path.c_str(),O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC,0644);
+	if(fd_<0){
+		std::perror("journal open");
+		return false;
+	}
+	off_t end=::lseek(fd_,0,SEEK_END);
+	if(end>=0 && static_cast<std::size_t>(end)>goodBytes){
+		std::cerr<<"Journal: discarding "<<(static_cast<std::size_t>(end)-goodBytes)<<" bytes of torn or corrupt tail\n";
+		if(::ftruncate(fd_,static_cast<off_t>(goodBytes))<0){
+			std::perror("journal truncate");
+			return false;
+		}
+	}
+	size_=goodBytes;
+	durableSeq_.store(lastSeq_);
+	return true;
+}
+
+bool Journal::replay(const std::string &path,DbState &state,std::size_t &goodBytes) {
+	goodBytes=0;
+	std::ifstream in(path,std::ios::binary);
+	if(!in.good())return true; // no journal yet
+	std::string data((std::istreambuf_iterator<char>(in)),std::istreambuf_iterator<char>());
+	std::size_t pos=0;
+	std::size_t applied=0;
+	while(data.size()-pos>=HEADER_SIZE){
+		std::uint32_t len=0;
+		std::uint32_t crc=0;
+		std::memcpy(&len,data.data()+pos,sizeof(len));
+		std::memcpy(&crc,data.data()+pos+4,sizeof(crc));
+		if(len<MIN_BODY || len>MAX_BODY || data.size()-pos-HEADER_SIZE<len)break;
+		const char *body=data.data()+pos+HEADER_SIZE;
+		if(crc32(body,len)!=crc)break;
+		const auto type=static_cast<RecordType>(static_cast<u8>(body[0]));
+		u64 seq=0;
+		std::memcpy(&seq,body+1,sizeof(seq));
+		if(seq>state.journalSeq){
+			if(!apply(state,type,seq,std::string_view(body+MIN_BODY,len-MIN_BODY)))break;
+			++applied;
+		}
+		if(seq>lastSeq_)lastSeq_=seq;
+		pos+=HEADER_SIZE+len;
+	}
+	goodBytes=pos;
+	if(applied>0)std::cout<<"Journal: replayed "<<applied<<" records\n";
+	return true;
+}
+
+bool Journal::apply(DbState &state,RecordType type,u64 seq,std::string_view body) {
+	Reader r(body);
+	const u64 uid=r.get<u64>();
+	if(type==RecordType::UserCreated || type==RecordType::UserCreatedKdf){
+		UserAuth a;
+		UserProfile p;
+		a.uid=uid;
+		a.handle=r.getString();
+		p.displayName=r.getString();
+		a.passwordHash=r.getHash(type==RecordType::UserCreatedKdf);
+		a.allowMultiLogin=r.get<u8>()!=0u;
+		if(!r.ok() || uid==0)return false; // uids start at 1
+		if(uid>=state.nextUid)state.nextUid=uid+1;
+		state.users.add(std::move(a),std::move(p),seq);
+		return true;
+	}
+	const bool known=state.users.contains(uid);
+	switch(type){
+	case RecordType::LoginRecorded:{
+		LoginRecord rec;
+		rec.epochSeconds=r.get<u64>();
+		rec.ip=parseIp(r.getString());
+		if(r.ok() && known)state.users.editProfile(uid,seq).history.push(rec);
+		break;
+	}
+	case RecordType::LoginRecordedIp:{
+		LoginRecord rec;
+		rec.epochSeconds=r.get<u64>();
+		r.getBytes(rec.ip.data(),rec.ip.size());
+		if(r.ok() && known)state.users.editProfile(uid,seq).history.push(rec);
+		break;
+	}
+	case RecordType::PasswordChanged:
+	case RecordType::PasswordChangedKdf:{
+		const PasswordHash hash=r.getHash(type==RecordType::PasswordChangedKdf);
+		if(r.ok() && known)state.users.setPasswordHash(uid,hash);
+		break;
+	}
+	case RecordType::HandleChanged:{
+		std::string handle=r.getString();
+		if(r.ok() && known)state.users.changeHandle(uid,handle);
+		break;
+	}
+	case RecordType::DisplayNameChanged:{
+		std::string name=r.getString();
+		if(r.ok() && known)state.users.editProfile(uid,seq).displayName=std::move(name);
+		break;
+	}
+	case RecordType::MultiLoginChanged:{
+		const u8 allow=r.get<u8>();
+		if(r.ok() && known)state.users.setAllowMultiLogin(uid,allow!=0u);
+		break;
+	}
+	default:
+		return false;
+	}
+	return r.ok();
+}
+
+void Journal::begin(RecordType type) {
+	rec_.assign(HEADER_SIZE,'\0');
+	put(rec_,static_cast<u8>(type));
+	put(rec_,++lastSeq_);
+}
+
+bool Journal::commit() {
+	const std::uint32_t len=static_cast<std::uint32_t>(rec_.size()-HEADER_SIZE);
+	const std::uint32_t crc=crc32(rec_.data()+HEADER_SIZE,len);
+	std::memcpy(&rec_[0],&len,sizeof(len));
+	std::memcpy(&rec_[4],&crc,sizeof(crc));
+	if(fd_<0)return false;
+	if(grouped_){
+		bool wake=false;
+		{
+			std::lock_guard<std::mutex> lock(bufMutex_);
+			if(batch_.empty())batchStarted_=std::chrono::steady_clock::now();
+			batch_.append(rec_);
+			++batchRecords_;
+			batchLastSeq_=lastSeq_;
+			wake=(batchRecords_==1 || batchRecords_>=maxRecords_);
+		}
+		if(wake)bufCv_.notify_one();
+		size_+=rec_.size();
+		return true;
+	}
+	if(!writeAll(fd_,rec_))return false;
+	size_+=rec_.size();
+	durableSeq_.store(lastSeq_);
+	return true;
+}
+
+// A failed write is cut back so half a record never sits in front of the
+// next one.
+bool Journal::writeAll(int fd,const std::string &data) {
+	struct stat st{};
+	const bool sized=::fstat(fd,&st)==0;
+	std::size_t off=0;
+	while(off<data.size()){
+		ssize_t n=::write(fd,data.data()+off,data.size()-off);
+		if(n<0){
+			if(errno==EINTR)continue;
+			std::perror("journal write");
+			if(off>0 && sized && ::ftruncate(fd,st.st_size)<0)std::perror("journal truncate");
+			return false;
+		}
+		off+=static_cast<std::size_t>(n);
+	}
+	return true;
+}
+
+void Journal::startGroupCommit(std::chrono::microseconds window,std::size_t maxRecords,std::function<void(u64)> onDurable) {
+	window_=window;
+	maxRecords_=maxRecords>0?maxRecords:1;
+	onDurable_=std::move(onDurable);
+	grouped_=true;
+	committer_=std::jthread([this](std::stop_token stop){commitLoop(stop);});
+}
+
+void Journal::commitLoop(std::stop_token stop) {
+	using namespace std::chrono;
+	std::string data; // kept across a failed attempt and retried
+	u64 upTo=0;
+	for(;;){
+		{
+			std::unique_lock<std::mutex> lock(bufMutex_);
+			// stop only once the batch has been flushed
+			bufCv_.wait(lock,stop,[&](){return !batch_.empty() || !data.empty();});
+			if(batch_.empty() && data.empty())return;
+			if(!stop.stop_requested()){
+				bufCv_.wait_until(lock,stop,batchStarted_+window_,[this](){return batchRecords_>=maxRecords_;});
+			}
+		}
+		const auto started=steady_clock::now();
+		std::lock_guard<std::mutex> io(ioMutex_);
+		int fd=-1;
+		std::size_t records=0;
+		{
+			std::lock_guard<std::mutex> lock(bufMutex_);
+			data.append(batch_);
+			batch_.clear();
+			records=batchRecords_;
+			batchRecords_=0;
+			if(batchLastSeq_>upTo)upTo=batchLastSeq_;
+			fd=fd_;
+		}
+		const bool ok=writeAll(fd,data) && ::fdatasync(fd)==0;
+		const u64 us=static_cast<u64>(duration_cast<microseconds>(steady_clock::now()-started).count());
+		{
+			std::lock_guard<std::mutex> lock(bufMutex_);
+			if(ok){
+				++batches_;
+				batchedRecords_+=records;
+				syncTotalUs_+=us;
+				if(us>syncMaxUs_)syncMaxUs_=us;
+			}else{
+				++failures_;
+			}
+		}
+		if(!ok){
+			std::perror("journal sync");
+			if(stop.stop_requested())return;
+			std::this_thread::sleep_for(milliseconds(100));
+			continue;
+		}
+		data.clear();
+		durableSeq_.store(upTo);
+		if(onDurable_ && !stop.stop_requested())onDurable_(upTo);
+	}
+}
+
+JournalCommitStats Journal::commitStats() const {
+	std::lock_guard<std::mutex> lock(bufMutex_);
+	JournalCommitStats s;
+	s.batches=batches_;
+	s.records=batchedRecords_;
+	s.failures=failures_;
+	if(batches_>0)s.syncAvgUs=syncTotalUs_/batches_;
+	s.syncMaxUs=syncMaxUs_;
+	return s;
+}
+
+bool Journal::userCreated(const UserAuth &auth,const std::string &displayName) {
+	begin(RecordType::UserCreatedKdf);
+	put(rec_,auth.uid);
+	putString(rec_,auth.handle);
+	putString(rec_,displayName);
+	putHash(rec_,auth.passwordHash);
+	put(rec_,static_cast<u8>(auth.allowMultiLogin?1u:0u));
+	return commit();
+}
+
+bool Journal::loginRecorded(u64 uid,const LoginRecord &rec) {
+	begin(RecordType::LoginRecordedIp);
+	put(rec_,uid);
+	put(rec_,rec.epochSeconds);
+	rec_.append(reinterpret_cast<const char*>(rec.ip.data()),rec.ip.size());
+	return commit();
+}
+
+bool Journal::passwordChanged(u64 uid,const PasswordHash &hash) {
+	begin(RecordType::PasswordChangedKdf);
+	put(rec_,uid);
+	putHash(rec_,hash);
+	return commit();
+}
+
+bool Journal::handleChanged(u64 uid,std::string_view handle) {
+	begin(RecordType::HandleChanged);
+	put(rec_,uid);
+	putString(rec_,handle);
+	return commit();
+}
+
+bool Journal::displayNameChanged(u64 uid,const std::string &name) {
+	begin(RecordType::DisplayNameChanged);
+	put(rec_,uid);
+	putString(rec_,name);
+	return commit();
+}
+
+bool Journal::multiLoginChanged(u64 uid,bool allow) {
+	begin(RecordType::MultiLoginChanged);
+	put(rec_,uid);
+	put(rec_,static_cast<u8>(allow?1u:0u));
+	return commit();
+}
+
+bool Journal::reset() {
+	if(fd_<0)return false;
+	if(::ftruncate(fd_,0)<0){
+		std::perror("journal truncate");
+		return false;
+	}
+	size_=0;
+	return true;
+}
+
+bool Journal::prepareRotate() {
+	if(rotating_ || spareFd_>=0)return true;
+	spareFd_=::open(nextPath_.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC,0644);
+	if(spareFd_<0){
+		std::perror("journal open");
+		return false;
+	}
+	return true;
+}
+
+bool Journal::rotate() {
+	if(rotating_)return true; // still appending to the next file
+	if(spareFd_<0)return false;
+	std::lock_guard<std::mutex> lock(bufMutex_);
+	retiredFd_=fd_;
+	fd_=spareFd_;
+	spareFd_=-1;
+	size_=0;
+	rotating_=true;
+	return true;
+}
+
+bool Journal::finishRotate() {
+	if(!rotating_)return true;
+	if(std::rename(nextPath_.c_str(),path_.c_str())!=0){
+		std::perror("journal rename");
+		return false;
+	}
+	if(retiredFd_>=0){
+		// the committer may still be writing an older batch to it
+		std::lock_guard<std::mutex> io(ioMutex_);
+		::close(retiredFd_);
+		retiredFd_=-1;
+	}
+	rotating_=false;
+	return true;
+}
+
+} // namespace qchat
@@ -0,0 +1,156 @@
+#ifndef QCHAT_JOURNAL_HPP
+#define QCHAT_JOURNAL_HPP
+
+#include "chat_common.hpp"
+#include "user_store.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace qchat {
+
+// Append-only log of database mutations, replayed on top of the last
+// snapshot at startup. Every record is
+//
+//   u32 body length | u32 CRC-32 of body | body
+//   body = u8 type | u64 seq | type-specific fields
+//
+// with integers in host byte order like the snapshot. seq increases across
+// the lifetime of the database; the snapshot stores the last seq it already
+// contains so records that survive a crash during compaction are skipped
+// instead of applied twice. A torn or corrupt tail is cut off at the last
+// good record.
+//
+// Compaction runs beside the writers by rotating: new records go to
+// <path>.next while the snapshot is written, and once it is durable
+// <path>.next is renamed over <path>. A crash in between leaves both files,
+// which are replayed in order.
+//
+// A hash is written as its 64-byte digest, the salt, then u8 kind, memLog2
+// and passes; the older types without the KDF fields hold unsalted SHA3.
+//
+// Without group commit every record is written as it is made and nothing is
+// synced. With it, records collect in memory and a committer thread writes
+// each batch with one write() and one fdatasync(), then reports the last seq
+// that is durable.
+struct JournalCommitStats {
+	u64 batches{0};
+	u64 records{0};
+	u64 failures{0};     // write or sync errors, batch retried
+	u64 syncAvgUs{0};    // write + fdatasync per batch
+	u64 syncMaxUs{0};
+};
+
+class Journal {
+public:
+	enum class RecordType : u8 {
+		UserCreated=1,        // uid, handle, display name, digest, multi-login (read only)
+		LoginRecorded=2,      // uid, epoch seconds, ip text (read only)
+		PasswordChanged=3,    // uid, digest (read only)
+		HandleChanged=4,      // uid, handle
+		DisplayNameChanged=5, // uid, display name
+		MultiLoginChanged=6,  // uid, flag
+		LoginRecordedIp=7,    // uid, epoch seconds, 16-byte ip
+		UserCreatedKdf=8,     // uid, handle, display name, hash, multi-login
+		PasswordChangedKdf=9  // uid, hash
+	};
+
+	explicit Journal(const std::string &path);
+	~Journal();
+
+	Journal(const Journal&)=delete;
+	Journal &operator=(const Journal&)=delete;
+
+	// Applies every record newer than state.journalSeq, then opens the file
+	// for appending.
+	bool open(DbState &state);
+
+	u64 lastSeq() const {return lastSeq_;}
+	// bytes in the file currently appended to
+	std::size_t sizeBytes() const {return size_;}
+	// true while records live in <path>.next
+	bool rotating() const {return rotating_;}
+
+	// Starts the committer thread. A batch is written once it is window old
+	// or holds maxRecords records; onDurable runs on the committer thread
+	// after each successful sync.
+	void startGroupCommit(std::chrono::microseconds window,std::size_t maxRecords,std::function<void(u64)> onDurable);
+	// Last seq known to be on disk (or, without group commit, written).
+	// Thread-safe.
+	u64 durableSeq() const {return durableSeq_.load();}
+	JournalCommitStats commitStats() const;
+
+	// Each call appends one record; false if the write failed.
+	bool userCreated(const UserAuth &auth,const std::string &displayName);
+	bool loginRecorded(u64 uid,const LoginRecord &rec);
+	bool passwordChanged(u64 uid,const PasswordHash &hash);
+	bool handleChanged(u64 uid,std::string_view handle);
+	bool displayNameChanged(u64 uid,const std::string &name);
+	bool multiLoginChanged(u64 uid,bool allow);
+
+	// Drops every record; call once a snapshot holding lastSeq() is durable.
+	bool reset();
+
+	// Rotation, driven by a single compacting thread. prepareRotate() opens
+	// the next file without holding the DB lock; rotate() switches appends to
+	// it and must hold the lock; finishRotate() retires the old file once a
+	// snapshot covering everything before the switch is durable. rotate()
+	// returns false if there was no file to switch to.
+	bool prepareRotate();
+	bool rotate();
+	bool finishRotate();
+
+private:
+	std::string path_;
+	std::string nextPath_;
+	int fd_{-1};
+	int spareFd_{-1};   // opened by prepareRotate()
+	int retiredFd_{-1}; // appended to before rotate()
+	bool rotating_{false};
+	u64 lastSeq_{0};
+	std::size_t size_{0};
+	std::string rec_; // scratch buffer for the record being built
+
+	// group commit; bufMutex_ guards the batch and fd_ while it runs, ioMutex_
+	// is held across each write and sync so a retired fd is never closed
+	// under the committer (lock order ioMutex_ -> bufMutex_)
+	bool grouped_{false};
+	std::chrono::microseconds window_{0};
+	std::size_t maxRecords_{0};
+	std::function<void(u64)> onDurable_;
+	mutable std::mutex bufMutex_;
+	std::condition_variable_any bufCv_;
+	std::mutex ioMutex_;
+	std::string batch_;
+	std::size_t batchRecords_{0};
+	u64 batchLastSeq_{0};
+	std::chrono::steady_clock::time_point batchStarted_;
+	std::atomic<u64> durableSeq_{0};
+	u64 batches_{0};     // guarded by bufMutex_, like the counters below
+	u64 batchedRecords_{0};
+	u64 failures_{0};
+	u64 syncTotalUs_{0};
+	u64 syncMaxUs_{0};
+	std::jthread committer_;
+
+	void begin(RecordType type);
+	bool commit();
+	void commitLoop(std::stop_token stop);
+	static bool writeAll(int fd,const std::string &data);
+	bool replay(const std::string &path,DbState &state,std::size_t &goodBytes);
+	bool openForAppend(const std::string &path,std::size_t goodBytes);
+	static bool apply(DbState &state,RecordType type,u64 seq,std::string_view body);
+};
+
+} // namespace qchat
+
+#endif
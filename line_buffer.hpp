@@ -0,0 +1,86 @@
+#ifndef QCHAT_LINE_BUFFER_HPP
+#define QCHAT_LINE_BUFFER_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace qchat {
+
+// Splits a byte stream into '\n'-terminated lines. Complete lines inside
+// the chunk being fed are handed out as views into that chunk; only a line
+// split across reads is copied, into a single carry-over buffer that never
+// grows past maxLine.
+class LineBuffer {
+public:
+	static constexpr std::size_t DEFAULT_MAX_LINE=16*1024;
+
+	enum class Event {
+		Line,    // view holds one line, without the '\n'
+		TooLong  // a line exceeded maxLine and is being discarded
+	};
+
+	void setMaxLine(std::size_t n) {maxLine_=n;}
+	std::size_t maxLine() const {return maxLine_;}
+
+	// Calls onEvent(Event,std::string_view) for each line; a false return
+	// stops right after that line. Returns the number of bytes of data
+	// consumed. Views are only valid for the duration of the call.
+	template<class F>
+	std::size_t feed(const char *data,std::size_t len,F &&onEvent) {
+		const std::size_t total=len;
+		while(len>0){
+			const char *nl=static_cast<const char*>(std::memchr(data,'\n',len));
+			if(nl==nullptr){
+				stash(data,len,onEvent);
+				return total;
+			}
+			const std::size_t n=static_cast<std::size_t>(nl-data);
+			const char *line=data;
+			data=nl+1;
+			len-=n+1;
+			if(discarding_){
+				// tail of an oversized line; resynchronise after its '\n'
+				discarding_=false;
+				continue;
+			}
+			bool more;
+			if(carry_.empty()){
+				more=(n>maxLine_)?onEvent(Event::TooLong,std::string_view())
+					:onEvent(Event::Line,std::string_view(line,n));
+			}else if(carry_.size()+n>maxLine_){
+				carry_.clear();
+				more=onEvent(Event::TooLong,std::string_view());
+			}else{
+				carry_.append(line,n);
+				more=onEvent(Event::Line,std::string_view(carry_));
+				carry_.clear();
+			}
+			if(!more)return total-len;
+		}
+		return total;
+	}
+
+private:
+	std::string carry_;
+	std::size_t maxLine_{DEFAULT_MAX_LINE};
+	bool discarding_{false};
+
+	template<class F>
+	void stash(const char *data,std::size_t len,F &onEvent) {
+		if(discarding_)return;
+		if(carry_.size()+len>maxLine_){
+			carry_.clear();
+			carry_.shrink_to_fit();
+			discarding_=true;
+			onEvent(Event::TooLong,std::string_view());
+			return;
+		}
+		carry_.append(data,len);
+	}
+};
+
+} // namespace qchat
+
+#endif
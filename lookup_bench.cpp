@@ -0,0 +1,204 @@
+// User lookup cost and index memory at a large user count, printed as one
+// JSON object:
+//
+//   lookup_bench [--users N] [--dir PATH] > before.json
+//
+// N users (default 1M) are written as a snapshot in --dir (default ".") and
+// loaded back with DbFile::load, so the UserStore is built the way the server
+// builds it at startup. Each lookup pass visits every user once in random
+// order; the best of five passes is reported per lookup.
+//
+// store     UserStore::byHandle (the snapshot's mmapped handle index) and
+//           byUid (the auth columns)
+// legacy    the indexes before them: std::unordered_map<std::string,u64>
+//           and std::unordered_map<u64,UserAuth>
+//
+// bytes_per_user is heap use while building, from bench_common's operator
+// new; the store also reports its own tableBytes and load_ms, the time
+// DbFile::load takes with the file in the page cache. A miss looks up a handle
+// that was never added. The legacy map has no heterogeneous lookup, so it
+// builds a std::string key per probe, as the server did.
+
+#include "bench_common.hpp"
+#include "db_file.hpp"
+#include "user_store.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+using bench::HeapCount;
+using qchat::u64;
+
+volatile u64 sink;
+
+std::string handleFor(u64 uid) {
+	return "user"+std::to_string(uid*2654435761u%100000007u)+"_"+std::to_string(uid);
+}
+
+template<class Fn>
+double nsPerLookup(std::size_t lookups,Fn &&pass) {
+	return bench::bestNs(0,pass)/static_cast<double>(lookups);
+}
+
+void printRow(bool &first,const char *index,const char *lookup,double ns) {
+	std::printf("%s\n    {\"index\": \"%s\", \"lookup\": \"%s\", \"ns\": %.1f}",first?"":",",index,lookup,ns);
+	first=false;
+}
+
+} // namespace
+
+int main(int argc,char **argv) {
+	std::size_t users=1000000;
+	std::string dir=".";
+	for(int i=1;i<argc;++i){
+		const std::string arg=argv[i];
+		if(arg=="--users" && i+1<argc){
+			users=std::strtoull(argv[++i],nullptr,10);
+		}else if(arg=="--dir" && i+1<argc){
+			dir=argv[++i];
+		}else{
+			std::fprintf(stderr,"Usage: %s [--users N] [--dir PATH]\n",argv[0]);
+			return 1;
+		}
+	}
+	if(users==0)users=1;
+	const std::string path=dir+"/lookup_bench.db";
+
+	std::vector<std::string> handles(users);
+	std::vector<std::string> missing(users);
+	for(std::size_t i=0;i<users;++i){
+		handles[i]=handleFor(i+1);
+		missing[i]="nobody"+std::to_string(i);
+	}
+	std::vector<u64> order(users);
+	for(std::size_t i=0;i<users;++i)order[i]=i+1;
+	std::mt19937_64 rng(20240601);
+	std::shuffle(order.begin(),order.end(),rng);
+	// probe keys laid out in visit order, so fetching the key is not a
+	// cache miss of its own
+	std::string hitText;
+	std::string missText;
+	for(u64 uid:order){
+		hitText+=handles[uid-1];
+		missText+=missing[uid-1];
+	}
+	std::vector<std::string_view> hitKeys;
+	std::vector<std::string_view> missKeys;
+	for(std::size_t k=0,hitAt=0,missAt=0;k<users;++k){
+		const u64 uid=order[k];
+		hitKeys.emplace_back(hitText.data()+hitAt,handles[uid-1].size());
+		missKeys.emplace_back(missText.data()+missAt,missing[uid-1].size());
+		hitAt+=handles[uid-1].size();
+		missAt+=missing[uid-1].size();
+	}
+
+	{
+		qchat::DbImage image;
+		image.nextUid=users+1;
+		for(std::size_t i=0;i<users;++i){
+			image.uids.push_back(i+1);
+			image.handles.push_back(handles[i]);
+			image.hashes.push_back(qchat::PasswordHash{});
+			image.multiLogin.push_back(0);
+		}
+		qchat::DbFile file(path);
+		if(!file.saveEncoded(qchat::DbFile::encode(image))){
+			std::fprintf(stderr,"cannot write %s\n",path.c_str());
+			return 1;
+		}
+	}
+
+	const HeapCount beforeStore=bench::heapCount();
+	const auto loadStarted=bench::Clock::now();
+	qchat::DbState state;
+	if(!qchat::DbFile(path).load(state) || state.users.size()!=users){
+		std::fprintf(stderr,"cannot load %s\n",path.c_str());
+		::unlink(path.c_str());
+		return 1;
+	}
+	const double loadMs=bench::nsSince(loadStarted)/1e6;
+	const HeapCount storeHeap=bench::heapCount()-beforeStore;
+	const qchat::UserStoreStats stats=state.users.stats();
+
+	const HeapCount beforeLegacy=bench::heapCount();
+	std::unordered_map<std::string,u64> legacyHandles;
+	std::unordered_map<u64,qchat::UserAuth> legacyAuth;
+	for(std::size_t i=0;i<users;++i){
+		qchat::UserAuth auth;
+		auth.uid=i+1;
+		auth.handle=handles[i];
+		legacyHandles.emplace(auth.handle,auth.uid);
+		legacyAuth.emplace(auth.uid,std::move(auth));
+	}
+	const HeapCount legacyHeap=bench::heapCount()-beforeLegacy;
+
+	const double perUser=static_cast<double>(users);
+	std::printf("{\n  \"optimized\": %s,\n  \"compiler\": \"%s\",\n  \"users\": %zu,\n",
+		bench::OPTIMIZED?"true":"false",__VERSION__,users);
+	std::printf("  \"memory\": [\n    {\"index\": \"store\", \"bytes_per_user\": %.1f, \"table_bytes_per_user\": %.1f, "
+		"\"load_ms\": %.1f},\n"
+		"    {\"index\": \"legacy\", \"bytes_per_user\": %.1f, \"allocs_per_user\": %.2f}\n  ],\n",
+		static_cast<double>(storeHeap.bytes)/perUser,static_cast<double>(stats.tableBytes)/perUser,loadMs,
+		static_cast<double>(legacyHeap.bytes)/perUser,static_cast<double>(legacyHeap.allocs)/perUser);
+
+	qchat::UserStore &store=state.users;
+	std::printf("  \"lookup\": [");
+	bool first=true;
+	printRow(first,"store","handle_hit",nsPerLookup(users,[&]{
+		u64 sum=0;
+		for(std::string_view key:hitKeys){
+			if(auto row=store.byHandle(key))sum+=row->uid();
+		}
+		sink=sum;
+	}));
+	printRow(first,"legacy","handle_hit",nsPerLookup(users,[&]{
+		u64 sum=0;
+		for(std::string_view key:hitKeys){
+			auto it=legacyHandles.find(std::string(key));
+			if(it!=legacyHandles.end())sum+=it->second;
+		}
+		sink=sum;
+	}));
+	printRow(first,"store","handle_miss",nsPerLookup(users,[&]{
+		u64 sum=0;
+		for(std::string_view key:missKeys){
+			if(!store.byHandle(key))++sum;
+		}
+		sink=sum;
+	}));
+	printRow(first,"legacy","handle_miss",nsPerLookup(users,[&]{
+		u64 sum=0;
+		for(std::string_view key:missKeys){
+			if(legacyHandles.find(std::string(key))==legacyHandles.end())++sum;
+		}
+		sink=sum;
+	}));
+	printRow(first,"store","uid_auth",nsPerLookup(users,[&]{
+		u64 sum=0;
+		for(u64 uid:order){
+			if(auto row=store.byUid(uid))sum+=row->passwordHash().digest[0]+row->handle().size();
+		}
+		sink=sum;
+	}));
+	printRow(first,"legacy","uid_auth",nsPerLookup(users,[&]{
+		u64 sum=0;
+		for(u64 uid:order){
+			auto it=legacyAuth.find(uid);
+			if(it!=legacyAuth.end())sum+=it->second.passwordHash.digest[0]+it->second.handle.size();
+		}
+		sink=sum;
+	}));
+	std::printf("\n  ]\n}\n");
+	::unlink(path.c_str());
+	return 0;
+}
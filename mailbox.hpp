@@ -0,0 +1,53 @@
+#ifndef QCHAT_MAILBOX_HPP
+#define QCHAT_MAILBOX_HPP
+
+#include <atomic>
+#include <utility>
+
+namespace qchat {
+
+// Unbounded lock-free multi-producer / single-consumer queue (Vyukov).
+// push() may be called from any thread, pop() only from the owning one.
+template<class T>
+class Mailbox {
+public:
+	Mailbox():head_(new Node()),tail_(head_.load(std::memory_order_relaxed)) {}
+
+	~Mailbox() {
+		T tmp;
+		while(pop(tmp)){}
+		delete tail_;
+	}
+
+	Mailbox(const Mailbox&)=delete;
+	Mailbox &operator=(const Mailbox&)=delete;
+
+	void push(T value) {
+		Node *n=new Node();
+		n->value=std::move(value);
+		Node *prev=head_.exchange(n,std::memory_order_acq_rel);
+		prev->next.store(n,std::memory_order_release);
+	}
+
+	bool pop(T &out) {
+		Node *next=tail_->next.load(std::memory_order_acquire);
+		if(next==nullptr)return false;
+		out=std::move(next->value);
+		delete tail_;
+		tail_=next;
+		return true;
+	}
+
+private:
+	struct Node {
+		std::atomic<Node*> next{nullptr};
+		T value{};
+	};
+
+	std::atomic<Node*> head_;
+	Node *tail_;
+};
+
+} // namespace qchat
+
+#endif
@@ -0,0 +1,400 @@
+#include "offline_queue.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace qchat {
+
+namespace {
+
+constexpr char MAGIC[8]={'Q','C','H','A','T','O','Q','1'};
+constexpr std::size_t HEADER=sizeof(MAGIC);
+constexpr std::size_t REC_HEAD=4+4+1+8; // length, crc, type, uid
+constexpr std::size_t REC_CRC_FROM=8;
+constexpr std::size_t MAX_RECORD=4u*1024u*1024u;
+constexpr u64 MAX_READ_GAP=64u*1024u;   // of other users' records read through
+constexpr u64 MAX_READ_RUN=1024u*1024u;  // bytes in one pread
+
+enum class RecordType : u8 {
+	Queued=1,
+	Delivered=2
+};
+
+template<class T>
+void put(std::string &out,const T &v) {
+	out.append(reinterpret_cast<const char*>(&v),sizeof(v));
+}
+
+template<class T>
+T get(const char *p) {
+	T v;
+	std::memcpy(&v,p,sizeof(v));
+	return v;
+}
+
+// Fills in the length and crc of the record built in rec.
+void seal(std::string &rec) {
+	const std::uint32_t len=static_cast<std::uint32_t>(rec.size());
+	std::memcpy(rec.data(),&len,sizeof(len));
+	const std::uint32_t crc=crc32(rec.data()+REC_CRC_FROM,rec.size()-REC_CRC_FROM);
+	std::memcpy(rec.data()+4,&crc,sizeof(crc));
+}
+
+void begin(std::string &rec,RecordType type,u64 uid) {
+	rec.assign(REC_CRC_FROM,'\0');
+	put(rec,static_cast<u8>(type));
+	put(rec,uid);
+}
+
+bool writeAt(int fd,const char *data,std::size_t len,u64 at) {
+	std::size_t off=0;
+	while(off<len){
+		ssize_t n=::pwrite(fd,data+off,len-off,static_cast<off_t>(at+off));
+		if(n<0){
+			if(errno==EINTR)continue;
+			return false;
+		}
+		off+=static_cast<std::size_t>(n);
+	}
+	return true;
+}
+
+bool readAt(int fd,char *out,std::size_t len,u64 off) {
+	std::size_t got=0;
+	while(got<len){
+		ssize_t n=::pread(fd,out+got,len-got,static_cast<off_t>(off+got));
+		if(n<0){
+			if(errno==EINTR)continue;
+			return false;
+		}
+		if(n==0)return false;
+		got+=static_cast<std::size_t>(n);
+	}
+	return true;
+}
+
+bool readFile(const std::string &path,std::string &out) {
+	int fd=::open(path.c_str(),O_RDONLY|O_CLOEXEC);
+	if(fd<0)return false;
+	out.clear();
+	char chunk[65536];
+	for(;;){
+		ssize_t n=::read(fd,chunk,sizeof(chunk));
+		if(n<0){
+			if(errno==EINTR)continue;
+			::close(fd);
+			return false;
+		}
+		if(n==0)break;
+		out.append(chunk,static_cast<std::size_t>(n));
+	}
+	::close(fd);
+	return true;
+}
+
+} // namespace
+
+OfflineQueue::OfflineQueue(std::string path,std::size_t capBytes)
+	:path_(std::move(path)),capBytes_(capBytes) {}
+
+OfflineQueue::~OfflineQueue() {
+	if(fd_>=0){
+		sync();
+		::close(fd_);
+	}
+}
+
+OfflineQueue::Batch::~Batch() {
+	release();
+}
+
+OfflineQueue::Batch::Batch(Batch &&other) noexcept
+	:owner_(std::exchange(other.owner_,nullptr)),extents_(std::move(other.extents_)) {}
+
+OfflineQueue::Batch &OfflineQueue::Batch::operator=(Batch &&other) noexcept {
+	if(this!=&other){
+		release();
+		owner_=std::exchange(other.owner_,nullptr);
+		extents_=std::move(other.extents_);
+	}
+	return *this;
+}
+
+void OfflineQueue::Batch::release() {
+	if(owner_!=nullptr)owner_->readers_.fetch_sub(1);
+	owner_=nullptr;
+}
+
+bool OfflineQueue::open() {
+	std::string data;
+	const bool fresh=!readFile(path_,data) || data.empty();
+	if(fresh)data.assign(MAGIC,HEADER);
+	if(data.size()<HEADER || std::memcmp(data.data(),MAGIC,HEADER)!=0){
+		std::cerr<<"Offline queue "<<path_<<" has a bad header\n";
+		return false;
+	}
+	u64 good=0;
+	replay(data,good);
+	if(good<data.size()){
+		std::cerr<<"Offline queue "<<path_<<": dropping "<<(data.size()-good)<<" bytes of torn tail\n";
+	}
+	data.resize(good);
+	// mostly delivered: start over with only what is still waiting
+	if(good-HEADER>2*liveBytes_ && !rewrite(data))return false;
+
+	fd_=::open(path_.c_str(),O_RDWR|O_CREAT|O_CLOEXEC,0644);
+	if(fd_<0)return false;
+	if(::ftruncate(fd_,fresh?0:static_cast<off_t>(size_))<0)return false;
+	if(fresh && !writeAt(fd_,MAGIC,HEADER,0))return false;
+	outAt_=size_;
+	return true;
+}
+
+bool OfflineQueue::replay(const std::string &data,u64 &goodBytes) {
+	std::size_t off=HEADER;
+	while(data.size()-off>=REC_HEAD){
+		const char *p=data.data()+off;
+		const std::uint32_t len=get<std::uint32_t>(p);
+		if(len<REC_HEAD || len>MAX_RECORD || len>data.size()-off)break;
+		if(crc32(p+REC_CRC_FROM,len-REC_CRC_FROM)!=get<std::uint32_t>(p+4))break;
+		const RecordType type=static_cast<RecordType>(p[8]);
+		const u64 uid=get<u64>(p+9);
+		if(type==RecordType::Queued){
+			if(len<REC_HEAD+8)break;
+			link(uid,off,len,len-REC_HEAD-8);
+		}else if(type==RecordType::Delivered){
+			dropQueue(uid);
+		}else{
+			break;
+		}
+		off+=len;
+	}
+	goodBytes=off;
+	size_=off;
+	return off==data.size();
+}
+
+// Writes the waiting records to a new file and replays that, so every
+// offset points into it.
+bool OfflineQueue::rewrite(const std::string &data) {
+	std::string out(MAGIC,HEADER);
+	out.reserve(HEADER+liveBytes_);
+	for(const auto &kv:queues_){
+		for(std::uint32_t i=kv.second.head;i!=NIL;i=entries_[i].next){
+			out.append(data,entries_[i].offset,entries_[i].len);
+		}
+	}
+	const std::string tmpPath=path_+".tmp";
+	int fd=::open(tmpPath.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC,0644);
+	if(fd<0)return false;
+	const bool ok=writeAt(fd,out.data(),out.size(),0) && ::fsync(fd)==0;
+	::close(fd);
+	if(!ok || std::rename(tmpPath.c_str(),path_.c_str())!=0)return false;
+
+	queues_.clear();
+	entries_.clear();
+	freeHead_=NIL;
+	messages_=0;
+	liveBytes_=0;
+	u64 good=0;
+	replay(out,good);
+	return true;
+}
+
+std::uint32_t OfflineQueue::allocEntry() {
+	if(freeHead_!=NIL){
+		const std::uint32_t i=freeHead_;
+		freeHead_=entries_[i].next;
+		return i;
+	}
+	entries_.emplace_back();
+	return static_cast<std::uint32_t>(entries_.size()-1);
+}
+
+void OfflineQueue::link(u64 uid,u64 offset,std::uint32_t len,std::size_t lineBytes) {
+	const std::uint32_t i=allocEntry();
+	entries_[i]=Entry{offset,len,NIL};
+	Queue &q=queues_[uid];
+	if(q.tail==NIL){
+		q.head=i;
+	}else{
+		entries_[q.tail].next=i;
+	}
+	q.tail=i;
+	++q.count;
+	q.bytes+=lineBytes;
+	++messages_;
+	liveBytes_+=len;
+}
+
+void OfflineQueue::dropQueue(u64 uid) {
+	auto it=queues_.find(uid);
+	if(it==queues_.end())return;
+	const Queue &q=it->second;
+	for(std::uint32_t i=q.head;i!=NIL;){
+		const std::uint32_t next=entries_[i].next;
+		liveBytes_-=entries_[i].len;
+		entries_[i].next=freeHead_;
+		freeHead_=i;
+		i=next;
+	}
+	messages_-=q.count;
+	queues_.erase(it);
+}
+
+// Reserves rec's place at the end of the log; flush() writes it there.
+void OfflineQueue::append(const std::string &rec) {
+	size_+=rec.size();
+	std::lock_guard<std::mutex> lock(bufMutex_);
+	out_.append(rec);
+}
+
+// Nothing is waiting and no batch is still to be read: the log starts over.
+// Whatever is pending is dead and dropped; the next flush() cuts the file.
+void OfflineQueue::startOver() {
+	entries_.clear();
+	freeHead_=NIL;
+	size_=HEADER;
+	std::lock_guard<std::mutex> lock(bufMutex_);
+	out_.clear();
+	outAt_=HEADER;
+	cut_=true;
+	++generation_;
+}
+
+OfflineQueue::PushResult OfflineQueue::push(u64 uid,std::string_view line) {
+	if(!line.empty() && line.back()=='\n')line.remove_suffix(1);
+	std::size_t waiting=0;
+	auto it=queues_.find(uid);
+	if(it!=queues_.end())waiting=it->second.bytes;
+	if(waiting+line.size()>capBytes_ || REC_HEAD+8+line.size()>MAX_RECORD){
+		++rejected_;
+		return PushResult::Full;
+	}
+	if(queues_.empty() && size_>HEADER && readers_.load()==0)startOver();
+	begin(rec_,RecordType::Queued,uid);
+	put(rec_,nowEpochSeconds());
+	rec_.append(line);
+	seal(rec_);
+	const u64 at=size_;
+	append(rec_);
+	link(uid,at,static_cast<std::uint32_t>(rec_.size()),line.size());
+	++queued_;
+	return PushResult::Queued;
+}
+
+OfflineQueue::Batch OfflineQueue::take(u64 uid) {
+	Batch batch;
+	auto it=queues_.find(uid);
+	if(it==queues_.end())return batch;
+	batch.extents_.reserve(it->second.count);
+	for(std::uint32_t i=it->second.head;i!=NIL;i=entries_[i].next){
+		batch.extents_.push_back(Extent{entries_[i].offset,entries_[i].len});
+	}
+	batch.owner_=this;
+	readers_.fetch_add(1);
+	dropQueue(uid);
+	delivered_+=batch.size();
+
+	begin(rec_,RecordType::Delivered,uid);
+	seal(rec_);
+	append(rec_);
+	return batch;
+}
+
+bool OfflineQueue::flush() {
+	std::lock_guard<std::mutex> io(ioMutex_);
+	return flushLocked();
+}
+
+bool OfflineQueue::flushLocked() {
+	std::string data;
+	u64 at=0;
+	bool cut=false;
+	u64 generation=0;
+	{
+		std::lock_guard<std::mutex> lock(bufMutex_);
+		if(out_.empty() && !cut_)return true;
+		data.swap(out_);
+		at=outAt_;
+		outAt_+=data.size();
+		cut=std::exchange(cut_,false);
+		generation=generation_;
+	}
+	const bool ok=(!cut || ::ftruncate(fd_,static_cast<off_t>(at))==0)
+		&& writeAt(fd_,data.data(),data.size(),at);
+	if(cut || ok)dirty_.store(true);
+	if(ok)return true;
+
+	std::cerr<<"Offline queue write failed: "<<std::strerror(errno)<<"\n";
+	// put it back in front of anything pushed meanwhile, unless the log has
+	// started over and it is dead
+	std::lock_guard<std::mutex> lock(bufMutex_);
+	if(generation==generation_){
+		data.append(out_);
+		out_.swap(data);
+		outAt_=at;
+		cut_=cut_ || cut;
+	}
+	return false;
+}
+
+std::size_t OfflineQueue::read(Batch &batch,const std::function<void(u64,std::string_view)> &fn) {
+	const std::size_t n=batch.size();
+	if(n==0)return 0;
+	std::lock_guard<std::mutex> io(ioMutex_);
+	// the batch may still be sitting in out_
+	if(!flushLocked())std::cerr<<"Offline queue for this login may be incomplete\n";
+	const std::vector<Extent> &ext=batch.extents_;
+	for(std::size_t first=0;first<n;){
+		// one pread for each run of records with small gaps between them
+		const u64 from=ext[first].offset;
+		u64 to=from+ext[first].len;
+		std::size_t last=first+1;
+		while(last<n && ext[last].offset-to<=MAX_READ_GAP && ext[last].offset+ext[last].len-from<=MAX_READ_RUN){
+			to=ext[last].offset+ext[last].len;
+			++last;
+		}
+		readBuf_.resize(static_cast<std::size_t>(to-from));
+		if(!readAt(fd_,readBuf_.data(),readBuf_.size(),from)){
+			std::cerr<<"Offline queue read failed: "<<std::strerror(errno)<<"\n";
+		}else{
+			for(std::size_t k=first;k<last;++k){
+				const char *p=readBuf_.data()+(ext[k].offset-from);
+				fn(get<u64>(p+REC_HEAD),std::string_view(p+REC_HEAD+8,ext[k].len-REC_HEAD-8));
+			}
+		}
+		first=last;
+	}
+	batch.release();
+	return n;
+}
+
+bool OfflineQueue::sync() {
+	std::lock_guard<std::mutex> io(ioMutex_);
+	const bool flushed=flushLocked();
+	if(!dirty_.exchange(false))return flushed;
+	if(::fdatasync(fd_)==0)return flushed;
+	dirty_.store(true);
+	return false;
+}
+
+OfflineQueueStats OfflineQueue::stats() const {
+	OfflineQueueStats s;
+	s.users=queues_.size();
+	s.messages=messages_;
+	s.bytes=liveBytes_;
+	s.logBytes=size_;
+	s.queued=queued_;
+	s.delivered=delivered_;
+	s.rejected=rejected_;
+	return s;
+}
+
+} // namespace qchat
@@ -0,0 +1,168 @@
+#ifndef QCHAT_OFFLINE_QUEUE_HPP
+#define QCHAT_OFFLINE_QUEUE_HPP
+
+#include "chat_common.hpp"
+#include "flat_map.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace qchat {
+
+struct OfflineQueueStats {
+	u64 users{0};        // with something waiting
+	u64 messages{0};     // waiting
+	u64 bytes{0};        // live bytes in the log
+	u64 logBytes{0};     // size of the log, live or not
+	u64 queued{0};       // since start
+	u64 delivered{0};
+	u64 rejected{0};     // over a user's cap
+};
+
+// Private messages for users who are not online, kept in one shared
+// append-only log:
+//
+//   "QCHATOQ1", then records of
+//   u32 length | u32 CRC-32 of the rest | u8 type | u64 uid | type fields
+//
+//   Queued     epoch seconds, the line as it would have been sent
+//   Delivered  (none) everything queued for uid before it is gone
+//
+// Each user's waiting messages are a linked list of log offsets threaded
+// through one shared entry array, so a queue costs no allocation of its own.
+// The log is emptied whenever nothing is waiting and rewritten at startup if
+// mostly dead.
+//
+// push() and take() only touch memory and are called under the hub mutex.
+// The file work they leave behind runs after it is released: flush() writes
+// the records push() and take() built, read() fetches the lines take()
+// detached. Records are written before the pushing command is answered and
+// synced by sync(), so a process crash loses at most a message that was
+// never acknowledged and a power loss what was queued since the last sync().
+// A failed write is kept and retried at the same offset.
+class OfflineQueue {
+public:
+	enum class PushResult {
+		Queued,
+		Full
+	};
+
+	struct Extent {
+		u64 offset{0};
+		std::uint32_t len{0};
+	};
+
+	// The records of one user's queue, detached by take(). Keeps the log
+	// from being started over until it is read or destroyed.
+	class Batch {
+	public:
+		Batch()=default;
+		~Batch();
+		Batch(Batch &&other) noexcept;
+		Batch &operator=(Batch &&other) noexcept;
+		Batch(const Batch&)=delete;
+		Batch &operator=(const Batch&)=delete;
+
+		std::size_t size() const {return extents_.size();}
+
+	private:
+		friend class OfflineQueue;
+		OfflineQueue *owner_{nullptr};
+		std::vector<Extent> extents_; // ascending offsets
+		void release();
+	};
+
+	OfflineQueue(std::string path,std::size_t capBytes);
+	~OfflineQueue();
+
+	OfflineQueue(const OfflineQueue&)=delete;
+	OfflineQueue &operator=(const OfflineQueue&)=delete;
+
+	// Replays the log, compacting it first if that pays off.
+	bool open();
+
+	// Hub mutex held. Queues line for uid unless that would take its
+	// waiting lines past the cap; call flush() once the mutex is released.
+	PushResult push(u64 uid,std::string_view line);
+	// Hub mutex held. Detaches everything waiting for uid, to be passed to
+	// read() once the mutex is released.
+	Batch take(u64 uid);
+	bool waiting(u64 uid) const {return queues_.contains(uid);}
+
+	// The rest are safe from any thread without the hub mutex.
+
+	// Writes what push() and take() left pending.
+	bool flush();
+	// Calls fn(epochSeconds,line) for every message in batch, oldest first.
+	// Records that lie close together are fetched in one pread. Returns the
+	// number of messages.
+	std::size_t read(Batch &batch,const std::function<void(u64,std::string_view)> &fn);
+	// flush(), then fdatasync if anything was written since the last call.
+	bool sync();
+
+	OfflineQueueStats stats() const;
+
+private:
+	static constexpr std::uint32_t NIL=~std::uint32_t{0};
+
+	struct Entry {
+		u64 offset{0};          // of the record in the log
+		std::uint32_t len{0};   // of the record
+		std::uint32_t next{NIL};
+	};
+
+	struct Queue {
+		std::uint32_t head{NIL};
+		std::uint32_t tail{NIL};
+		std::uint32_t count{0};
+		std::size_t bytes{0};   // of the lines, for the cap
+	};
+
+	std::string path_;
+	std::size_t capBytes_;
+	int fd_{-1};
+
+	// hub mutex
+	u64 size_{0};            // of the log once everything pending is written
+	std::vector<Entry> entries_;
+	std::uint32_t freeHead_{NIL};
+	FlatMap<u64,Queue> queues_;
+	std::string rec_;        // scratch for the record being built
+	u64 messages_{0};
+	u64 liveBytes_{0};
+	u64 queued_{0};
+	u64 delivered_{0};
+	u64 rejected_{0};
+	std::atomic<std::size_t> readers_{0}; // batches not yet read
+
+	// bufMutex_ is only held to hand records over, never across a syscall
+	std::mutex bufMutex_;
+	std::string out_;        // records not yet written
+	u64 outAt_{0};           // where out_ goes in the file
+	bool cut_{false};        // truncate the file to outAt_ first
+	u64 generation_{0};      // bumped each time the log starts over
+
+	// ioMutex_ serialises the file; lock order ioMutex_ -> bufMutex_
+	std::mutex ioMutex_;
+	std::string readBuf_;
+	std::atomic<bool> dirty_{false};
+
+	std::uint32_t allocEntry();
+	void link(u64 uid,u64 offset,std::uint32_t len,std::size_t lineBytes);
+	void dropQueue(u64 uid);
+	void append(const std::string &rec);
+	void startOver();
+	bool flushLocked();
+	bool replay(const std::string &data,u64 &goodBytes);
+	bool rewrite(const std::string &data);
+};
+
+} // namespace qchat
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef QCHAT_OUT_QUEUE_HPP
+#define QCHAT_OUT_QUEUE_HPP
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <sys/uio.h>
+
+namespace qchat {
+
+// Immutable, refcounted wire buffer. Event loops keep a reference while the
+// kernel may still read from it, so it outlives the connection if needed.
+using OutBuf=std::shared_ptr<const std::string>;
+
+// Wraps one text-protocol line, adding the trailing newline if missing.
+// Bodies that arrived over the binary protocol may contain line breaks;
+// those become spaces so they cannot split the line. Fan-out paths build
+// the line once and queue the same OutBuf on every connection.
+inline OutBuf makeLine(std::string line) {
+	if(!line.empty() && line.back()=='\n')line.pop_back();
+	for(std::size_t i=line.find_first_of("\r\n");i!=std::string::npos;i=line.find_first_of("\r\n",i+1)){
+		line[i]=' ';
+	}
+	line.push_back('\n');
+	return std::make_shared<const std::string>(std::move(line));
+}
+
+// Per-connection queue of pending outbound buffers.
+class OutQueue {
+public:
+	void push(OutBuf buf) {
+		if(!buf || buf->empty())return;
+		bytes_+=buf->size();
+		bufs_.push_back(std::move(buf));
+	}
+
+	bool empty() const {return bufs_.empty();}
+	std::size_t bytes() const {return bytes_;}
+
+	// Describes up to maxIov unsent buffers; pins (if non-null) receives the
+	// matching references.
+	std::size_t fillIov(iovec *iov,std::size_t maxIov,OutBuf *pins=nullptr) const {
+		std::size_t n=0;
+		for(;n<maxIov && n<bufs_.size();++n){
+			const std::string &b=*bufs_[n];
+			const std::size_t off=(n==0)?headOff_:0;
+			iov[n].iov_base=const_cast<char*>(b.data()+off);
+			iov[n].iov_len=b.size()-off;
+			if(pins!=nullptr)pins[n]=bufs_[n];
+		}
+		return n;
+	}
+
+	void consume(std::size_t n) {
+		bytes_-=(n<bytes_)?n:bytes_;
+		while(n>0 && !bufs_.empty()){
+			const std::size_t left=bufs_.front()->size()-headOff_;
+			if(n<left){
+				headOff_+=n;
+				return;
+			}
+			n-=left;
+			bufs_.pop_front();
+			headOff_=0;
+		}
+	}
+
+	void clear() {
+		bufs_.clear();
+		headOff_=0;
+		bytes_=0;
+	}
+
+private:
+	std::deque<OutBuf> bufs_;
+	std::size_t headOff_{0};
+	std::size_t bytes_{0};
+};
+
+} // namespace qchat
+
+#endif
@@ -0,0 +1,166 @@
+// Text-protocol parsing cost per line, printed as one JSON object:
+//
+//   parse_bench [--min-ms N] > before.json
+//
+// A 64 KiB stream of command lines is fed through LineBuffer in 4 KiB reads,
+// so some lines cross a read and go through the carry-over buffer. Each line
+// is split and dispatched; MSGTO also splits its handle from the text.
+//
+// view     the server's path: splitCommand, a switch on verbKey,
+//          splitTokens into a std::array of views
+// legacy   the path before it: the argument tail copied into a std::string,
+//          an if-chain of verb compares, splitTokens into a vector of strings
+//
+// allocs counts operator new calls per line over one pass of the stream.
+
+#include "bench_common.hpp"
+#include "chat_common.hpp"
+#include "line_buffer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+using bench::HeapCount;
+using qchat::LineBuffer;
+
+volatile std::size_t sink;
+
+constexpr std::size_t STREAM_BYTES=64*1024;
+constexpr std::size_t READ_BYTES=4096;
+
+struct Mix {
+	const char *name;
+	unsigned msgAll; // of every 4 lines
+	unsigned msgTo;
+};
+
+std::string makeStream(const Mix &mix) {
+	std::string s;
+	for(std::size_t i=0;s.size()<STREAM_BYTES;++i){
+		const unsigned k=static_cast<unsigned>(i%4);
+		if(k<mix.msgAll){
+			s+="MSGALL has anyone seen the build logs from last night? #"+std::to_string(i)+"\n";
+		}else if(k<mix.msgAll+mix.msgTo){
+			s+="MSGTO bob_the_builder can you look at the failing test when you get a minute #"+std::to_string(i)+"\n";
+		}else{
+			s+="WHO\n";
+		}
+	}
+	return s;
+}
+
+void viewLine(std::string_view line) {
+	auto [cmd,rest]=qchat::splitCommand(line);
+	if(cmd.empty())return;
+	switch(qchat::verbKey(cmd)){
+	case qchat::verbKey("MSGALL"):
+		sink=sink+rest.size();
+		break;
+	case qchat::verbKey("MSGTO"):{
+		std::array<std::string_view,2> toks;
+		if(qchat::splitTokens(rest,toks)==2)sink=sink+toks[0].size()+toks[1].size();
+		break;
+	}
+	case qchat::verbKey("WHO"):
+		sink=sink+1;
+		break;
+	default:
+		break;
+	}
+}
+
+void legacyLine(std::string_view line) {
+	std::string_view trimmed=qchat::trimView(line);
+	if(trimmed.empty())return;
+	std::size_t sp=trimmed.find(' ');
+	std::string_view cmd;
+	std::string rest;
+	if(sp==std::string_view::npos){
+		cmd=trimmed;
+	}else{
+		cmd=trimmed.substr(0,sp);
+		rest=qchat::trimView(trimmed.substr(sp+1));
+	}
+	if(cmd=="SIGNUP" || cmd=="LOGIN"){
+		sink=sink+2;
+	}else if(cmd=="MSGALL"){
+		sink=sink+rest.size();
+	}else if(cmd=="MSGTO"){
+		auto toks=qchat::splitTokens(rest,2);
+		if(toks.size()==2)sink=sink+toks[0].size()+toks[1].size();
+	}else if(cmd=="CHPASS" || cmd=="CHHANDLE" || cmd=="CHNAME" || cmd=="SETMULTI" || cmd=="HISTORY"){
+		sink=sink+3;
+	}else if(cmd=="WHO" || cmd=="ONLINE"){
+		sink=sink+1;
+	}
+}
+
+template<class Fn>
+std::size_t feedAll(LineBuffer &in,const std::string &stream,Fn &&parse) {
+	std::size_t lines=0;
+	for(std::size_t off=0;off<stream.size();off+=READ_BYTES){
+		const std::size_t n=std::min(READ_BYTES,stream.size()-off);
+		in.feed(stream.data()+off,n,[&](LineBuffer::Event ev,std::string_view line){
+			if(ev==LineBuffer::Event::Line)parse(line);
+			++lines;
+			return true;
+		});
+	}
+	return lines;
+}
+
+template<class Fn>
+void printRow(bool &first,const char *path,const Mix &mix,const std::string &stream,double roundNs,Fn parse) {
+	LineBuffer in;
+	const std::size_t lines=feedAll(in,stream,parse); // sizes the carry-over buffer
+	const HeapCount before=bench::heapCount();
+	feedAll(in,stream,parse);
+	const HeapCount used=bench::heapCount()-before;
+	const double ns=bench::bestNs(roundNs,[&]{feedAll(in,stream,parse);});
+	const double perLine=static_cast<double>(lines);
+	std::printf("%s\n    {\"path\": \"%s\", \"mix\": \"%s\", \"lines\": %zu, \"allocs_per_line\": %.2f, "
+		"\"heap_bytes_per_line\": %.1f, \"ns_per_line\": %.1f, \"mib_s\": %.1f}",
+		first?"":",",path,mix.name,lines,static_cast<double>(used.allocs)/perLine,
+		static_cast<double>(used.bytes)/perLine,ns/perLine,static_cast<double>(stream.size())/ns*1e9/(1<<20));
+	first=false;
+}
+
+} // namespace
+
+int main(int argc,char **argv) {
+	double minMs=200;
+	for(int i=1;i<argc;++i){
+		const std::string arg=argv[i];
+		if(arg=="--min-ms" && i+1<argc){
+			minMs=std::strtod(argv[++i],nullptr);
+		}else{
+			std::fprintf(stderr,"Usage: %s [--min-ms N]\n",argv[0]);
+			return 1;
+		}
+	}
+	const double roundNs=minMs*1e6/5;
+
+	static constexpr Mix MIXES[]={
+		{"msgall",4,0},
+		{"msgto",0,4},
+		{"mixed",2,1},
+	};
+
+	std::printf("{\n  \"optimized\": %s,\n  \"compiler\": \"%s\",\n",bench::OPTIMIZED?"true":"false",__VERSION__);
+	std::printf("  \"parse\": [");
+	bool first=true;
+	for(const Mix &mix:MIXES){
+		const std::string stream=makeStream(mix);
+		printRow(first,"view",mix,stream,roundNs,viewLine);
+		printRow(first,"legacy",mix,stream,roundNs,legacyLine);
+	}
+	std::printf("\n  ]\n}\n");
+	return 0;
+}
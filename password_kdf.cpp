@@ -0,0 +1,154 @@
+#include "password_kdf.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <sys/random.h>
+
+namespace qchat {
+
+namespace {
+
+constexpr char DOMAIN[]={'q','k','d','f','1'};
+constexpr std::size_t BLOCK_LANES=16; // 128 bytes, inside the 136-byte SHAKE256 rate
+
+std::size_t blockCount(u8 memLog2) {
+	return (std::size_t{1024}/(BLOCK_LANES*8))<<memLog2;
+}
+
+void fillRandom(u8 *out,std::size_t n) {
+	std::size_t got=0;
+	while(got<n){
+		const ssize_t r=::getrandom(out+got,n-got,0);
+		if(r<0){
+			if(errno==EINTR)continue;
+			break;
+		}
+		got+=static_cast<std::size_t>(r);
+	}
+	if(got<n){
+		// no getrandom(): still unpredictable enough for a salt
+		std::random_device rd;
+		for(;got<n;++got)out[got]=static_cast<u8>(rd());
+	}
+}
+
+double secondsFor(KdfParams params) {
+	using namespace std::chrono;
+	static constexpr std::array<u8,KDF_SALT_SIZE> salt{};
+	double best=1e300;
+	for(int i=0;i<3;++i){
+		const auto t0=steady_clock::now();
+		(void)qkdf("calibrate",salt,params);
+		best=std::min(best,duration<double>(steady_clock::now()-t0).count());
+	}
+	return best;
+}
+
+} // namespace
+
+bool KdfParams::valid() const {
+	switch(kind){
+	case Kind::Sha3:
+		return memLog2==0 && passes==0;
+	case Kind::Qkdf:
+		return memLog2>=KDF_MIN_MEM_LOG2 && memLog2<=KDF_MAX_MEM_LOG2 && passes>=1 && passes<=KDF_MAX_PASSES;
+	}
+	return false;
+}
+
+u64 KdfParams::cost() const {
+	if(kind!=Kind::Qkdf)return 0;
+	return static_cast<u64>(blockCount(memLog2))*(1u+passes);
+}
+
+std::array<u8,64> qkdf(std::string_view pw,std::span<const u8,KDF_SALT_SIZE> salt,KdfParams params) {
+	qhash::Shake256 seed;
+	seed.update(DOMAIN,sizeof(DOMAIN));
+	const u8 p[2]={params.memLog2,params.passes};
+	seed.update(p,sizeof(p));
+	seed.update(salt);
+	const std::uint32_t len=static_cast<std::uint32_t>(pw.size());
+	seed.update(&len,sizeof(len));
+	seed.update(pw.data(),pw.size());
+
+	u64 st[25]{};
+	seed.squeeze(st,BLOCK_LANES*8);
+
+	const std::size_t n=blockCount(params.memLog2);
+	thread_local std::vector<u64> mem;
+	if(mem.size()<n*BLOCK_LANES)mem.resize(n*BLOCK_LANES);
+
+	for(std::size_t i=0;i<n;++i){
+		qhash::detail::keccakf(st);
+		std::memcpy(&mem[i*BLOCK_LANES],st,BLOCK_LANES*8);
+	}
+	const std::size_t steps=n*params.passes;
+	for(std::size_t i=0;i<steps;++i){
+		const u64 *v=&mem[(st[0]&(n-1))*BLOCK_LANES];
+		for(std::size_t k=0;k<BLOCK_LANES;++k)st[k]^=v[k];
+		qhash::detail::keccakf(st);
+	}
+	qhash::detail::keccakf(st);
+
+	std::array<u8,64> out;
+	std::memcpy(out.data(),st,out.size());
+	return out;
+}
+
+PasswordHash hashPassword(std::string_view pw,KdfParams params) {
+	PasswordHash h;
+	h.params=params;
+	if(params.kind==KdfParams::Kind::Qkdf){
+		fillRandom(h.salt.data(),h.salt.size());
+		h.digest=qkdf(pw,h.salt,params);
+	}else{
+		h.digest=qhash::sha3_512_bytes(pw.data(),pw.size());
+	}
+	return h;
+}
+
+bool passwordMatches(const PasswordHash &stored,std::string_view pw) {
+	if(!stored.params.valid())return false;
+	const std::array<u8,64> d=stored.params.kind==KdfParams::Kind::Qkdf
+		?qkdf(pw,stored.salt,stored.params)
+		:qhash::sha3_512_bytes(pw.data(),pw.size());
+	return digestsEqual(d,stored.digest);
+}
+
+void sha3Passwords(std::span<const std::string_view> pws,std::span<std::array<u8,64>> out) {
+	std::vector<std::span<const u8>> in;
+	in.reserve(pws.size());
+	for(std::string_view pw:pws)in.emplace_back(reinterpret_cast<const u8*>(pw.data()),pw.size());
+	qhash::sha3_512_many(in,out);
+}
+
+bool digestsEqual(const std::array<u8,64> &a,const std::array<u8,64> &b) {
+	u8 diff=0;
+	for(std::size_t i=0;i<a.size();++i)diff|=a[i]^b[i];
+	return diff==0;
+}
+
+KdfParams calibrateKdf(std::chrono::microseconds budget) {
+	const double limit=std::chrono::duration<double>(budget).count();
+	KdfParams p{KdfParams::Kind::Qkdf,KDF_MIN_MEM_LOG2,1};
+	// cost is linear in memory and passes, so one small run predicts the rest
+	const double perPerm=secondsFor(p)/static_cast<double>(p.cost());
+	auto fits=[&](KdfParams q){return static_cast<double>(q.cost())*perPerm<=limit;};
+	while(p.memLog2<KDF_MAX_MEM_LOG2 && fits(KdfParams{p.kind,static_cast<u8>(p.memLog2+1),p.passes}))++p.memLog2;
+	while(p.passes<KDF_MAX_PASSES && fits(KdfParams{p.kind,p.memLog2,static_cast<u8>(p.passes+1)}))++p.passes;
+	// a large buffer misses cache, which the small run did not see
+	while(secondsFor(p)>limit && (p.passes>1 || p.memLog2>KDF_MIN_MEM_LOG2)){
+		if(p.passes>1){
+			--p.passes;
+		}else{
+			--p.memLog2;
+		}
+	}
+	return p;
+}
+
+} // namespace qchat
@@ -0,0 +1,81 @@
+#ifndef QCHAT_PASSWORD_KDF_HPP
+#define QCHAT_PASSWORD_KDF_HPP
+
+#include "chat_common.hpp"
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <span>
+#include <string_view>
+
+namespace qchat {
+
+// How a stored password hash was made.
+struct KdfParams {
+	enum class Kind : u8 {
+		Sha3=0, // unsalted SHA3-512 of the password, from before the KDF
+		Qkdf=1  // salted and memory-hard, see qkdf()
+	};
+	Kind kind{Kind::Sha3};
+	u8 memLog2{0}; // Qkdf: 2^memLog2 KiB of memory
+	u8 passes{0};  // Qkdf: random reads, in multiples of the memory size
+
+	bool operator==(const KdfParams&) const=default;
+
+	// A known kind with settings this build can run; checked on everything
+	// read back from disk.
+	bool valid() const;
+
+	// Permutations per hash; 0 for Sha3, which is too cheap to count.
+	u64 cost() const;
+};
+
+constexpr std::size_t KDF_SALT_SIZE=16;
+constexpr u8 KDF_MIN_MEM_LOG2=3;  // 8 KiB
+constexpr u8 KDF_MAX_MEM_LOG2=14; // 16 MiB, held by each hashing thread
+constexpr u8 KDF_MAX_PASSES=16;
+
+// A stored password: the digest and everything needed to check it again.
+struct PasswordHash {
+	std::array<u8,64> digest{};
+	std::array<u8,KDF_SALT_SIZE> salt{}; // zero for Sha3
+	KdfParams params;
+
+	bool operator==(const PasswordHash&) const=default;
+};
+
+// scrypt's ROMix with Keccak-f[1600] for the block mix:
+//
+//   seed  = SHAKE256("qkdf1" | memLog2 | passes | salt | u32 len | pw), 128 bytes
+//   state = seed in lanes 0..15, zero in 16..24
+//   fill  N = 2^memLog2 KiB / 128 blocks; V[i] = lanes 0..15 after a permutation
+//   mix   passes*N times: lanes 0..15 ^= V[lane 0 mod N], permute
+//   out   lanes 0..7 after a last permutation
+//
+// The reads depend on the password, so every block must be kept or
+// recomputed. Memory comes from a per-thread buffer that is kept for the
+// next call.
+std::array<u8,64> qkdf(std::string_view pw,std::span<const u8,KDF_SALT_SIZE> salt,KdfParams params);
+
+// A fresh random salt and pw hashed with it under params.
+PasswordHash hashPassword(std::string_view pw,KdfParams params);
+
+// Checks pw against stored, without an early exit on the first differing
+// byte.
+bool passwordMatches(const PasswordHash &stored,std::string_view pw);
+
+// Sha3 digests of many passwords at once, in vector lanes. For checking
+// accounts that have not logged in since the KDF came in.
+void sha3Passwords(std::span<const std::string_view> pws,std::span<std::array<u8,64>> out);
+
+bool digestsEqual(const std::array<u8,64> &a,const std::array<u8,64> &b);
+
+// Times qkdf on this host and returns the most memory, then passes, whose
+// single hash still fits in budget. Never below KDF_MIN_MEM_LOG2 and one
+// pass, however small the budget.
+KdfParams calibrateKdf(std::chrono::microseconds budget);
+
+} // namespace qchat
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef QCHAT_PROTO_BIN_HPP
+#define QCHAT_PROTO_BIN_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace qchat {
+
+// Binary framing, entered from the text protocol with "PROTO BIN" (and left
+// again with a "PROTO TEXT" Command frame). Every frame is
+//
+//   u32 payload length (little-endian) | u8 opcode | payload
+//
+// Multi-field payloads prefix every field but the last with a u16
+// little-endian length; the last field runs to the end of the payload, so
+// text may contain spaces and newlines.
+enum class BinOp : std::uint8_t {
+	// client -> server
+	Signup=0x01,  // [handle][password] display name
+	Login=0x02,   // [handle] password
+	MsgAll=0x03,  // text
+	MsgTo=0x04,   // [handle] text
+	Command=0x10, // any text-protocol command line
+	// server -> client: the reply line minus its keyword
+	Ok=0x80,
+	Err=0x81,
+	Sys=0x82,
+	From=0x83,    // "<display> (@handle): text"
+	Private=0x84, // same layout as From
+	Line=0x8f     // any other reply line, verbatim (HIST, ONLINE, ...)
+};
+
+constexpr std::size_t BIN_HEADER_SIZE=5;
+
+inline std::uint32_t binPayloadLength(const char *hdr) {
+	const auto *p=reinterpret_cast<const unsigned char*>(hdr);
+	return static_cast<std::uint32_t>(p[0])|(static_cast<std::uint32_t>(p[1])<<8)|
+		(static_cast<std::uint32_t>(p[2])<<16)|(static_cast<std::uint32_t>(p[3])<<24);
+}
+
+inline void appendBinHeader(std::string &out,BinOp op,std::size_t payloadLen) {
+	const auto n=static_cast<std::uint32_t>(payloadLen);
+	out.push_back(static_cast<char>(n&0xffu));
+	out.push_back(static_cast<char>((n>>8)&0xffu));
+	out.push_back(static_cast<char>((n>>16)&0xffu));
+	out.push_back(static_cast<char>((n>>24)&0xffu));
+	out.push_back(static_cast<char>(op));
+}
+
+inline void appendBinField(std::string &out,std::string_view field) {
+	const auto n=static_cast<std::uint16_t>(std::min<std::size_t>(field.size(),0xffffu));
+	out.push_back(static_cast<char>(n&0xffu));
+	out.push_back(static_cast<char>(n>>8));
+	out.append(field.data(),n);
+}
+
+// Splits the next length-prefixed field off payload; false if truncated.
+inline bool takeBinField(std::string_view &payload,std::string_view &field) {
+	if(payload.size()<2u)return false;
+	const auto *p=reinterpret_cast<const unsigned char*>(payload.data());
+	const std::size_t n=static_cast<std::size_t>(p[0])|(static_cast<std::size_t>(p[1])<<8);
+	if(payload.size()-2u<n)return false;
+	field=payload.substr(2,n);
+	payload.remove_prefix(2+n);
+	return true;
+}
+
+struct BinReplyPrefix {
+	BinOp op;
+	std::string_view prefix;
+};
+
+inline constexpr BinReplyPrefix BIN_REPLY_PREFIXES[]={
+	{BinOp::Ok,"OK "},
+	{BinOp::Err,"ERR "},
+	{BinOp::Sys,"SYS "},
+	{BinOp::From,"FROM "},
+	{BinOp::Private,"PRIVATE from "}
+};
+
+// Encodes one text-protocol reply line (without '\n') as a frame.
+inline std::string encodeBinReply(std::string_view line) {
+	BinOp op=BinOp::Line;
+	for(const BinReplyPrefix &p:BIN_REPLY_PREFIXES){
+		if(line.starts_with(p.prefix)){
+			op=p.op;
+			line.remove_prefix(p.prefix.size());
+			break;
+		}
+	}
+	std::string out;
+	out.reserve(BIN_HEADER_SIZE+line.size());
+	appendBinHeader(out,op,line.size());
+	out.append(line);
+	return out;
+}
+
+// Inverse of encodeBinReply, for clients that render text.
+inline std::string decodeBinReply(BinOp op,std::string_view payload) {
+	for(const BinReplyPrefix &p:BIN_REPLY_PREFIXES){
+		if(p.op==op){
+			std::string out(p.prefix);
+			out.append(payload);
+			return out;
+		}
+	}
+	return std::string(payload);
+}
+
+// Reassembles frames from a byte stream: a fixed header read plus a bounds
+// check, no delimiter scanning. Frames wholly inside the chunk being fed are
+// handed out as views into it; a frame split across reads is copied into a
+// carry-over buffer of at most BIN_HEADER_SIZE+maxFrame bytes.
+class FrameBuffer {
+public:
+	enum class Event {
+		Frame,   // op and payload are valid
+		TooLong  // payload exceeded maxFrame and is being skipped
+	};
+
+	void setMaxFrame(std::size_t n) {maxFrame_=n;}
+
+	// Calls onEvent(Event,BinOp,std::string_view payload) per frame; a false
+	// return stops early. Returns the number of bytes of data consumed.
+	template<class F>
+	std::size_t feed(const char *data,std::size_t len,F &&onEvent) {
+		std::size_t used=0;
+		while(used<len){
+			if(skip_>0){
+				const std::size_t n=std::min(skip_,len-used);
+				skip_-=n;
+				used+=n;
+				continue;
+			}
+			const char *p=data+used;
+			const std::size_t avail=len-used;
+			if(carry_.empty() && avail>=BIN_HEADER_SIZE){
+				const std::size_t plen=binPayloadLength(p);
+				const BinOp op=static_cast<BinOp>(p[4]);
+				if(plen>maxFrame_){
+					used+=BIN_HEADER_SIZE;
+					skip_=plen;
+					if(!onEvent(Event::TooLong,op,std::string_view()))return used;
+					continue;
+				}
+				if(avail-BIN_HEADER_SIZE>=plen){
+					used+=BIN_HEADER_SIZE+plen;
+					if(!onEvent(Event::Frame,op,std::string_view(p+BIN_HEADER_SIZE,plen)))return used;
+					continue;
+				}
+			}
+			// partial frame: fill the header first, then the payload
+			std::size_t want=BIN_HEADER_SIZE;
+			if(carry_.size()>=BIN_HEADER_SIZE)want+=binPayloadLength(carry_.data());
+			const std::size_t n=std::min(want-carry_.size(),avail);
+			carry_.append(p,n);
+			used+=n;
+			if(carry_.size()<BIN_HEADER_SIZE)continue;
+			const std::size_t plen=binPayloadLength(carry_.data());
+			const BinOp op=static_cast<BinOp>(carry_[4]);
+			if(plen>maxFrame_){
+				carry_.clear();
+				skip_=plen;
+				if(!onEvent(Event::TooLong,op,std::string_view()))return used;
+				continue;
+			}
+			if(carry_.size()<BIN_HEADER_SIZE+plen)continue;
+			const bool more=onEvent(Event::Frame,op,std::string_view(carry_).substr(BIN_HEADER_SIZE));
+			carry_.clear();
+			if(!more)return used;
+		}
+		return used;
+	}
+
+private:
+	std::string carry_;
+	std::size_t skip_{0};
+	std::size_t maxFrame_{16*1024};
+};
+
+} // namespace qchat
+
+#endif
@@ -1,7 +1,19 @@
+#include "qhash.hpp"
+
 #include <array>
+#include <bit>
 #include <cstdint>
 #include <cstring>
-#include <bit>
+#include <span>
+#include <type_traits>
+#include <utility>
+
+// The lane templates below also run on AVX vectors; they are always
+// inlined into functions built for that ISA, so no vector ever crosses an
+// ABI boundary and GCC's note about the ABI change does not apply.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
 
 namespace qhash {
 
@@ -25,62 +37,266 @@ static constexpr u64 RC[24]={
 	0x0000000080000001ULL,0x8000000080008008ULL
 };
 
-static constexpr int R[5][5]={
-	{  0, 36,  3, 41, 18},
-	{  1, 44, 10, 45,  2},
-	{ 62,  6, 43, 15, 61},
-	{ 28, 55, 25, 21, 56},
-	{ 27, 20, 39,  8, 14}
-};
+// ρ offsets, from the spec: lane (1,0) turns by 1, and each step along the
+// π orbit (x,y) -> (y,2x+3y) adds t+1 more.
+static constexpr std::array<int,25> RHO=[]{
+	std::array<int,25> r{};
+	int x=1,y=0;
+	for(int t=0;t<24;++t){
+		r[x+5*y]=((t+1)*(t+2)/2)%64;
+		const int nx=y;
+		y=(2*x+3*y)%5;
+		x=nx;
+	}
+	return r;
+}();
 
-// Keccak-f[1600], little-endian 64-bit lanes
-inline void keccakf(u64 s[25]) {
-	for(int rnd=0;rnd<24;++rnd){
-		// θ
-		u64 C[5];
-		for(int x=0;x<5;++x)
-			C[x]=s[x]^s[x+5]^s[x+10]^s[x+15]^s[x+20];
-
-		u64 D[5];
-		for(int x=0;x<5;++x)
-			D[x]=C[(x+4)%5]^std::rotl(C[(x+1)%5],1);
-
-		for(int x=0;x<5;++x)
-		for(int y=0;y<5;++y)
-			s[x+5*y]^=D[x];
-
-		// ρ and π
-		u64 B[25];
-		for(int x=0;x<5;++x)
-		for(int y=0;y<5;++y){
-			int nx=y;
-			int ny=(2*x+3*y)%5;
-			B[nx+5*ny]=std::rotl(s[x+5*y],R[x][y]);
-		}
+// π moves lane (x,y) to (y,2x+3y); B lane j is read from A lane PI_SRC[j].
+static constexpr std::array<int,25> PI_SRC=[]{
+	std::array<int,25> src{};
+	for(int x=0;x<5;++x)
+	for(int y=0;y<5;++y)
+		src[y+5*((2*x+3*y)%5)]=x+5*y;
+	return src;
+}();
 
-		// χ
-		for(int y=0;y<5;++y){
-			u64 b0=B[5*y+0];
-			u64 b1=B[5*y+1];
-			u64 b2=B[5*y+2];
-			u64 b3=B[5*y+3];
-			u64 b4=B[5*y+4];
-			s[5*y+0]=b0^((~b1)&b2);
-			s[5*y+1]=b1^((~b2)&b3);
-			s[5*y+2]=b2^((~b3)&b4);
-			s[5*y+3]=b3^((~b4)&b0);
-			s[5*y+4]=b4^((~b0)&b1);
+// Lane complementing: these lanes are held inverted between rounds, which
+// lets most of χ's ~b1&b2 be written as plain AND/OR. With andn available
+// the NOTs are free and nothing is inverted.
+static constexpr std::array<bool,25> COMPLEMENTED=[]{
+	std::array<bool,25> c{};
+	for(int i:{1,2,8,12,17,20})c[i]=true;
+	return c;
+}();
+
+// Which B lanes come out of θ, ρ and π inverted, given the inverted A lanes:
+// a column parity is inverted if an odd number of its lanes are, and so on.
+template<bool Complement>
+static constexpr std::array<bool,25> B_INVERTED=[]{
+	std::array<bool,25> b{};
+	if constexpr(Complement){
+		bool c[5]{};
+		for(int i=0;i<25;++i)c[i%5]^=COMPLEMENTED[i];
+		for(int j=0;j<25;++j){
+			const int i=PI_SRC[j];
+			const int x=i%5;
+			b[j]=COMPLEMENTED[i]^c[(x+4)%5]^c[(x+1)%5];
 		}
+	}
+	return b;
+}();
+
+template<bool Invert,class L>
+[[gnu::always_inline]] inline L invertIf(const L &v) {
+	if constexpr(Invert)return ~v;
+	return v;
+}
+
+// A lane is a u64, or a GCC vector of u64 holding the same lane of several
+// independent states; the bitwise operators work on both.
+template<int N,class L>
+[[gnu::always_inline]] inline L rotlLane(const L &v) {
+	if constexpr(N==0)return v;
+	else if constexpr(std::is_same_v<L,u64>)return std::rotl(v,N);
+	else return (v<<N)|(v>>(64-N));
+}
+
+// χ for lane J = (x,y): t0^(~t1&t2) over the true lanes, written for the
+// stored ones (t or ~t per B_INVERTED) so the result is stored inverted iff
+// COMPLEMENTED[J]. Each case needs at most one NOT.
+template<int J,bool Complement,class L>
+[[gnu::always_inline]] inline L chiLane(const L (&b)[25]) {
+	constexpr int x=J%5;
+	constexpr int y=J/5;
+	constexpr int i0=J;
+	constexpr int i1=(x+1)%5+5*y;
+	constexpr int i2=(x+2)%5+5*y;
+	constexpr bool f1=B_INVERTED<Complement>[i1];
+	constexpr bool f2=B_INVERTED<Complement>[i2];
+	constexpr bool flip=B_INVERTED<Complement>[i0]!=(Complement && COMPLEMENTED[J]);
+	if constexpr(f1 && !f2){
+		// ~t1&t2 = b1&b2
+		return invertIf<flip>(b[i0]^(b[i1]&b[i2]));
+	}else if constexpr(!f1 && f2){
+		// ~t1&t2 = ~(b1|b2)
+		return invertIf<!flip>(b[i0]^(b[i1]|b[i2]));
+	}else if constexpr(!f1){
+		// ~t1&t2 = ~b1&b2 = ~(b1|~b2)
+		if constexpr(flip)return b[i0]^(b[i1]|~b[i2]);
+		return b[i0]^(~b[i1]&b[i2]);
+	}else{
+		// ~t1&t2 = b1&~b2 = ~(~b1|b2)
+		if constexpr(flip)return b[i0]^(~b[i1]|b[i2]);
+		return b[i0]^(b[i1]&~b[i2]);
+	}
+}
+
+template<int X,class L>
+[[gnu::always_inline]] inline L column(const L (&a)[25]) {
+	return a[X]^a[X+5]^a[X+10]^a[X+15]^a[X+20];
+}
 
-		// ι
-		s[0]^=RC[rnd];
+// One round from a into e. Every index is a constant, so the compiler keeps
+// the lanes in registers (or fixed stack slots) with no B staging array
+// in memory.
+template<bool Complement,class L,std::size_t... J>
+[[gnu::always_inline]] inline void keccakRound(const L (&a)[25],L (&e)[25],u64 rc,std::index_sequence<J...>) {
+	const L c[5]={column<0>(a),column<1>(a),column<2>(a),column<3>(a),column<4>(a)};
+	const L d[5]={
+		c[4]^rotlLane<1>(c[1]),
+		c[0]^rotlLane<1>(c[2]),
+		c[1]^rotlLane<1>(c[3]),
+		c[2]^rotlLane<1>(c[4]),
+		c[3]^rotlLane<1>(c[0])
+	};
+	const L b[25]={rotlLane<RHO[PI_SRC[J]]>(a[PI_SRC[J]]^d[PI_SRC[J]%5])...};
+	((e[J]=chiLane<static_cast<int>(J),Complement>(b)),...);
+	e[0]^=rc;
+}
+
+template<bool Complement,class L,std::size_t... J>
+[[gnu::always_inline]] inline void keccakPermute(L s[25],std::index_sequence<J...> lanes) {
+	constexpr u64 ALL=~u64{0};
+	L a[25]={(s[J]^((Complement && COMPLEMENTED[J])?ALL:0))...};
+	L e[25];
+	for(int rnd=0;rnd<24;rnd+=2){
+		keccakRound<Complement>(a,e,RC[rnd],lanes);
+		keccakRound<Complement>(e,a,RC[rnd+1],lanes);
 	}
+	((s[J]=a[J]^((Complement && COMPLEMENTED[J])?ALL:0)),...);
+}
+
+// Keccak-f[1600], little-endian 64-bit lanes
+static void keccakfGeneric(u64 s[25]) {
+	keccakPermute<true>(s,std::make_index_sequence<25>());
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// andn makes ~b1&b2 one instruction and rorx spares the moves around rol
+__attribute__((target("bmi,bmi2")))
+static void keccakfBmi2(u64 s[25]) {
+	keccakPermute<false>(s,std::make_index_sequence<25>());
+}
+#endif
+
+using KeccakFn=void(*)(u64*);
+
+static KeccakFn pickKeccakf() {
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2"))return keccakfBmi2;
+#endif
+	return keccakfGeneric;
+}
+
+void keccakf(u64 s[25]) {
+	static const KeccakFn impl=pickKeccakf();
+	impl(s);
+}
+
+const char* keccakf_kernel() {
+	return pickKeccakf()==keccakfGeneric?"generic":"bmi2";
 }
 
 // SHA3-512 parameters
 static constexpr std::size_t SHA3_512_RATE   = 72;  // bytes
 static constexpr std::size_t SHA3_512_DIGEST = 64;  // bytes
 
+// The padded tail: the remaining bytes, then rembits more bits taken
+// LSB-first from the next byte, then the SHA3 suffix 01 and pad10*1, right
+// after the last message bit. block holds two blocks, zeroed; the second is
+// only needed when fewer than four bits of the first are left. Returns the
+// number of blocks used.
+static std::size_t padFinal(u8 *block,const u8 *in,std::size_t remaining,unsigned rembits) {
+	if(remaining>0)
+		std::memcpy(block,in,remaining);
+
+	if(rembits){
+		const u8 mask=(1u<<rembits)-1u;
+		block[remaining]|=in[remaining] & mask;
+	}
+
+	// Domain separation for SHA3: 0x06, then pad10*1 (final bit 0x80)
+	const unsigned suffix=0x06u<<rembits;
+	block[remaining] ^= static_cast<u8>(suffix);
+	block[remaining+1] ^= static_cast<u8>(suffix>>8);
+	const std::size_t blocks=remaining*8+rembits+4<=SHA3_512_RATE*8?1:2;
+	block[blocks*SHA3_512_RATE-1] ^= 0x80u;
+	return blocks;
+}
+
+// W messages through W states side by side, one per vector element. Each
+// message is absorbed block by block in lockstep; a state whose message has
+// ended just idles (its digest is taken right after its last block).
+template<class V,std::size_t W>
+[[gnu::always_inline]] inline void sha3_512_lanes(const std::span<const u8> *in,std::array<u8,64> *out,std::size_t n) {
+	V st[25]={};
+	std::size_t blocks[W]{};
+	std::size_t most=0;
+	for(std::size_t k=0;k<n;++k){
+		blocks[k]=in[k].size()/SHA3_512_RATE+1;
+		if(blocks[k]>most)most=blocks[k];
+	}
+	for(std::size_t b=0;b<most;++b){
+		for(std::size_t k=0;k<n;++k){
+			if(b>=blocks[k])continue;
+			std::array<u8,2*SHA3_512_RATE> last{};
+			const u8 *p=in[k].data()+b*SHA3_512_RATE;
+			if(b+1==blocks[k]){
+				padFinal(last.data(),p,in[k].size()-b*SHA3_512_RATE,0);
+				p=last.data();
+			}
+			for(std::size_t i=0;i<SHA3_512_RATE/8;++i){
+				u64 lane=0;
+				std::memcpy(&lane,p+8*i,8);
+				st[i][k]^=lane;
+			}
+		}
+		keccakPermute<false>(st,std::make_index_sequence<25>());
+		for(std::size_t k=0;k<n;++k){
+			if(b+1!=blocks[k])continue;
+			for(std::size_t i=0;i<SHA3_512_DIGEST/8;++i){
+				const u64 lane=st[i][k];
+				std::memcpy(out[k].data()+8*i,&lane,8);
+			}
+		}
+	}
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+typedef u64 U64x4 __attribute__((vector_size(32)));
+typedef u64 U64x8 __attribute__((vector_size(64)));
+
+__attribute__((target("avx2")))
+static void sha3_512_x4(const std::span<const u8> *in,std::array<u8,64> *out,std::size_t n) {
+	sha3_512_lanes<U64x4,4>(in,out,n);
+}
+
+// vpternlogq does each χ lane and column parity in one instruction
+__attribute__((target("avx512f")))
+static void sha3_512_x8(const std::span<const u8> *in,std::array<u8,64> *out,std::size_t n) {
+	sha3_512_lanes<U64x8,8>(in,out,n);
+}
+#endif
+
+struct ManyImpl {
+	void (*fn)(const std::span<const u8>*,std::array<u8,64>*,std::size_t);
+	std::size_t width;
+};
+
+static ManyImpl pickMany() {
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f"))return {sha3_512_x8,8};
+	if(__builtin_cpu_supports("avx2"))return {sha3_512_x4,4};
+#endif
+	return {nullptr,1};
+}
+
+std::size_t many_width() {
+	return pickMany().width;
+}
+
 } // namespace detail
 
 // bitlen is the number of bits in *data.
@@ -109,31 +325,18 @@ std::array<u8,64> sha3_512(const void* data,std::uint64_t bitlen){
 	}
 
 	// Build final padded block(s)
-	// We work on a zeroed temp block, then XOR into state.
-	std::array<u8,SHA3_512_RATE> block{};
-	const std::uint64_t remaining=bytelen-offset;
-	if(remaining>0)
-		std::memcpy(block.data(),in+offset,static_cast<std::size_t>(remaining));
-
-	if(rembits){
-		// Take remaining bits from the next input bit position
-		// Bits are taken LSB-first within a byte.
-		const u8 mask=(1u<<rembits)-1u;
-		const u8 last_byte=in[bytelen] & mask;
-		block[remaining]|=last_byte;
-	}
+	std::array<u8,2*SHA3_512_RATE> block{};
+	const std::size_t tail=padFinal(block.data(),in+offset,bytelen-offset,rembits);
 
-	// Domain separation for SHA3: 0x06, then pad10*1 (final bit 0x80)
-	block[remaining] ^= 0x06u;
-	block[SHA3_512_RATE-1] ^= 0x80u;
-
-	// Absorb final block
-	for(std::size_t i=0;i<SHA3_512_RATE/8;++i){
-		u64 lane=0;
-		std::memcpy(&lane,block.data()+8*i,8);
-		st[i]^=lane;
+	// Absorb final block(s)
+	for(std::size_t b=0;b<tail;++b){
+		for(std::size_t i=0;i<SHA3_512_RATE/8;++i){
+			u64 lane=0;
+			std::memcpy(&lane,block.data()+b*SHA3_512_RATE+8*i,8);
+			st[i]^=lane;
+		}
+		keccakf(st);
 	}
-	keccakf(st);
 
 	// Squeeze digest
 	std::array<u8,SHA3_512_DIGEST> out{};
@@ -162,4 +365,22 @@ std::array<u8,64> sha3_512(const void* data,std::uint64_t bitlen){
 	return out;
 }
 
+void sha3_512_many(std::span<const std::span<const u8>> inputs,std::span<std::array<u8,64>> digests){
+	using namespace detail;
+	static const ManyImpl impl=pickMany();
+
+	const std::size_t n=inputs.size()<digests.size()?inputs.size():digests.size();
+	std::size_t i=0;
+	if(impl.fn!=nullptr){
+		// a lone leftover is cheaper on its own than in an idle batch
+		while(n-i>=2){
+			const std::size_t take=n-i<impl.width?n-i:impl.width;
+			impl.fn(inputs.data()+i,digests.data()+i,take);
+			i+=take;
+		}
+	}
+	for(;i<n;++i)
+		digests[i]=sha3_512(inputs[i].data(),static_cast<u64>(inputs[i].size())*8);
+}
+
 } // namespace qhash
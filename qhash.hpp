@@ -2,7 +2,10 @@
 #define QHASH_SHA3_512_HPP
 
 #include <array>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <span>
 
 namespace qhash {
 
@@ -34,6 +37,147 @@ sha3_512_bytes(const void* data, std::size_t bytelen) {
     return sha3_512(data, static_cast<u64>(bytelen) * 8);
 }
 
+
+/*
+ * Computes SHA3-512 of many independent byte messages at once.
+ * Parameters:
+ *   inputs  : The messages.
+ *   digests : digests[i] receives the hash of inputs[i]; only the first
+ *             min(inputs.size(), digests.size()) messages are hashed.
+ *
+ * Where the CPU has AVX2 or AVX-512F, 4 or 8 messages are hashed in the
+ * lanes of one vector state, which pays off for many short messages such
+ * as passwords. Otherwise this is a loop over sha3_512.
+ */
+void
+sha3_512_many(std::span<const std::span<const u8>> inputs,
+              std::span<std::array<u8, 64>> digests);
+
+
+namespace detail {
+
+// Keccak-f[1600] on 25 little-endian lanes, using the fastest kernel the CPU
+// supports.
+void keccakf(u64 s[25]);
+
+// What the dispatch above picked, for benchmark reports: the keccakf kernel
+// name and how many messages sha3_512_many hashes side by side.
+const char* keccakf_kernel();
+std::size_t many_width();
+
+} // namespace detail
+
+/*
+ * Incremental Keccak sponge: feed input in pieces of any size, then read the
+ * output, in constant memory.
+ * Parameters:
+ *   Rate   : Bytes absorbed per permutation (200 minus the capacity).
+ *   Suffix : Domain bits and the first padding bit: 0x06 for SHA3,
+ *            0x1F for SHAKE.
+ *
+ * Usage:
+ *   qhash::Sha3_512 h;
+ *   h.update(part1, n1);
+ *   h.update(part2, n2);
+ *   std::array<u8, 64> d = h.final();
+ *
+ * final() returns capacity/2 bytes, the SHA3 digest size. squeeze() reads
+ * any amount, and may be called repeatedly to continue an XOF (SHAKE)
+ * stream. Once output has been read, update() must not be called again
+ * until reset().
+ */
+template<std::size_t Rate, u8 Suffix>
+class Keccak {
+    static_assert(Rate > 0 && Rate < 200 && Rate % 8 == 0, "rate must be whole lanes");
+
+public:
+    static constexpr std::size_t rate        = Rate;
+    static constexpr std::size_t digest_size = (200 - Rate) / 2;
+
+    void update(const void* data, std::size_t len) {
+        const auto* in = static_cast<const u8*>(data);
+        if (used_ > 0) {
+            const std::size_t take = len < Rate - used_ ? len : Rate - used_;
+            std::memcpy(buf_.data() + used_, in, take);
+            used_ += take;
+            in += take;
+            len -= take;
+            if (used_ < Rate)
+                return;
+            absorb(buf_.data());
+            used_ = 0;
+        }
+        // Whole blocks go straight from the caller's buffer.
+        for (; len >= Rate; in += Rate, len -= Rate)
+            absorb(in);
+        if (len > 0) {
+            std::memcpy(buf_.data(), in, len);
+            used_ = len;
+        }
+    }
+
+    void update(std::span<const u8> data) { update(data.data(), data.size()); }
+
+    void squeeze(void* out, std::size_t len) {
+        if (!squeezing_)
+            pad();
+        auto* o = static_cast<u8*>(out);
+        while (len > 0) {
+            if (used_ == Rate) {
+                detail::keccakf(st_);
+                used_ = 0;
+            }
+            const std::size_t take = len < Rate - used_ ? len : Rate - used_;
+            for (std::size_t i = 0; i < take; ++i) {
+                const std::size_t pos = used_ + i;
+                o[i] = static_cast<u8>(st_[pos / 8] >> (8 * (pos % 8)));
+            }
+            used_ += take;
+            o += take;
+            len -= take;
+        }
+    }
+
+    [[nodiscard]] std::array<u8, digest_size> final() {
+        std::array<u8, digest_size> out;
+        squeeze(out.data(), out.size());
+        return out;
+    }
+
+    void reset() {
+        *this = Keccak();
+    }
+
+private:
+    u64 st_[25]{};
+    std::array<u8, Rate> buf_{};
+    std::size_t used_{0};   // bytes buffered, or read once squeezing
+    bool squeezing_{false};
+
+    void absorb(const u8* block) {
+        for (std::size_t i = 0; i < Rate / 8; ++i) {
+            u64 lane;
+            std::memcpy(&lane, block + 8 * i, 8);
+            st_[i] ^= lane;
+        }
+        detail::keccakf(st_);
+    }
+
+    void pad() {
+        std::memset(buf_.data() + used_, 0, Rate - used_);
+        buf_[used_] ^= Suffix;
+        buf_[Rate - 1] ^= 0x80u;
+        absorb(buf_.data());
+        used_ = 0;
+        squeezing_ = true;
+    }
+};
+
+using Sha3_256 = Keccak<136, 0x06>;
+using Sha3_512 = Keccak<72, 0x06>;
+using Shake128 = Keccak<168, 0x1F>;
+using Shake256 = Keccak<136, 0x1F>;
+
 } // namespace qhash
 
 #endif // QHASH_SHA3_512_HPP
@@ -0,0 +1,137 @@
+// qhash throughput and latency, printed as one JSON object so runs from
+// different commits can be diffed or plotted:
+//
+//   qhash_bench [--max-bytes N] [--min-ms N] > before.json
+//
+// throughput  sha3_512 over messages from 0 bytes to 64 MiB (capped by
+//             --max-bytes), best of five rounds of at least --min-ms/5 each
+// many        sha3_512_many over batches of 16 short messages
+// stream      Sha3_512 fed in 4 KiB updates
+// latency     single sha3_512 calls on one-block messages, timed one by one
+//
+// Numbers are only meaningful from an optimised build
+// (-DCMAKE_BUILD_TYPE=Release); "optimized" in the output says which it was.
+
+#include "bench_common.hpp"
+#include "qhash.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace {
+
+using qhash::u8;
+using bench::Clock;
+using bench::bestNs;
+using bench::nsSince;
+
+volatile u8 sink;
+
+void printRate(bool &first,std::size_t bytes,double ns) {
+	std::printf("%s\n    {\"bytes\": %zu, \"ns\": %.1f",first?"":",",bytes,ns);
+	if(bytes>0)std::printf(", \"mib_s\": %.1f",static_cast<double>(bytes)/ns*1e9/(1<<20));
+	std::printf("}");
+	first=false;
+}
+
+} // namespace
+
+int main(int argc,char **argv) {
+	std::size_t maxBytes=64u<<20;
+	double minMs=200;
+	for(int i=1;i<argc;++i){
+		const std::string arg=argv[i];
+		if(arg=="--max-bytes" && i+1<argc){
+			maxBytes=std::strtoull(argv[++i],nullptr,10);
+		}else if(arg=="--min-ms" && i+1<argc){
+			minMs=std::strtod(argv[++i],nullptr);
+		}else{
+			std::fprintf(stderr,"Usage: %s [--max-bytes N] [--min-ms N]\n",argv[0]);
+			return 1;
+		}
+	}
+	const double roundNs=minMs*1e6/5;
+
+	std::vector<u8> data(maxBytes);
+	for(std::size_t i=0;i<data.size();++i)data[i]=static_cast<u8>(i*131+7);
+
+	std::printf("{\n  \"kernel\": \"%s\",\n  \"many_width\": %zu,\n  \"optimized\": %s,\n  \"compiler\": \"%s\",\n",
+		qhash::detail::keccakf_kernel(),qhash::detail::many_width(),bench::OPTIMIZED?"true":"false",__VERSION__);
+
+	static constexpr std::size_t SIZES[]={
+		0,1,16,64,71,72,128,256,1024,4096,16384,65536,
+		1u<<20,16u<<20,64u<<20
+	};
+
+	std::printf("  \"throughput\": [");
+	bool first=true;
+	for(std::size_t n:SIZES){
+		if(n>maxBytes)break;
+		const double ns=bestNs(roundNs,[&]{
+			sink=sink^qhash::sha3_512_bytes(data.data(),n)[0];
+		});
+		printRate(first,n,ns);
+	}
+	std::printf("\n  ],\n");
+
+	static constexpr std::size_t BATCH=16;
+	std::printf("  \"many\": [");
+	first=true;
+	for(std::size_t n:{std::size_t{8},std::size_t{16},std::size_t{64},std::size_t{71},std::size_t{200}}){
+		if(n*BATCH>maxBytes)break;
+		std::array<std::span<const u8>,BATCH> in;
+		for(std::size_t k=0;k<BATCH;++k)in[k]=std::span<const u8>(data.data()+k*n,n);
+		std::array<std::array<u8,64>,BATCH> out;
+		const double ns=bestNs(roundNs,[&]{
+			qhash::sha3_512_many(in,out);
+			sink=sink^out[BATCH-1][0];
+		});
+		printRate(first,n,ns/BATCH);
+	}
+	std::printf("\n  ],\n");
+
+	std::printf("  \"stream\": [");
+	first=true;
+	for(std::size_t n:SIZES){
+		if(n<4096)continue;
+		if(n>maxBytes)break;
+		const double ns=bestNs(roundNs,[&]{
+			qhash::Sha3_512 h;
+			for(std::size_t off=0;off<n;off+=4096)h.update(data.data()+off,std::min<std::size_t>(4096,n-off));
+			sink=sink^h.final()[0];
+		});
+		printRate(first,n,ns);
+	}
+	std::printf("\n  ],\n");
+
+	// per call timings; the clock's own cost is reported beside them
+	static constexpr std::size_t SAMPLES=200000;
+	std::vector<double> clockNs(SAMPLES);
+	for(auto &t:clockNs){
+		const auto t0=Clock::now();
+		t=nsSince(t0);
+	}
+	std::sort(clockNs.begin(),clockNs.end());
+	std::printf("  \"latency\": [");
+	first=true;
+	for(std::size_t n:{std::size_t{0},std::size_t{16},std::size_t{64},std::size_t{71}}){
+		if(n>maxBytes)break;
+		std::vector<double> ns(SAMPLES);
+		for(auto &t:ns){
+			const auto t0=Clock::now();
+			sink=sink^qhash::sha3_512_bytes(data.data(),n)[0];
+			t=nsSince(t0);
+		}
+		std::sort(ns.begin(),ns.end());
+		std::printf("%s\n    {\"bytes\": %zu, \"min_ns\": %.1f, \"p50_ns\": %.1f, \"p90_ns\": %.1f, \"p99_ns\": %.1f}",
+			first?"":",",n,ns[0],ns[SAMPLES/2],ns[SAMPLES*9/10],ns[SAMPLES*99/100]);
+		first=false;
+	}
+	std::printf("\n  ],\n  \"clock_p50_ns\": %.1f\n}\n",clockNs[SAMPLES/2]);
+	return 0;
+}
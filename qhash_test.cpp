@@ -0,0 +1,240 @@
+// Conformance checks for qhash: the NIST SHA3 example vectors, including the
+// bit-length (non byte aligned) ones, and agreement between sha3_512,
+// sha3_512_many and the streaming Keccak on inputs around every block edge.
+// Exits non-zero on the first mismatch in each group.
+
+#include "qhash.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+using qhash::u8;
+using qhash::u64;
+
+int failures=0;
+
+std::string hex(const u8 *p,std::size_t n) {
+	static constexpr char DIGITS[]="0123456789abcdef";
+	std::string out;
+	out.reserve(2*n);
+	for(std::size_t i=0;i<n;++i){
+		out+=DIGITS[p[i]>>4];
+		out+=DIGITS[p[i]&15];
+	}
+	return out;
+}
+
+template<std::size_t N>
+std::string hex(const std::array<u8,N> &a) {
+	return hex(a.data(),a.size());
+}
+
+bool expect(const std::string &name,const std::string &got,std::string_view want) {
+	if(got==want)return true;
+	std::printf("FAIL %s\n  got  %s\n  want %.*s\n",name.c_str(),got.c_str(),static_cast<int>(want.size()),want.data());
+	++failures;
+	return false;
+}
+
+// bitlen bits of 0xA3 repeated, as in the NIST 1600/1605/1630-bit examples.
+std::vector<u8> a3Bits(std::size_t bitlen) {
+	return std::vector<u8>((bitlen+7)/8,0xA3);
+}
+
+// From the NIST "Cryptographic Standards and Guidelines" SHA3 examples. The
+// messages are bit strings; bytes hold them LSB-first, as FIPS 202 does.
+struct BitVector {
+	const char *name;
+	std::vector<u8> msg;
+	u64 bitlen;
+	std::string_view digest;
+};
+
+void sha3_512Vectors() {
+	const std::string m448="abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+	const std::vector<BitVector> vectors={
+		{"0 bits",{},0,
+			"a69f73cca23a9ac5c8b567dc185a756e97c982164fe25859e0d1dcc1475c80a6"
+			"15b2123af1f5f94c11e3e9402c3ac558f500199d95b6d3e301758586281dcd26"},
+		{"5 bits 11001",{0x13},5,
+			"a13e01494114c09800622a70288c432121ce70039d753cadd2e006e4d961cb27"
+			"544c1481e5814bdceb53be6733d5e099795e5e81918addb058e22a9f24883f37"},
+		{"30 bits",{0x53,0x58,0x7B,0x19},30,
+			"9834c05a11e1c5d3da9c740e1c106d9e590a0e530b6f6aaa7830525d075ca5db"
+			"1bd8a6aa981a28613ac334934a01823cd45f45e49b6d7e6917f2f16778067bab"},
+		{"abc",{'a','b','c'},24,
+			"b751850b1a57168a5693cd924b6b096e08f621827444f70d884f5d0240d2712e"
+			"10e116e9192af3c91a7ec57647e3934057340b4cf408d5a56592f8274eec53f0"},
+		{"448 bits",std::vector<u8>(m448.begin(),m448.end()),448,
+			"04a371e84ecfb5b8b77cb48610fca8182dd457ce6f326a0fd3d7ec2f1e91636d"
+			"ee691fbe0c985302ba1b0d8dc78c086346b533b49c030d99a27daf1139d6e75e"},
+		{"1600 bits 0xA3",a3Bits(1600),1600,
+			"e76dfad22084a8b1467fcf2ffa58361bec7628edf5f3fdc0e4805dc48caeeca8"
+			"1b7c13c30adf52a3659584739a2df46be589c51ca1a4a8416df6545a1ce8ba00"},
+		{"1605 bits 0xA3",a3Bits(1605),1605,
+			"fc4a167ccb31a937d698fde82b04348c9539b28f0c9d3b4505709c03812350e4"
+			"990e9622974f6e575c47861c0d2e638ccfc2023c365bb60a93f528550698786b"},
+		{"1630 bits 0xA3",a3Bits(1630),1630,
+			"cf9a30ac1f1f6ac0916f9fef1919c595debe2ee80c85421210fdf05f1c6af73a"
+			"a9cac881d0f91db6d034a2bbadc1cf7fbcb2ecfa9d191d3a5016fb3fad8709c9"},
+	};
+	for(const auto &v:vectors){
+		expect(std::string("sha3_512 ")+v.name,hex(qhash::sha3_512(v.msg.data(),v.bitlen)),v.digest);
+	}
+
+	// bits past bitlen are not part of the message
+	const u8 noisy[]={0xF3};
+	expect("sha3_512 5 bits, high bits set",hex(qhash::sha3_512(noisy,5)),vectors[1].digest);
+
+	const std::string million(1000000,'a');
+	expect("sha3_512 million a",hex(qhash::sha3_512_bytes(million.data(),million.size())),
+		"3c3a876da14034ab60627c077bb98f7e120a2a5370212dffb3385a18d4f38859"
+		"ed311d0a9d5141ce9cc5c66ee689b266a8aa18ace8282a0e0db596c90b0a7b87");
+}
+
+template<class H>
+std::string streamed(std::string_view msg,std::size_t outLen) {
+	H h;
+	h.update(msg.data(),msg.size());
+	std::vector<u8> out(outLen);
+	h.squeeze(out.data(),out.size());
+	return hex(out.data(),out.size());
+}
+
+void streamingVectors() {
+	const std::string m448="abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+	const std::string a3(200,'\xA3');
+	expect("Sha3_256 empty",streamed<qhash::Sha3_256>("",32),
+		"a7ffc6f8bf1ed76651c14756a061d662f580ff4de43b49fa82d80a4b80f8434a");
+	expect("Sha3_256 abc",streamed<qhash::Sha3_256>("abc",32),
+		"3a985da74fe225b2045c172d6bd390bd855f086e3e9d525b46bfe24511431532");
+	expect("Sha3_256 448 bits",streamed<qhash::Sha3_256>(m448,32),
+		"41c0dba2a9d6240849100376a8235e2c82e1b9998a999e21db32dd97496d3376");
+	expect("Sha3_256 1600 bits 0xA3",streamed<qhash::Sha3_256>(a3,32),
+		"79f38adec5c20307a98ef76e8324afbfd46cfd81b22e3973c65fa1bd9de31787");
+	expect("Sha3_512 1600 bits 0xA3",streamed<qhash::Sha3_512>(a3,64),
+		"e76dfad22084a8b1467fcf2ffa58361bec7628edf5f3fdc0e4805dc48caeeca8"
+		"1b7c13c30adf52a3659584739a2df46be589c51ca1a4a8416df6545a1ce8ba00");
+	expect("Shake128 empty",streamed<qhash::Shake128>("",32),
+		"7f9c2ba4e88f827d616045507605853ed73b8093f6efbc88eb1a6eacfa66ef26");
+	expect("Shake128 abc",streamed<qhash::Shake128>("abc",32),
+		"5881092dd818bf5cf8a3ddb793fbcba74097d5c526a6d35f97b83351940f2cc8");
+	expect("Shake256 empty",streamed<qhash::Shake256>("",64),
+		"46b9dd2b0ba88d13233b3feb743eeb243fcd52ea62b81b82b50c27646ed5762f"
+		"d75dc4ddd8c0f200cb05019d67b592f6fc821c49479ab48640292eacb3b7c4be");
+
+	// the last 32 of 512 output bytes take several squeeze permutations
+	qhash::Shake128 h;
+	h.update(a3.data(),a3.size());
+	std::vector<u8> out(512);
+	for(std::size_t off=0,step=1;off<out.size();off+=step,step=step*2+1){
+		h.squeeze(out.data()+off,std::min(step,out.size()-off));
+	}
+	expect("Shake128 1600 bits 0xA3, bytes 480..511",hex(out.data()+480,32),
+		"44c9fb359fd56ac0a9a75a743cff6862f17d7259ab075216c0699511643b6439");
+}
+
+// FIPS 202 padding spelled out bit by bit: M || 01 || 1 0* 1, absorbed with
+// the same permutation, so only the bit handling is under test.
+std::array<u8,64> referenceSha3_512(const u8 *msg,u64 bitlen) {
+	constexpr std::size_t RATE_BITS=576;
+	std::vector<u8> bits;
+	for(u64 i=0;i<bitlen;++i)bits.push_back((msg[i/8]>>(i%8))&1);
+	bits.push_back(0);
+	bits.push_back(1);
+	bits.push_back(1);
+	while((bits.size()+1)%RATE_BITS)bits.push_back(0);
+	bits.push_back(1);
+
+	u64 st[25]{};
+	for(std::size_t b=0;b<bits.size();b+=RATE_BITS){
+		for(std::size_t i=0;i<RATE_BITS;++i){
+			st[i/64]^=static_cast<u64>(bits[b+i])<<(i%64);
+		}
+		qhash::detail::keccakf(st);
+	}
+	std::array<u8,64> out;
+	for(std::size_t i=0;i<out.size();++i)out[i]=static_cast<u8>(st[i/8]>>(8*(i%8)));
+	return out;
+}
+
+void bitLengths(std::mt19937_64 &rng) {
+	// every bit length through three blocks, so each padding position and
+	// the spill into an extra block are all reached
+	std::vector<u8> msg(3*72+1);
+	for(auto &b:msg)b=static_cast<u8>(rng());
+	for(u64 bitlen=0;bitlen<=3*576+8;++bitlen){
+		if(!expect("sha3_512 "+std::to_string(bitlen)+" bits",
+				hex(qhash::sha3_512(msg.data(),bitlen)),hex(referenceSha3_512(msg.data(),bitlen))))
+			return;
+	}
+}
+
+void paths(std::mt19937_64 &rng) {
+	std::vector<std::vector<u8>> msgs;
+	for(std::size_t len=0;len<=4*72+1;++len){
+		std::vector<u8> m(len);
+		for(auto &b:m)b=static_cast<u8>(rng());
+		msgs.push_back(std::move(m));
+	}
+
+	std::vector<std::array<u8,64>> want;
+	for(const auto &m:msgs)want.push_back(qhash::sha3_512_bytes(m.data(),m.size()));
+
+	// streaming, in random pieces
+	for(std::size_t k=0;k<msgs.size();++k){
+		const auto &m=msgs[k];
+		qhash::Sha3_512 h;
+		for(std::size_t off=0;off<m.size();){
+			const std::size_t n=std::min<std::size_t>(rng()%100,m.size()-off);
+			h.update(m.data()+off,n);
+			off+=n;
+		}
+		if(!expect("Sha3_512 streamed "+std::to_string(m.size())+" bytes",hex(h.final()),hex(want[k])))return;
+	}
+
+	// sha3_512_many over every batch size up to twice the widest kernel,
+	// with mixed lengths in each batch
+	for(std::size_t n=1;n<=17;++n){
+		for(std::size_t start=0;start+n<=msgs.size();start+=n*7+1){
+			std::vector<std::span<const u8>> in;
+			for(std::size_t k=0;k<n;++k){
+				const auto &m=msgs[(start+k*37)%msgs.size()];
+				in.emplace_back(m.data(),m.size());
+			}
+			std::vector<std::array<u8,64>> got(n);
+			qhash::sha3_512_many(in,got);
+			for(std::size_t k=0;k<n;++k){
+				const std::size_t j=(start+k*37)%msgs.size();
+				if(!expect("sha3_512_many batch "+std::to_string(n)+" length "+std::to_string(msgs[j].size()),
+						hex(got[k]),hex(want[j])))
+					return;
+			}
+		}
+	}
+}
+
+} // namespace
+
+int main() {
+	std::mt19937_64 rng(20240601);
+	sha3_512Vectors();
+	streamingVectors();
+	bitLengths(rng);
+	paths(rng);
+	std::printf("keccakf kernel %s, sha3_512_many width %zu\n",
+		qhash::detail::keccakf_kernel(),qhash::detail::many_width());
+	if(failures>0){
+		std::printf("%d failure(s)\n",failures);
+		return 1;
+	}
+	std::printf("all passed\n");
+	return 0;
+}
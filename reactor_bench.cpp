@@ -0,0 +1,238 @@
+// Reactor wakeup cost against the number of idle connections, printed as one
+// JSON object:
+//
+//   reactor_bench [--max-conns N] [--wakeups N] > before.json
+//
+// Each step registers N socketpair ends with the loop, then repeatedly times
+// one byte's trip from write() on a random peer to onData. Only one socket is
+// ever ready, so the time that grows with N is what the reactor spends on the
+// idle ones. The write is inside the timing because io_uring completes the
+// receive from within it.
+//
+// epoll, uring   the server's EventLoop backends (uring only where the
+//                kernel supports it)
+// poll_rebuild   the loop the server had before: a pollfd array rebuilt
+//                and scanned on every wakeup
+//
+// A connection costs two fds here, so N stops at half of RLIMIT_NOFILE;
+// "max_conns" in the output says where.
+
+#include "bench_common.hpp"
+#include "event_loop.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+using bench::Clock;
+using bench::nsSince;
+using qchat::EventLoop;
+
+class Counter final : public EventLoop::Handler {
+public:
+	void onAccept(int fd,const sockaddr_in&) override {::close(fd);}
+	void onData(int,const char*,std::size_t len) override {bytes+=len;}
+	void onHangup(int) override {}
+	void onNotify(int) override {}
+
+	std::size_t bytes{0};
+};
+
+int listenSocket() {
+	int fd=::socket(AF_INET,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+	if(fd<0)return -1;
+	sockaddr_in addr{};
+	addr.sin_family=AF_INET;
+	addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	if(::bind(fd,reinterpret_cast<sockaddr*>(&addr),sizeof(addr))<0 || ::listen(fd,16)<0){
+		::close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+std::size_t raiseFdLimit() {
+	rlimit lim{};
+	if(::getrlimit(RLIMIT_NOFILE,&lim)<0)return 1024;
+	lim.rlim_cur=lim.rlim_max;
+	::setrlimit(RLIMIT_NOFILE,&lim);
+	::getrlimit(RLIMIT_NOFILE,&lim);
+	return static_cast<std::size_t>(lim.rlim_cur);
+}
+
+struct Pair {
+	int loopFd;
+	int peerFd;
+};
+
+void poke(const Pair &p) {
+	const char c='x';
+	if(::write(p.peerFd,&c,1)!=1)std::perror("write");
+}
+
+void printRow(bool &first,const char *backend,std::size_t conns,std::vector<double> &ns) {
+	double sum=0;
+	for(double t:ns)sum+=t;
+	const double mean=sum/static_cast<double>(ns.size());
+	std::printf("%s\n    {\"backend\": \"%s\", \"conns\": %zu, \"mean_ns\": %.0f, \"p50_ns\": %.0f, \"p99_ns\": %.0f}",
+		first?"":",",backend,conns,mean,bench::quantile(ns,0.5),bench::quantile(ns,0.99));
+	first=false;
+}
+
+// Wakeups through one of the server's EventLoop backends.
+bool timeLoop(std::unique_ptr<EventLoop> loop,Counter &counter,int listenFd,const std::vector<Pair> &pairs,
+		std::size_t conns,std::size_t wakeups,std::mt19937 &rng,std::vector<double> &ns) {
+	if(!loop->init(listenFd))return false;
+	std::vector<qchat::OutQueue> out(conns);
+	for(std::size_t i=0;i<conns;++i){
+		if(!loop->addClient(pairs[i].loopFd,out[i]))return false;
+	}
+	// the first polls report every socket as writable once
+	for(std::size_t i=0;i<conns/64+16;++i)loop->poll(0);
+
+	ns.clear();
+	for(std::size_t k=0;k<wakeups+wakeups/10;++k){
+		const std::size_t before=counter.bytes;
+		const auto t0=Clock::now();
+		poke(pairs[rng()%conns]);
+		while(counter.bytes==before){
+			if(!loop->poll(1000))return false;
+		}
+		// the first tenth warms caches and is dropped
+		if(k>=wakeups/10)ns.push_back(nsSince(t0));
+	}
+	for(std::size_t i=0;i<conns;++i)loop->removeClient(pairs[i].loopFd);
+	loop->poll(0);
+	return true;
+}
+
+// The pre-reactor main loop: rebuild the pollfd array, poll, scan it.
+void timePollRebuild(int listenFd,const std::vector<Pair> &pairs,std::size_t conns,std::size_t wakeups,
+		std::mt19937 &rng,std::vector<double> &ns) {
+	std::vector<pollfd> fds;
+	ns.clear();
+	for(std::size_t k=0;k<wakeups+wakeups/10;++k){
+		const auto t0=Clock::now();
+		poke(pairs[rng()%conns]);
+		bool got=false;
+		while(!got){
+			fds.clear();
+			pollfd pfd{};
+			pfd.fd=listenFd;
+			pfd.events=POLLIN;
+			fds.push_back(pfd);
+			for(std::size_t i=0;i<conns;++i){
+				pollfd cfd{};
+				cfd.fd=pairs[i].loopFd;
+				cfd.events=POLLIN;
+				fds.push_back(cfd);
+			}
+			if(::poll(fds.data(),static_cast<nfds_t>(fds.size()),1000)<0){
+				std::perror("poll");
+				return;
+			}
+			for(std::size_t i=1;i<fds.size();++i){
+				if(fds[i].revents&POLLIN){
+					char buf[64];
+					if(::read(fds[i].fd,buf,sizeof(buf))>0)got=true;
+				}
+			}
+		}
+		if(k>=wakeups/10)ns.push_back(nsSince(t0));
+	}
+}
+
+} // namespace
+
+int main(int argc,char **argv) {
+	std::size_t maxConns=50000;
+	std::size_t wakeups=20000;
+	for(int i=1;i<argc;++i){
+		const std::string arg=argv[i];
+		if(arg=="--max-conns" && i+1<argc){
+			maxConns=std::strtoull(argv[++i],nullptr,10);
+		}else if(arg=="--wakeups" && i+1<argc){
+			wakeups=std::strtoull(argv[++i],nullptr,10);
+		}else{
+			std::fprintf(stderr,"Usage: %s [--max-conns N] [--wakeups N]\n",argv[0]);
+			return 1;
+		}
+	}
+	if(wakeups==0)wakeups=1;
+
+	const std::size_t fdLimit=raiseFdLimit();
+	const std::size_t fdConns=fdLimit>64?(fdLimit-64)/2:1;
+	if(maxConns>fdConns)maxConns=fdConns;
+	if(maxConns==0)maxConns=1;
+
+	const int listenFd=listenSocket();
+	if(listenFd<0){
+		std::perror("listen");
+		return 1;
+	}
+	std::vector<Pair> pairs;
+	pairs.reserve(maxConns);
+	for(std::size_t i=0;i<maxConns;++i){
+		int sv[2];
+		if(::socketpair(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0,sv)<0){
+			std::perror("socketpair");
+			return 1;
+		}
+		pairs.push_back(Pair{sv[0],sv[1]});
+	}
+
+	std::vector<std::size_t> steps;
+	for(std::size_t n:{100,300,1000,3000,10000,30000,50000}){
+		if(n<=maxConns)steps.push_back(n);
+	}
+	if(steps.empty() || steps.back()<maxConns)steps.push_back(maxConns);
+
+	std::printf("{\n  \"optimized\": %s,\n  \"compiler\": \"%s\",\n  \"fd_limit\": %zu,\n  \"max_conns\": %zu,\n",
+		bench::OPTIMIZED?"true":"false",__VERSION__,fdLimit,maxConns);
+
+	std::mt19937 rng(20240601);
+	std::vector<double> ns;
+	bool uring=true;
+	std::printf("  \"wakeup\": [");
+	bool first=true;
+	for(std::size_t conns:steps){
+		{
+			Counter counter;
+			if(timeLoop(qchat::makeEpollLoop(counter),counter,listenFd,pairs,conns,wakeups,rng,ns)){
+				printRow(first,"epoll",conns,ns);
+			}
+		}
+		if(uring){
+			Counter counter;
+			auto loop=qchat::makeUringLoop(counter);
+			if(loop==nullptr){
+				uring=false;
+			}else if(timeLoop(std::move(loop),counter,listenFd,pairs,conns,wakeups,rng,ns)){
+				printRow(first,"uring",conns,ns);
+			}
+		}
+		timePollRebuild(listenFd,pairs,conns,wakeups,rng,ns);
+		printRow(first,"poll_rebuild",conns,ns);
+		std::fflush(stdout);
+	}
+	std::printf("\n  ],\n  \"uring\": %s\n}\n",uring?"true":"false");
+
+	for(const Pair &p:pairs){
+		::close(p.loopFd);
+		::close(p.peerFd);
+	}
+	::close(listenFd);
+	return 0;
+}
@@ -1,5 +1,7 @@
 #include "server.hpp"
 
+#include <algorithm>
+#include <charconv>
 #include <iostream>
 #include <cstring>
 #include <cerrno>
@@ -8,34 +10,79 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <poll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <netdb.h>
 
 namespace qchat {
 
-Server::Server(unsigned short port,const std::string &dbPath)
-	:port_(port),
-	dbPath_(dbPath),
+namespace {
+
+bool setNonBlocking(int fd) {
+	int flags=::fcntl(fd,F_GETFL,0);
+	if(flags<0)return false;
+	return ::fcntl(fd,F_SETFL,flags|O_NONBLOCK)==0;
+}
+
+// SCROLLBACK without a count, and the most it will return.
+constexpr std::size_t DEFAULT_SCROLLBACK=50;
+constexpr std::size_t MAX_SCROLLBACK=1000;
+
+// Input a client may send while its password is being hashed.
+constexpr std::size_t MAX_HELD_INPUT=256*1024;
+
+OutBuf encodeFor(const ClientConn &c,std::string line) {
+	if(c.binary)return makeBinLine(line);
+	return makeLine(std::move(line));
+}
+
+} // namespace
+
+bool parseSlowConsumerPolicy(const std::string &name,SlowConsumerPolicy &out) {
+	if(name=="drop"){
+		out=SlowConsumerPolicy::Drop;
+		return true;
+	}
+	if(name=="disconnect"){
+		out=SlowConsumerPolicy::Disconnect;
+		return true;
+	}
+	return false;
+}
+
+Server::Server(Hub &hub,std::size_t shardId,unsigned short port,const ServerOptions &opts)
+	:hub_(hub),
+	shard_(shardId),
+	port_(port),
+	opts_(opts),
 	listenFd_(-1),
+	wakeFd_(-1),
 	running_(false),
-	dbFile_(dbPath) {}
+	db_(hub.db()),
+	dbMutex_(hub.mutex()) {}
 
 Server::~Server() {
+	loop_.reset();
 	if(listenFd_>=0){
 		::close(listenFd_);
 	}
+	if(wakeFd_>=0){
+		::close(wakeFd_);
+	}
 	for(auto &kv:clients_){
 		if(kv.second.fd>=0)::close(kv.second.fd);
 	}
 }
 
 bool Server::init() {
-	if(!dbFile_.load(db_)){
-		std::cerr<<"Failed to load DB from "<<dbPath_<<"\n";
+	if(!setupListenSocket())return false;
+	wakeFd_=::eventfd(0,EFD_CLOEXEC);
+	if(wakeFd_<0){
+		std::perror("eventfd");
 		return false;
 	}
-	if(!setupListenSocket())return false;
+	if(!setupEventLoop())return false;
 	running_=true;
 	return true;
 }
@@ -47,7 +94,8 @@ bool Server::setupListenSocket() {
 		return false;
 	}
 	int one=1;
-	if(::setsockopt(listenFd_,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one))<0){
+	if(::setsockopt(listenFd_,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one))<0 ||
+		::setsockopt(listenFd_,SOL_SOCKET,SO_REUSEPORT,&one,sizeof(one))<0){
 		std::perror("setsockopt");
 		::close(listenFd_);
 		listenFd_=-1;
@@ -69,7 +117,28 @@ bool Server::setupListenSocket() {
 		listenFd_=-1;
 		return false;
 	}
-	std::cout<<"Server listening on port "<<port_<<"\n";
+	if(!setNonBlocking(listenFd_)){
+		std::perror("fcntl");
+		::close(listenFd_);
+		listenFd_=-1;
+		return false;
+	}
+	if(shard_==0)std::cout<<"Server listening on port "<<port_<<"\n";
+	return true;
+}
+
+bool Server::setupEventLoop() {
+	if(opts_.backend==IoBackend::Uring){
+		loop_=makeUringLoop(*this);
+		if(!loop_){
+			std::cerr<<"io_uring unavailable on this kernel, falling back to epoll\n";
+		}
+	}
+	if(!loop_)loop_=makeEpollLoop(*this);
+	if(!loop_->init(listenFd_))return false;
+	loop_->setZeroCopy(opts_.zeroCopyMin);
+	if(!loop_->addNotifier(wakeFd_))return false;
+	if(shard_==0)std::cout<<"Using "<<loop_->name()<<" event loop\n";
 	return true;
 }
 
@@ -80,469 +149,957 @@ void Server::run() {
 
 void Server::mainLoop() {
 	while(running_){
-		std::vector<pollfd> fds;
-		fds.reserve(1+clients_.size());
-		pollfd pfd{};
-		pfd.fd=listenFd_;
-		pfd.events=POLLIN;
-		pfd.revents=0;
-		fds.push_back(pfd);
-		for(auto &kv:clients_){
-			pollfd cfd{};
-			cfd.fd=kv.first;
-			cfd.events=POLLIN;
-			cfd.revents=0;
-			fds.push_back(cfd);
-		}
-		int ret=::poll(fds.data(),static_cast<nfds_t>(fds.size()),1000);
-		if(ret<0){
-			if(errno==EINTR)continue;
-			std::perror("poll");
-			break;
-		}
-		if(ret==0)continue;
-		if(fds[0].revents&POLLIN){
-			handleNewConnection();
-		}
-		for(std::size_t i=1;i<fds.size();++i){
-			if(fds[i].revents&POLLIN){
-				handleClientReadable(fds[i].fd);
-			}else if(fds[i].revents&(POLLHUP|POLLERR|POLLNVAL)){
-				closeClient(fds[i].fd);
-			}
-		}
+		if(!loop_->poll(1000))break;
+		closePending();
 	}
 }
 
-void Server::handleNewConnection() {
-	sockaddr_in addr{};
-	socklen_t alen=sizeof(addr);
-	int fd=::accept(listenFd_,reinterpret_cast<sockaddr*>(&addr),&alen);
-	if(fd<0){
-		std::perror("accept");
-		return;
-	}
-	char ipbuf[INET_ADDRSTRLEN];
-	const char *ptr=::inet_ntop(AF_INET,&addr.sin_addr,ipbuf,sizeof(ipbuf));
-	std::string ip;
-	if(ptr!=nullptr)ip=ptr;
-	else ip="unknown";
+void Server::onAccept(int fd,const sockaddr_in &addr) {
 	ClientConn c;
 	c.fd=fd;
+	c.id=nextConnId_++;
 	c.loggedIn=false;
 	c.uid=0;
 	c.handle.clear();
-	c.peerIp=ip;
-	clients_.emplace(fd,std::move(c));
-	sendLine(fd,"SYS Welcome to qchat server\n");
+	c.peerIp=ipFromV4(addr.sin_addr);
+	c.in.setMaxLine(opts_.maxLine);
+	c.frames.setMaxFrame(opts_.maxLine);
+	auto it=clients_.emplace(fd,std::move(c)).first;
+	if(!loop_->addClient(fd,it->second.out)){
+		clients_.erase(it);
+		::close(fd);
+		return;
+	}
+	sendLine(it->second,"SYS Welcome to qchat server\n");
 }
 
-void Server::handleClientReadable(int fd) {
+void Server::onData(int fd,const char *data,std::size_t len) {
 	auto it=clients_.find(fd);
 	if(it==clients_.end())return;
-	ClientConn &c=it->second;
-	char buf[1024];
-	ssize_t n=::recv(fd,buf,sizeof(buf),0);
-	if(n<=0){
-		closeClient(fd);
+	feedInput(it->second,data,len);
+}
+
+void Server::feedInput(ClientConn &c,const char *data,std::size_t len) {
+	// PROTO switches framing mid-chunk; the rest goes to the other framer
+	std::size_t off=0;
+	while(off<len && !c.closing && !c.authPending){
+		if(c.binary){
+			off+=c.frames.feed(data+off,len-off,[&](FrameBuffer::Event ev,BinOp op,std::string_view payload){
+				if(ev==FrameBuffer::Event::TooLong){
+					sendLine(c,"ERR Line too long");
+				}else{
+					processFrame(c,op,payload);
+				}
+				return !c.closing && !c.authPending && c.binary;
+			});
+		}else{
+			off+=c.in.feed(data+off,len-off,[&](LineBuffer::Event ev,std::string_view line){
+				if(ev==LineBuffer::Event::TooLong){
+					sendLine(c,"ERR Line too long");
+				}else{
+					processLine(c,line);
+				}
+				return !c.closing && !c.authPending && !c.binary;
+			});
+		}
+	}
+	if(off<len && c.authPending && !c.closing){
+		if(c.held.size()+(len-off)>MAX_HELD_INPUT){
+			sendLine(c,"ERR Too much input while authenticating");
+			closeLater(c);
+			return;
+		}
+		c.held.append(data+off,len-off);
+	}
+}
+
+void Server::onHangup(int fd) {
+	closeClient(fd);
+}
+
+void Server::post(ShardMsg msg) {
+	inbox_.push(std::move(msg));
+	// one eventfd write per batch: the reactor clears the flag before draining
+	if(!wakePending_.exchange(true,std::memory_order_acq_rel)){
+		u64 one=1;
+		if(::write(wakeFd_,&one,sizeof(one))<0)std::perror("eventfd write");
+	}
+}
+
+void Server::onNotify(int fd) {
+	if(fd!=wakeFd_)return;
+	wakePending_.store(false,std::memory_order_release);
+	ShardMsg msg;
+	while(inbox_.pop(msg)){
+		handleShardMsg(msg);
+	}
+}
+
+void Server::handleShardMsg(const ShardMsg &msg) {
+	switch(msg.kind){
+	case ShardMsg::Kind::Broadcast:
+		broadcastLocal(msg.line,-1);
+		break;
+	case ShardMsg::Kind::Deliver:
+		deliverLocal(msg.uid,msg.line);
+		break;
+	case ShardMsg::Kind::HashDone:
+		onHashDone(*msg.job);
+		break;
+	case ShardMsg::Kind::Durable:
+		onDurable(msg.seq);
+		break;
+	}
+}
+
+std::shared_ptr<HashJob> Server::newHashJob(const ClientConn &c,HashJob::Op op) {
+	auto job=std::make_shared<HashJob>();
+	job->op=op;
+	job->owner=this;
+	job->fd=c.fd;
+	job->connId=c.id;
+	return job;
+}
+
+void Server::submitHash(ClientConn &c,std::shared_ptr<HashJob> job) {
+	if(!hub_.hashPool().submit(std::move(job))){
+		sendLine(c,"ERR Server busy, try again");
 		return;
 	}
-	c.recvBuf.append(buf,buf+static_cast<std::size_t>(n));
-	for(;;){
-		std::size_t pos=c.recvBuf.find('\n');
-		if(pos==std::string::npos)break;
-		std::string line=c.recvBuf.substr(0,pos);
-		c.recvBuf.erase(0,pos+1);
-		line=trim(line);
-		if(line.empty())continue;
-		processLine(c,line);
+	c.authPending=true;
+}
+
+void Server::onHashDone(const HashJob &job) {
+	auto it=clients_.find(job.fd);
+	if(it==clients_.end() || it->second.id!=job.connId)return;
+	ClientConn &c=it->second;
+	c.authPending=false;
+	if(c.closing)return;
+	switch(job.op){
+	case HashJob::Op::Signup:
+		finishSignup(c,job);
+		break;
+	case HashJob::Op::Login:
+		finishLogin(c,job);
+		break;
+	case HashJob::Op::ChPass:
+		finishChPass(c,job);
+		break;
+	}
+	if(!c.held.empty()){
+		std::string held;
+		held.swap(c.held);
+		feedInput(c,held.data(),held.size());
 	}
 }
 
 void Server::closeClient(int fd) {
 	auto it=clients_.find(fd);
 	if(it==clients_.end())return;
+	if(it->second.loggedIn){
+		std::lock_guard<std::mutex> lock(dbMutex_);
+		sessionEnd(it->second);
+	}
+	loop_->removeClient(fd);
 	::close(fd);
 	clients_.erase(it);
 }
 
-void Server::broadcast(const std::string &msg,int exceptFd) {
+void Server::sessionStart(ClientConn &c,const UserRow &u) {
+	hub_.sessionOpened(u.uid(),shard_);
+	presence_[u.uid()].push_back(c.fd);
+	c.loggedIn=true;
+	c.uid=u.uid();
+	c.handle=u.handle();
+}
+
+void Server::sessionEnd(ClientConn &c) {
+	hub_.sessionClosed(c.uid,shard_);
+	auto it=presence_.find(c.uid);
+	if(it!=presence_.end()){
+		std::vector<int> &fds=it->second;
+		for(std::size_t i=0;i<fds.size();++i){
+			if(fds[i]==c.fd){
+				fds[i]=fds.back();
+				fds.pop_back();
+				break;
+			}
+		}
+		if(fds.empty())presence_.erase(it);
+	}
+	c.loggedIn=false;
+	c.uid=0;
+	c.handle.clear();
+}
+
+// Handlers never erase from clients_ directly, so references to a
+// ClientConn stay valid for the whole dispatch.
+void Server::closeLater(ClientConn &c) {
+	if(c.closing)return;
+	c.closing=true;
+	pendingClose_.push_back(c.fd);
+}
+
+void Server::closePending() {
+	std::vector<int> fds;
+	fds.swap(pendingClose_);
+	for(int fd:fds)closeClient(fd);
+}
+
+// The line is encoded once per protocol; every shard and every connection
+// queues a reference to the same buffers.
+WireLine Server::broadcast(std::string msg,int exceptFd) {
+	ShardMsg m;
+	m.kind=ShardMsg::Kind::Broadcast;
+	m.line=makeWireLine(std::move(msg));
+	hub_.postOthers(shard_,m);
+	broadcastLocal(m.line,exceptFd);
+	return std::move(m.line);
+}
+
+void Server::broadcastLocal(const WireLine &line,int exceptFd) {
 	for(auto &kv:clients_){
 		if(kv.first==exceptFd)continue;
-		sendLine(kv.first,msg);
+		queueOut(kv.second,kv.second.binary?line.bin:line.text);
 	}
 }
 
-bool Server::sendAll(int fd,const char *data,std::size_t len) {
-	std::size_t off=0;
-	while(off<len){
-		ssize_t n=::send(fd,data+off,len-off,0);
-		if(n<0){
-			if(errno==EINTR)continue;
-			return false;
-		}
-		if(n==0)return false;
-		off+=static_cast<std::size_t>(n);
+bool Server::deliverLocal(u64 uid,const WireLine &line) {
+	auto it=presence_.find(uid);
+	if(it==presence_.end())return false;
+	for(int fd:it->second){
+		auto cit=clients_.find(fd);
+		if(cit!=clients_.end())queueOut(cit->second,cit->second.binary?line.bin:line.text);
 	}
 	return true;
 }
 
 void Server::sendLine(int fd,const std::string &line) {
-	std::string out=line;
-	if(out.empty() || out.back()!='\n')out.push_back('\n');
-	sendAll(fd,out.data(),out.size());
+	auto it=clients_.find(fd);
+	if(it==clients_.end())return;
+	sendLine(it->second,line);
+}
+
+void Server::sendLine(ClientConn &c,const std::string &line) {
+	queueOut(c,encodeFor(c,line));
+}
+
+// Applies the slow-consumer policy, then hands buf to the event loop, which
+// writes it once the socket has room.
+void Server::queueOut(ClientConn &c,OutBuf buf) {
+	if(c.closing)return;
+	if(c.syncSeq!=0){
+		if(c.syncSeq>hub_.durableSeq()){
+			c.unsynced.push_back(std::move(buf));
+			return;
+		}
+		releaseUnsynced(c);
+	}
+	if(c.dropping){
+		if(c.out.bytes()>opts_.lowWatermark){
+			++c.dropped;
+			return;
+		}
+		c.dropping=false;
+		std::ostringstream note;
+		note<<"SYS "<<c.dropped<<" messages dropped (connection too slow)";
+		c.dropped=0;
+		c.out.push(encodeFor(c,note.str()));
+	}
+	if(c.out.bytes()+buf->size()>opts_.highWatermark){
+		if(opts_.slowPolicy==SlowConsumerPolicy::Disconnect){
+			closeLater(c);
+			return;
+		}
+		c.dropping=true;
+		++c.dropped;
+		return;
+	}
+	c.out.push(std::move(buf));
+	loop_->flush(c.fd);
+}
+
+void Server::awaitDurable(ClientConn &c) {
+	if(hub_.durableSeq()>=hub_.journal().lastSeq())return; // written through
+	if(c.syncSeq==0)syncWaiters_.push_back(c.fd);
+	c.syncSeq=hub_.journal().lastSeq();
+	awaitedSeq_.store(c.syncSeq);
+}
+
+void Server::onDurable(u64 seq) {
+	std::size_t keep=0;
+	for(int fd:syncWaiters_){
+		auto it=clients_.find(fd);
+		if(it==clients_.end() || it->second.syncSeq==0)continue;
+		if(it->second.syncSeq>seq){
+			syncWaiters_[keep++]=fd;
+			continue;
+		}
+		releaseUnsynced(it->second);
+	}
+	syncWaiters_.resize(keep);
+}
+
+void Server::releaseUnsynced(ClientConn &c) {
+	c.syncSeq=0;
+	std::vector<OutBuf> bufs;
+	bufs.swap(c.unsynced);
+	for(OutBuf &buf:bufs)queueOut(c,std::move(buf));
 }
 
-User *Server::findUserByHandle(const std::string &handle) {
-	auto it=db_.uidByHandle.find(handle);
-	if(it==db_.uidByHandle.end())return nullptr;
-	return findUserById(it->second);
+std::optional<UserRow> Server::findUserByHandle(std::string_view handle) {
+	return db_.users.byHandle(handle);
 }
 
-User *Server::findUserById(u64 uid) {
-	auto it=db_.usersById.find(uid);
-	if(it==db_.usersById.end())return nullptr;
-	return &it->second;
+std::optional<UserRow> Server::findUserById(u64 uid) {
+	return db_.users.byUid(uid);
 }
 
-void Server::recordLogin(User &u,const std::string &ip) {
+void Server::recordLogin(ClientConn &c,const UserRow &u) {
 	LoginRecord rec;
 	rec.epochSeconds=nowEpochSeconds();
-	rec.ip=ip;
-	u.history.push_back(rec);
-	const std::size_t maxHist=32;
-	if(u.history.size()>maxHist){
-		const std::size_t drop=u.history.size()-maxHist;
-		u.history.erase(u.history.begin(),u.history.begin()+static_cast<std::ptrdiff_t>(drop));
-	}
+	rec.ip=c.peerIp;
+	hub_.journal().loginRecorded(u.uid(),rec);
+	awaitDurable(c);
+	db_.users.editProfile(u.uid(),hub_.journal().lastSeq()).history.push(rec);
 }
 
-void Server::processLine(ClientConn &c,const std::string &line) {
-	std::string trimmed=trim(line);
-	if(trimmed.empty())return;
+void Server::processLine(ClientConn &c,std::string_view line) {
+	auto [cmd,rest]=splitCommand(line);
+	if(cmd.empty())return;
 
-	std::size_t sp=trimmed.find(' ');
-	std::string cmd;
-	std::string rest;
+	switch(verbKey(cmd)){
+	case verbKey("SIGNUP"):   cmdSignup(c,rest); break;
+	case verbKey("LOGIN"):    cmdLogin(c,rest); break;
+	case verbKey("MSGALL"):   cmdMsgAll(c,rest); break;
+	case verbKey("MSGTO"):    cmdMsgTo(c,rest); break;
+	case verbKey("CHPASS"):   cmdChPass(c,rest); break;
+	case verbKey("CHHANDLE"): cmdChHandle(c,rest); break;
+	case verbKey("CHNAME"):   cmdChName(c,rest); break;
+	case verbKey("SETMULTI"): cmdSetMulti(c,rest); break;
+	case verbKey("HISTORY"):  cmdHistory(c); break;
+	case verbKey("WHO"):
+	case verbKey("ONLINE"):   cmdWho(c); break;
+	case verbKey("LOGOUT"):   cmdLogout(c); break;
+	case verbKey("PROTO"):    cmdProto(c,rest); break;
+	case verbKey("STATS"):    cmdStats(c); break;
+	case verbKey("QUIT"):     closeLater(c); break;
+	default:
+		// verbs longer than 8 bytes all land here
+		if(cmd=="SCROLLBACK"){
+			cmdScrollback(c,rest);
+			break;
+		}
+		sendLine(c,"ERR Unknown command");
+		break;
+	}
+}
 
-	if(sp==std::string::npos){
-		cmd=trimmed;
-		rest.clear();
-	}else{
-		cmd=trimmed.substr(0,sp);
-		rest=trim(trimmed.substr(sp+1));
-	}
-
-	if(cmd=="SIGNUP"){
-		cmdSignup(c,rest);
-	}else if(cmd=="LOGIN"){
-		cmdLogin(c,rest);
-	}else if(cmd=="MSGALL"){
-		cmdMsgAll(c,rest);
-	}else if(cmd=="MSGTO"){
-		cmdMsgTo(c,rest);
-	}else if(cmd=="CHPASS"){
-		cmdChPass(c,rest);
-	}else if(cmd=="CHHANDLE"){
-		cmdChHandle(c,rest);
-	}else if(cmd=="CHNAME"){
-		cmdChName(c,rest);
-	}else if(cmd=="SETMULTI"){
-		cmdSetMulti(c,rest);
-	}else if(cmd=="HISTORY"){
-		cmdHistory(c);
-	}else if(cmd=="LOGOUT"){
-		cmdLogout(c);
-	}else if(cmd=="QUIT"){
-		closeClient(c.fd);
-	}else{
-		sendLine(c.fd,"ERR Unknown command");
+// Binary frames skip tokenizing: fields are length-prefixed, so they may
+// hold spaces (passwords) or newlines (message text).
+void Server::processFrame(ClientConn &c,BinOp op,std::string_view payload) {
+	std::string_view handle;
+	std::string_view pw;
+	switch(op){
+	case BinOp::Signup:
+		if(!takeBinField(payload,handle) || !takeBinField(payload,pw) || pw.empty() || payload.empty()){
+			sendLine(c,"ERR Malformed frame");
+			return;
+		}
+		signup(c,handle,pw,payload);
+		break;
+	case BinOp::Login:
+		if(!takeBinField(payload,handle) || payload.empty()){
+			sendLine(c,"ERR Malformed frame");
+			return;
+		}
+		login(c,handle,payload);
+		break;
+	case BinOp::MsgAll:
+		cmdMsgAll(c,payload);
+		break;
+	case BinOp::MsgTo:
+		if(!takeBinField(payload,handle) || payload.empty()){
+			sendLine(c,"ERR Malformed frame");
+			return;
+		}
+		msgTo(c,handle,payload);
+		break;
+	case BinOp::Command:
+		processLine(c,payload);
+		break;
+	default:
+		sendLine(c,"ERR Unknown opcode");
+		break;
 	}
 }
 
-void Server::cmdSignup(ClientConn &c,const std::string &rest) {
+void Server::cmdSignup(ClientConn &c,std::string_view rest) {
 	if(c.loggedIn){
-		sendLine(c.fd,"ERR Already logged in");
+		sendLine(c,"ERR Already logged in");
 		return;
 	}
 	// rest = "handle password display_name(with spaces, unicode...)"
-	auto toks=splitTokens(rest,3); // [handle][password][display name...]
-	if(toks.size()<3u){
-		sendLine(c.fd,"ERR Usage: SIGNUP handle password display_name");
+	std::array<std::string_view,3> toks; // [handle][password][display name...]
+	if(splitTokens(rest,toks)<3u){
+		sendLine(c,"ERR Usage: SIGNUP handle password display_name");
 		return;
 	}
-	const std::string &handle=toks[0];
-	const std::string &pw=toks[1];
-	const std::string &display=toks[2];
+	signup(c,toks[0],toks[1],toks[2]);
+}
 
+void Server::signup(ClientConn &c,std::string_view handle,std::string_view pw,std::string_view display) {
+	if(c.loggedIn){
+		sendLine(c,"ERR Already logged in");
+		return;
+	}
 	if(!isValidHandle(handle)){
-		sendLine(c.fd,"ERR Invalid handle");
+		sendLine(c,"ERR Invalid handle");
 		return;
 	}
-	if(db_.uidByHandle.find(handle)!=db_.uidByHandle.end()){
-		sendLine(c.fd,"ERR Handle already exists");
+	{
+		// fail fast; finishSignup checks again once the hash is ready
+		std::lock_guard<std::mutex> lock(dbMutex_);
+		if(db_.users.handleTaken(handle)){
+			sendLine(c,"ERR Handle already exists");
+			return;
+		}
+	}
+	auto job=newHashJob(c,HashJob::Op::Signup);
+	job->handle=handle;
+	job->display=display;
+	job->password=pw;
+	submitHash(c,std::move(job));
+}
+
+void Server::finishSignup(ClientConn &c,const HashJob &job) {
+	std::unique_lock<std::mutex> lock(dbMutex_);
+	if(db_.users.handleTaken(job.handle)){
+		lock.unlock();
+		sendLine(c,"ERR Handle already exists");
 		return;
 	}
 
-	User u{};
+	UserAuth u;
 	u.uid=db_.nextUid++;
-	u.handle=handle;
-	u.displayName=display; // spaces & UTF-8 allowed
-	u.passwordHash=hashPassword(pw);
+	u.handle=job.handle;
+	u.passwordHash=job.newHash;
 	u.allowMultiLogin=false;
+	UserProfile p;
+	p.displayName=job.display; // spaces & UTF-8 allowed
 
-	db_.uidByHandle[handle]=u.uid;
-	db_.usersById.emplace(u.uid,std::move(u));
-	saveDbIfPossible();
-	sendLine(c.fd,"OK Signup successful");
+	hub_.journal().userCreated(u,p.displayName);
+	awaitDurable(c);
+	db_.users.add(std::move(u),std::move(p),hub_.journal().lastSeq());
+	lock.unlock();
+	sendLine(c,"OK Signup successful");
 }
 
-void Server::cmdLogin(ClientConn &c,const std::string &rest) {
+void Server::cmdLogin(ClientConn &c,std::string_view rest) {
 	// rest = "handle password"
-	auto toks=splitTokens(rest,3);
-	if(toks.size()<2u){
-		sendLine(c.fd,"ERR Usage: LOGIN handle password");
+	std::array<std::string_view,3> toks;
+	if(splitTokens(rest,toks)<2u){
+		sendLine(c,"ERR Usage: LOGIN handle password");
 		return;
 	}
-	const std::string &handle=toks[0];
-	const std::string &pw=toks[1];
+	login(c,toks[0],toks[1]);
+}
+
+void Server::login(ClientConn &c,std::string_view handle,std::string_view pw) {
+	auto job=newHashJob(c,HashJob::Op::Login);
+	{
+		std::lock_guard<std::mutex> lock(dbMutex_);
+		auto u=findUserByHandle(handle);
+		if(!u){
+			sendLine(c,"ERR No such user");
+			return;
+		}
+		job->uid=u->uid();
+		job->expected=u->passwordHash();
+	}
+	job->password=pw;
+	submitHash(c,std::move(job));
+}
 
-	User *u=findUserByHandle(handle);
-	if(u==nullptr){
-		sendLine(c.fd,"ERR No such user");
+void Server::finishLogin(ClientConn &c,const HashJob &job) {
+	if(!job.matched){
+		sendLine(c,"ERR Invalid password");
 		return;
 	}
-	if(!passwordMatches(u->passwordHash,pw)){
-		sendLine(c.fd,"ERR Invalid password");
+	std::unique_lock<std::mutex> lock(dbMutex_);
+	auto u=findUserById(job.uid);
+	// the account may have changed its password while we were hashing
+	if(!u || u->passwordHash()!=job.expected){
+		lock.unlock();
+		sendLine(c,"ERR Invalid password");
 		return;
 	}
-	if(!u->allowMultiLogin){
-		for(auto &kv:clients_){
-			if(kv.second.loggedIn && kv.second.uid==u->uid && kv.second.fd!=c.fd){
-				sendLine(c.fd,"ERR Multiple logins disabled for this account");
-				return;
-			}
+	if(!u->allowMultiLogin()){
+		unsigned others=hub_.sessionsOf(u->uid());
+		if(c.loggedIn && c.uid==u->uid())--others;
+		if(others>0){
+			lock.unlock();
+			sendLine(c,"ERR Multiple logins disabled for this account");
+			return;
 		}
 	}
-	c.loggedIn=true;
-	c.uid=u->uid;
-	c.handle=u->handle;
+	if(job.rehashed){
+		db_.users.setPasswordHash(u->uid(),job.newHash);
+		hub_.journal().passwordChanged(u->uid(),job.newHash);
+	}
+	if(c.loggedIn)sessionEnd(c);
+	sessionStart(c,*u);
 
-	recordLogin(*u,c.peerIp);
-	saveDbIfPossible();
+	recordLogin(c,*u);
 
-	std::string ok="OK Login successful as "+u->displayName+" (@"+u->handle+")";
-	sendLine(c.fd,ok);
+	const std::string &display=db_.users.profile(u->uid()).displayName;
+	std::string ok="OK Login successful as "+display+" (@";
+	ok.append(u->handle()).append(")");
+	std::string sys="SYS "+display+" (@";
+	sys.append(u->handle()).append(") joined chat");
+	// everything that waited is detached now and read once the lock is gone
+	OfflineQueue *offline=hub_.offline();
+	OfflineQueue::Batch batch;
+	if(offline!=nullptr)batch=offline->take(u->uid());
+	lock.unlock();
+
+	// as a single buffer behind the reply
+	std::string waiting;
+	if(batch.size()>0){
+		std::string ln;
+		std::string body;
+		const std::size_t n=offline->read(batch,[&](u64 epochSeconds,std::string_view line){
+			ln.assign("OFFLINE ").append(std::to_string(epochSeconds)).append(" ").append(line);
+			if(c.binary){
+				body.append(encodeBinReply(ln));
+			}else{
+				body.append(ln).append("\n");
+			}
+		});
+		const std::string head="OFFLINE "+std::to_string(n);
+		waiting=c.binary?encodeBinReply(head):head+"\n";
+		waiting.append(body);
+	}
 
-	std::string sys="SYS "+u->displayName+" (@"+u->handle+") joined chat";
-	broadcast(sys,c.fd);
+	sendLine(c,ok);
+	if(!waiting.empty())queueOut(c,std::make_shared<const std::string>(std::move(waiting)));
+	broadcast(std::move(sys),c.fd);
 }
 
-void Server::cmdMsgAll(ClientConn &c,const std::string &rest) {
+void Server::cmdMsgAll(ClientConn &c,std::string_view rest) {
 	if(!c.loggedIn){
-		sendLine(c.fd,"ERR Not logged in");
+		sendLine(c,"ERR Not logged in");
 		return;
 	}
 	if(rest.empty()){
-		sendLine(c.fd,"ERR Usage: MSGALL message");
+		sendLine(c,"ERR Usage: MSGALL message");
 		return;
 	}
 
-	User *u=findUserById(c.uid);
-	if(u==nullptr){
-		sendLine(c.fd,"ERR Internal error");
+	std::unique_lock<std::mutex> lock(dbMutex_);
+	auto u=findUserById(c.uid);
+	if(!u){
+		lock.unlock();
+		sendLine(c,"ERR Internal error");
 		return;
 	}
-
-	const std::string &text=rest; // full message with spaces & UTF-8
-	std::string line="FROM "+u->displayName+" (@"+u->handle+"): "+text;
-	broadcast(line,-1);
+	const std::string &display=db_.users.profile(u->uid()).displayName;
+	std::string_view text=rest; // full message with spaces & UTF-8
+	std::string line;
+	line.reserve(display.size()+u->handle().size()+text.size()+16);
+	line.append("FROM ").append(display).append(" (@").append(u->handle()).append("): ").append(text);
+	lock.unlock();
+	WireLine sent=broadcast(std::move(line),-1);
+	// archived after the fan-out, which it never delays
+	if(Archive *a=hub_.archive())a->append(Archive::Kind::Broadcast,c.uid,0,std::move(sent.text));
 }
 
-void Server::cmdMsgTo(ClientConn &c,const std::string &rest) {
+void Server::cmdMsgTo(ClientConn &c,std::string_view rest) {
 	if(!c.loggedIn){
-		sendLine(c.fd,"ERR Not logged in");
+		sendLine(c,"ERR Not logged in");
 		return;
 	}
 	// rest = "handle message..."
-	auto toks=splitTokens(rest,2); // [handle][message...]
-	if(toks.size()<2u){
-		sendLine(c.fd,"ERR Usage: MSGTO handle message");
+	std::array<std::string_view,2> toks; // [handle][message...]
+	if(splitTokens(rest,toks)<2u){
+		sendLine(c,"ERR Usage: MSGTO handle message");
 		return;
 	}
-	const std::string &dstHandle=toks[0];
-	const std::string &text=toks[1];
+	msgTo(c,toks[0],toks[1]);
+}
 
-	User *dst=findUserByHandle(dstHandle);
-	if(dst==nullptr){
-		sendLine(c.fd,"ERR No such user");
+void Server::msgTo(ClientConn &c,std::string_view dstHandle,std::string_view text) {
+	if(!c.loggedIn){
+		sendLine(c,"ERR Not logged in");
+		return;
+	}
+	std::unique_lock<std::mutex> lock(dbMutex_);
+	auto dst=findUserByHandle(dstHandle);
+	if(!dst){
+		lock.unlock();
+		sendLine(c,"ERR No such user");
+		return;
+	}
+	auto src=findUserById(c.uid);
+	if(!src){
+		lock.unlock();
+		sendLine(c,"ERR Internal error");
 		return;
 	}
-	User *src=findUserById(c.uid);
-	if(src==nullptr){
-		sendLine(c.fd,"ERR Internal error");
+	const std::string &display=db_.users.profile(src->uid()).displayName;
+	std::string line;
+	line.reserve(display.size()+src->handle().size()+text.size()+24);
+	line.append("PRIVATE from ").append(display).append(" (@").append(src->handle()).append("): ").append(text);
+	if(hub_.sessionsOf(dst->uid())==0){
+		queueOffline(c,dst->uid(),std::move(line),lock);
 		return;
 	}
+	ShardMsg m;
+	m.kind=ShardMsg::Kind::Deliver;
+	m.uid=dst->uid();
+	m.line=makeWireLine(std::move(line));
+	hub_.postSessions(shard_,m.uid,m);
+	lock.unlock();
 
-	bool sent=false;
-	for(auto &kv:clients_){
-		ClientConn &other=kv.second;
-		if(other.loggedIn && other.uid==dst->uid){
-			std::string line="PRIVATE from "+src->displayName+" (@"+src->handle+"): "+text;
-			sendLine(other.fd,line);
-			sent=true;
-		}
+	deliverLocal(m.uid,m.line);
+	if(Archive *a=hub_.archive())a->append(Archive::Kind::Private,c.uid,m.uid,m.line.text);
+	sendLine(c,"OK Private message sent");
+}
+
+// Called with lock held on dbMutex_, so the recipient cannot log in between
+// the presence check and the push; releases it.
+void Server::queueOffline(ClientConn &c,u64 dst,std::string line,std::unique_lock<std::mutex> &lock) {
+	OfflineQueue *offline=hub_.offline();
+	if(offline==nullptr){
+		lock.unlock();
+		sendLine(c,"ERR Target user not online");
+		return;
 	}
-	if(!sent){
-		sendLine(c.fd,"ERR Target user not online");
-	}else{
-		sendLine(c.fd,"OK Private message sent");
+	const OfflineQueue::PushResult r=offline->push(dst,line);
+	lock.unlock();
+	switch(r){
+	case OfflineQueue::PushResult::Queued:
+		// a failed write stays pending and is retried by the next flush
+		offline->flush();
+		if(Archive *a=hub_.archive())a->append(Archive::Kind::Private,c.uid,dst,makeLine(std::move(line)));
+		sendLine(c,"OK Target user offline, message queued");
+		break;
+	case OfflineQueue::PushResult::Full:
+		sendLine(c,"ERR Target user offline and their queue is full");
+		break;
 	}
 }
 
-void Server::cmdChPass(ClientConn &c,const std::string &rest) {
+void Server::cmdChPass(ClientConn &c,std::string_view rest) {
 	if(!c.loggedIn){
-		sendLine(c.fd,"ERR Not logged in");
+		sendLine(c,"ERR Not logged in");
 		return;
 	}
-	auto toks=splitTokens(rest,3); // old, new
-	if(toks.size()<2u){
-		sendLine(c.fd,"ERR Usage: CHPASS old new");
+	std::array<std::string_view,3> toks; // old, new
+	if(splitTokens(rest,toks)<2u){
+		sendLine(c,"ERR Usage: CHPASS old new");
 		return;
 	}
-	const std::string &oldPw=toks[0];
-	const std::string &newPw=toks[1];
+	auto job=newHashJob(c,HashJob::Op::ChPass);
+	{
+		std::lock_guard<std::mutex> lock(dbMutex_);
+		auto u=findUserById(c.uid);
+		if(!u){
+			sendLine(c,"ERR Internal error");
+			return;
+		}
+		job->uid=u->uid();
+		job->expected=u->passwordHash();
+	}
+	job->password=toks[0];
+	job->newPassword=toks[1];
+	submitHash(c,std::move(job));
+}
 
-	User *u=findUserById(c.uid);
-	if(u==nullptr){
-		sendLine(c.fd,"ERR Internal error");
+void Server::finishChPass(ClientConn &c,const HashJob &job) {
+	if(!job.matched){
+		sendLine(c,"ERR Old password mismatch");
+		return;
+	}
+	std::unique_lock<std::mutex> lock(dbMutex_);
+	auto u=findUserById(job.uid);
+	if(!u || !c.loggedIn || c.uid!=job.uid){
+		lock.unlock();
+		sendLine(c,"ERR Internal error");
 		return;
 	}
-	if(!passwordMatches(u->passwordHash,oldPw)){
-		sendLine(c.fd,"ERR Old password mismatch");
+	if(u->passwordHash()!=job.expected){
+		lock.unlock();
+		sendLine(c,"ERR Old password mismatch");
 		return;
 	}
-	u->passwordHash=hashPassword(newPw);
-	saveDbIfPossible();
-	sendLine(c.fd,"OK Password changed");
+	db_.users.setPasswordHash(u->uid(),job.newHash);
+	hub_.journal().passwordChanged(u->uid(),job.newHash);
+	awaitDurable(c);
+	lock.unlock();
+	sendLine(c,"OK Password changed");
 }
 
-void Server::cmdChHandle(ClientConn &c,const std::string &rest) {
+void Server::cmdChHandle(ClientConn &c,std::string_view rest) {
 	if(!c.loggedIn){
-		sendLine(c.fd,"ERR Not logged in");
+		sendLine(c,"ERR Not logged in");
 		return;
 	}
-	auto toks=splitTokens(rest,2); // new_handle
-	if(toks.empty()){
-		sendLine(c.fd,"ERR Usage: CHHANDLE new_handle");
+	std::array<std::string_view,2> toks; // new_handle
+	if(splitTokens(rest,toks)==0){
+		sendLine(c,"ERR Usage: CHHANDLE new_handle");
 		return;
 	}
-	const std::string &newHandle=toks[0];
+	const std::string newHandle(toks[0]);
 
 	if(!isValidHandle(newHandle)){
-		sendLine(c.fd,"ERR Invalid handle");
+		sendLine(c,"ERR Invalid handle");
 		return;
 	}
-	if(db_.uidByHandle.find(newHandle)!=db_.uidByHandle.end()){
-		sendLine(c.fd,"ERR Handle already exists");
+	std::unique_lock<std::mutex> lock(dbMutex_);
+	if(db_.users.handleTaken(newHandle)){
+		lock.unlock();
+		sendLine(c,"ERR Handle already exists");
 		return;
 	}
-	User *u=findUserById(c.uid);
-	if(u==nullptr){
-		sendLine(c.fd,"ERR Internal error");
+	auto u=findUserById(c.uid);
+	if(!u){
+		lock.unlock();
+		sendLine(c,"ERR Internal error");
 		return;
 	}
-	db_.uidByHandle.erase(u->handle);
-	u->handle=newHandle;
-	db_.uidByHandle[newHandle]=u->uid;
-	c.handle=newHandle;
-	saveDbIfPossible();
-	sendLine(c.fd,"OK Handle changed");
+	db_.users.changeHandle(u->uid(),newHandle);
+	// presence is keyed by uid; only the cached handles need refreshing
+	auto pit=presence_.find(u->uid());
+	if(pit!=presence_.end()){
+		for(int fd:pit->second){
+			auto cit=clients_.find(fd);
+			if(cit!=clients_.end())cit->second.handle=newHandle;
+		}
+	}
+	hub_.journal().handleChanged(u->uid(),u->handle());
+	awaitDurable(c);
+	lock.unlock();
+	sendLine(c,"OK Handle changed");
 }
 
-void Server::cmdChName(ClientConn &c,const std::string &rest) {
+void Server::cmdChName(ClientConn &c,std::string_view rest) {
 	if(!c.loggedIn){
-		sendLine(c.fd,"ERR Not logged in");
+		sendLine(c,"ERR Not logged in");
 		return;
 	}
 	if(rest.empty()){
-		sendLine(c.fd,"ERR Usage: CHNAME display_name");
+		sendLine(c,"ERR Usage: CHNAME display_name");
 		return;
 	}
-	User *u=findUserById(c.uid);
-	if(u==nullptr){
-		sendLine(c.fd,"ERR Internal error");
+	std::unique_lock<std::mutex> lock(dbMutex_);
+	auto u=findUserById(c.uid);
+	if(!u){
+		lock.unlock();
+		sendLine(c,"ERR Internal error");
 		return;
 	}
-	u->displayName=rest; // full string, spaces, UTF-8 allowed
-	saveDbIfPossible();
-	sendLine(c.fd,"OK Display name changed");
+	std::string name(rest); // full string, spaces, UTF-8 allowed
+	hub_.journal().displayNameChanged(u->uid(),name);
+	awaitDurable(c);
+	db_.users.editProfile(u->uid(),hub_.journal().lastSeq()).displayName=std::move(name);
+	lock.unlock();
+	sendLine(c,"OK Display name changed");
 }
 
-void Server::cmdSetMulti(ClientConn &c,const std::string &rest) {
+void Server::cmdSetMulti(ClientConn &c,std::string_view rest) {
 	if(!c.loggedIn){
-		sendLine(c.fd,"ERR Not logged in");
+		sendLine(c,"ERR Not logged in");
 		return;
 	}
-	auto toks=splitTokens(rest,2);
-	if(toks.empty()){
-		sendLine(c.fd,"ERR Usage: SETMULTI 0|1");
+	std::array<std::string_view,2> toks;
+	if(splitTokens(rest,toks)==0){
+		sendLine(c,"ERR Usage: SETMULTI 0|1");
 		return;
 	}
-	const std::string &v=toks[0];
-
-	User *u=findUserById(c.uid);
-	if(u==nullptr){
-		sendLine(c.fd,"ERR Internal error");
+	std::string_view v=toks[0];
+	if(v!="0" && v!="1"){
+		sendLine(c,"ERR Value must be 0 or 1");
 		return;
 	}
-	if(v=="0"){
-		u->allowMultiLogin=false;
-	}else if(v=="1"){
-		u->allowMultiLogin=true;
-	}else{
-		sendLine(c.fd,"ERR Value must be 0 or 1");
+
+	std::unique_lock<std::mutex> lock(dbMutex_);
+	auto u=findUserById(c.uid);
+	if(!u){
+		lock.unlock();
+		sendLine(c,"ERR Internal error");
 		return;
 	}
-	saveDbIfPossible();
-	sendLine(c.fd,"OK Multi-login setting updated");
+	db_.users.setAllowMultiLogin(u->uid(),v=="1");
+	hub_.journal().multiLoginChanged(u->uid(),v=="1");
+	awaitDurable(c);
+	lock.unlock();
+	sendLine(c,"OK Multi-login setting updated");
 }
 
 void Server::cmdHistory(ClientConn &c) {
 	if(!c.loggedIn){
-		sendLine(c.fd,"ERR Not logged in");
+		sendLine(c,"ERR Not logged in");
 		return;
 	}
-	User *u=findUserById(c.uid);
-	if(u==nullptr){
-		sendLine(c.fd,"ERR Internal error");
+	std::unique_lock<std::mutex> lock(dbMutex_);
+	auto u=findUserById(c.uid);
+	if(!u){
+		lock.unlock();
+		sendLine(c,"ERR Internal error");
 		return;
 	}
+	const LoginHistory history=db_.users.profile(u->uid()).history;
+	lock.unlock();
+
 	std::ostringstream oss;
-	oss<<"HIST "<<u->history.size();
-	sendLine(c.fd,oss.str());
-	for(const LoginRecord &rec:u->history){
+	oss<<"HIST "<<history.size();
+	sendLine(c,oss.str());
+	for(std::size_t k=0;k<history.size();++k){
 		std::ostringstream ln;
-		ln<<"HIST "<<rec.epochSeconds<<" "<<rec.ip;
-		sendLine(c.fd,ln.str());
+		ln<<"HIST "<<history[k].epochSeconds<<" "<<formatIp(history[k].ip);
+		sendLine(c,ln.str());
 	}
 }
 
-void Server::cmdLogout(ClientConn &c) {
+// Replays the last n archived messages c may read, oldest first, as one
+// buffer so the whole reply goes out in as few sends as possible.
+void Server::cmdScrollback(ClientConn &c,std::string_view rest) {
 	if(!c.loggedIn){
-		sendLine(c.fd,"ERR Not logged in");
+		sendLine(c,"ERR Not logged in");
 		return;
 	}
-	c.loggedIn=false;
-	c.uid=0;
-	c.handle.clear();
-	sendLine(c.fd,"OK Logged out");
+	Archive *archive=hub_.archive();
+	if(archive==nullptr){
+		sendLine(c,"ERR Archive disabled");
+		return;
+	}
+	std::size_t n=DEFAULT_SCROLLBACK;
+	if(!rest.empty()){
+		auto [end,ec]=std::from_chars(rest.data(),rest.data()+rest.size(),n);
+		if(ec!=std::errc() || end!=rest.data()+rest.size()){
+			sendLine(c,"ERR Usage: SCROLLBACK [n]");
+			return;
+		}
+	}
+	n=std::min(n,MAX_SCROLLBACK);
+
+	std::string body;
+	std::string ln;
+	std::size_t count=0;
+	archive->recent(c.uid,n,[&](u64 epochSeconds,std::string_view line){
+		ln.assign("SCROLLBACK ").append(std::to_string(epochSeconds)).append(" ").append(line);
+		if(c.binary){
+			body.append(encodeBinReply(ln));
+		}else{
+			body.append(ln).append("\n");
+		}
+		++count;
+	});
+	const std::string head="SCROLLBACK "+std::to_string(count);
+	std::string out=c.binary?encodeBinReply(head):head+"\n";
+	out.append(body);
+	queueOut(c,std::make_shared<const std::string>(std::move(out)));
+}
+
+// Lists online users from the hub's presence index, never the connections.
+void Server::cmdWho(ClientConn &c) {
+	if(!c.loggedIn){
+		sendLine(c,"ERR Not logged in");
+		return;
+	}
+	std::unique_lock<std::mutex> lock(dbMutex_);
+	std::vector<u64> uids=hub_.onlineUsers();
+	std::vector<std::string> lines;
+	lines.reserve(uids.size());
+	for(u64 uid:uids){
+		auto u=findUserById(uid);
+		if(!u)continue;
+		std::string ln="ONLINE "+db_.users.profile(uid).displayName+" (@";
+		ln.append(u->handle()).append(")");
+		lines.push_back(std::move(ln));
+	}
+	lock.unlock();
+
+	std::ostringstream oss;
+	oss<<"ONLINE "<<lines.size();
+	sendLine(c,oss.str());
+	for(const std::string &ln:lines)sendLine(c,ln);
+}
+
+// Replies in the old protocol, then switches; bytes after this command are
+// parsed in the new one.
+void Server::cmdProto(ClientConn &c,std::string_view rest) {
+	if(rest=="BIN"){
+		sendLine(c,"OK Binary protocol");
+		c.binary=true;
+	}else if(rest=="TEXT"){
+		sendLine(c,"OK Text protocol");
+		c.binary=false;
+	}else{
+		sendLine(c,"ERR Usage: PROTO BIN|TEXT");
+	}
+}
+
+void Server::cmdStats(ClientConn &c) {
+	if(!c.loggedIn){
+		sendLine(c,"ERR Not logged in");
+		return;
+	}
+	HashPoolStats hs=hub_.hashPool().stats();
+	std::ostringstream oss;
+	oss<<"STATS hash_queue="<<hs.depth<<" hash_queue_peak="<<hs.peakDepth
+		<<" hash_done="<<hs.completed<<" hash_rejected="<<hs.rejected
+		<<" hash_wait_avg_us="<<hs.waitAvgUs<<" hash_run_avg_us="<<hs.runAvgUs
+		<<" hash_max_us="<<hs.maxUs<<" hash_upgraded="<<hs.upgraded
+		<<" kdf_mem_kib="<<(std::size_t{1}<<hs.kdf.memLog2)<<" kdf_passes="<<static_cast<unsigned>(hs.kdf.passes);
+	JournalCommitStats js=hub_.commitStats();
+	oss<<" commit_batches="<<js.batches<<" commit_records="<<js.records
+		<<" commit_failed="<<js.failures<<" commit_sync_avg_us="<<js.syncAvgUs
+		<<" commit_sync_max_us="<<js.syncMaxUs;
+	UserStoreStats us;
+	{
+		std::lock_guard<std::mutex> lock(dbMutex_);
+		us=db_.users.stats();
+	}
+	oss<<" users="<<us.users<<" user_table_bytes="<<us.tableBytes<<" profiles_cached="<<us.cached
+		<<" profile_cache_bytes="<<us.cachedBytes<<" profiles_dirty="<<us.dirty
+		<<" profile_hits="<<us.hits<<" profile_misses="<<us.misses
+		<<" profile_evictions="<<us.evictions;
+	SnapshotStats ss=hub_.snapshotStats();
+	oss<<" snap_count="<<ss.count<<" snap_failed="<<ss.failed
+		<<" snap_last_us="<<ss.lastUs<<" snap_last_bytes="<<ss.lastBytes
+		<<" snap_total_bytes="<<ss.totalBytes;
+	if(Archive *a=hub_.archive()){
+		ArchiveStats as=a->stats();
+		oss<<" archive_messages="<<as.messages<<" archive_written="<<as.written
+			<<" archive_failed="<<as.failed<<" archive_segments="<<as.segments
+			<<" archive_bytes="<<as.bytes;
+	}
+	if(OfflineQueue *offline=hub_.offline()){
+		OfflineQueueStats os;
+		{
+			std::lock_guard<std::mutex> lock(dbMutex_);
+			os=offline->stats();
+		}
+		oss<<" offline_users="<<os.users<<" offline_messages="<<os.messages
+			<<" offline_bytes="<<os.bytes<<" offline_log_bytes="<<os.logBytes
+			<<" offline_queued="<<os.queued<<" offline_delivered="<<os.delivered
+			<<" offline_rejected="<<os.rejected;
+	}
+	sendLine(c,oss.str());
 }
 
-void Server::saveDbIfPossible() {
-	if(!dbFile_.save(db_)){
-		std::cerr<<"Warning: failed to save DB\n";
+void Server::cmdLogout(ClientConn &c) {
+	if(!c.loggedIn){
+		sendLine(c,"ERR Not logged in");
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(dbMutex_);
+		sessionEnd(c);
 	}
+	sendLine(c,"OK Logged out");
 }
 
 } // namespace qchat
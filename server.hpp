@@ -2,8 +2,20 @@
 #define QCHAT_SERVER_HPP
 
 #include "chat_common.hpp"
-
+#include "event_loop.hpp"
+#include "hash_pool.hpp"
+#include "hub.hpp"
+#include "line_buffer.hpp"
+#include "mailbox.hpp"
+#include "out_queue.hpp"
+#include "proto_bin.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -11,60 +23,158 @@ namespace qchat {
 
 struct ClientConn {
 	int fd{-1};
-	std::string recvBuf;
+	u64 id{0};               // unique per shard; fds get reused
+	LineBuffer in;
+	bool binary{false};      // switched to the framed protocol by PROTO BIN
+	FrameBuffer frames;
 	bool loggedIn{false};
 	u64 uid{0};
 	std::string handle;
-	std::string peerIp;
+	IpAddr peerIp{};
+
+	OutQueue out;
+	bool closing{false};     // scheduled for closeClient after this dispatch
+	bool dropping{false};    // over the high watermark, output discarded
+	std::size_t dropped{0};  // lines discarded while dropping
+
+	// A password hash is running on the HashPool. Input is parked in held
+	// and replayed once it finishes, so pipelined commands keep their order.
+	bool authPending{false};
+	std::string held;
+
+	// A reply must not go out before journal record syncSeq is durable.
+	// Until then all output to the connection waits in unsynced, in order.
+	u64 syncSeq{0};
+	std::vector<OutBuf> unsynced;
+};
+
+// What to do with a client whose unsent output reaches the high watermark.
+enum class SlowConsumerPolicy {
+	Drop,       // discard its output until the queue falls to the low watermark
+	Disconnect  // close the connection
 };
 
-class Server {
+bool parseSlowConsumerPolicy(const std::string &name,SlowConsumerPolicy &out);
+
+struct ServerOptions {
+	IoBackend backend{IoBackend::Epoll};
+	std::size_t lowWatermark{64*1024};
+	std::size_t highWatermark{1024*1024};
+	SlowConsumerPolicy slowPolicy{SlowConsumerPolicy::Drop};
+	std::size_t zeroCopyMin{0}; // MSG_ZEROCOPY for sends this large; 0 = off
+	std::size_t maxLine{LineBuffer::DEFAULT_MAX_LINE};
+};
+
+// One reactor shard. Each shard runs on its own thread with its own
+// SO_REUSEPORT listen socket and its own share of the connections; users,
+// presence and cross-shard delivery go through the shared Hub.
+class Server : private EventLoop::Handler {
 public:
-	Server(unsigned short port,const std::string &dbPath);
-	~Server();
+	Server(Hub &hub,std::size_t shardId,unsigned short port,const ServerOptions &opts);
+	~Server() override;
 
 	bool init();
 	void run();
 
+	// Thread-safe: queues msg for this shard's reactor and wakes it.
+	void post(ShardMsg msg);
+	// Thread-safe: highest journal seq a connection here is waiting on.
+	u64 awaitedSeq() const {return awaitedSeq_.load();}
+
 private:
+	Hub &hub_;
+	std::size_t shard_;
 	unsigned short port_;
-	std::string dbPath_;
+	ServerOptions opts_;
 	int listenFd_;
+	int wakeFd_;
 	bool running_;
+	std::unique_ptr<EventLoop> loop_;
 
-	DbState db_;
-	DbFile dbFile_;
+	DbState &db_;
+	std::mutex &dbMutex_;
+
+	Mailbox<ShardMsg> inbox_;
+	std::atomic<bool> wakePending_{false};
 
 	std::unordered_map<int,ClientConn> clients_;
+	u64 nextConnId_{1};
+	std::vector<int> pendingClose_;
+	// uid -> this shard's logged-in connections of that user
+	std::unordered_map<u64,std::vector<int>> presence_;
+	// connections with syncSeq set, possibly stale
+	std::vector<int> syncWaiters_;
+	std::atomic<u64> awaitedSeq_{0};
 
 	bool setupListenSocket();
+	bool setupEventLoop();
 	void mainLoop();
-	void handleNewConnection();
-	void handleClientReadable(int fd);
 	void closeClient(int fd);
+	void closeLater(ClientConn &c);
+	void closePending();
+
+	// EventLoop::Handler
+	void onAccept(int fd,const sockaddr_in &addr) override;
+	void onData(int fd,const char *data,std::size_t len) override;
+	void onHangup(int fd) override;
+	void onNotify(int fd) override;
+
+	void handleShardMsg(const ShardMsg &msg);
+	void feedInput(ClientConn &c,const char *data,std::size_t len);
+
+	std::shared_ptr<HashJob> newHashJob(const ClientConn &c,HashJob::Op op);
+	void submitHash(ClientConn &c,std::shared_ptr<HashJob> job);
+	void onHashDone(const HashJob &job);
 
-	void broadcast(const std::string &msg,int exceptFd);
+	// Keep hub_ and presence_ in step. Callers must hold dbMutex_.
+	void sessionStart(ClientConn &c,const UserRow &u);
+	void sessionEnd(ClientConn &c);
+
+	WireLine broadcast(std::string msg,int exceptFd);
+	void broadcastLocal(const WireLine &line,int exceptFd);
+	bool deliverLocal(u64 uid,const WireLine &line);
 	void sendLine(int fd,const std::string &line);
-	static bool sendAll(int fd,const char *data,std::size_t len);
-
-	void processLine(ClientConn &c,const std::string &line);
-
-	void cmdSignup(ClientConn &c,const std::string &rest);
-	void cmdLogin(ClientConn &c,const std::string &rest);
-	void cmdMsgAll(ClientConn &c,const std::string &rest);
-	void cmdMsgTo(ClientConn &c,const std::string &rest);
-	void cmdChPass(ClientConn &c,const std::string &rest);
-	void cmdChHandle(ClientConn &c,const std::string &rest);
-	void cmdChName(ClientConn &c,const std::string &rest);
-	void cmdSetMulti(ClientConn &c,const std::string &rest);
+	void sendLine(ClientConn &c,const std::string &line);
+	void queueOut(ClientConn &c,OutBuf buf);
+	// Holds c's output until the last journal record is durable. Caller must
+	// hold dbMutex_.
+	void awaitDurable(ClientConn &c);
+	void onDurable(u64 seq);
+	void releaseUnsynced(ClientConn &c);
+
+	void processLine(ClientConn &c,std::string_view line);
+	void processFrame(ClientConn &c,BinOp op,std::string_view payload);
+
+	void cmdSignup(ClientConn &c,std::string_view rest);
+	void cmdLogin(ClientConn &c,std::string_view rest);
+	void cmdMsgAll(ClientConn &c,std::string_view rest);
+	void cmdMsgTo(ClientConn &c,std::string_view rest);
+	void cmdChPass(ClientConn &c,std::string_view rest);
+	void cmdChHandle(ClientConn &c,std::string_view rest);
+	void cmdChName(ClientConn &c,std::string_view rest);
+	void cmdSetMulti(ClientConn &c,std::string_view rest);
 	void cmdHistory(ClientConn &c);
+	void cmdScrollback(ClientConn &c,std::string_view rest);
+	void cmdWho(ClientConn &c);
 	void cmdLogout(ClientConn &c);
-
-	User *findUserByHandle(const std::string &handle);
-	User *findUserById(u64 uid);
-	void recordLogin(User &u,const std::string &ip);
-
-	void saveDbIfPossible();
+	void cmdProto(ClientConn &c,std::string_view rest);
+	void cmdStats(ClientConn &c);
+
+	// Shared by the text commands and their binary frames.
+	void signup(ClientConn &c,std::string_view handle,std::string_view pw,std::string_view display);
+	void login(ClientConn &c,std::string_view handle,std::string_view pw);
+	void msgTo(ClientConn &c,std::string_view dstHandle,std::string_view text);
+	void queueOffline(ClientConn &c,u64 dst,std::string line,std::unique_lock<std::mutex> &lock);
+
+	// Second halves of the hashing commands, run when the job comes back.
+	void finishSignup(ClientConn &c,const HashJob &job);
+	void finishLogin(ClientConn &c,const HashJob &job);
+	void finishChPass(ClientConn &c,const HashJob &job);
+
+	// Callers must hold dbMutex_.
+	std::optional<UserRow> findUserByHandle(std::string_view handle);
+	std::optional<UserRow> findUserById(u64 uid);
+	void recordLogin(ClientConn &c,const UserRow &u);
 };
 
 } // namespace qchat
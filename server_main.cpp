@@ -1,21 +1,166 @@
 #include "server.hpp"
 
 #include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+void usage(const char *argv0) {
+	std::cerr<<"Usage: "<<argv0<<" [port] [db_path] [epoll|uring] [shards] [options]\n"
+		<<"  --low-water=BYTES    resume output to a slow client below this (default 65536)\n"
+		<<"  --high-water=BYTES   slow-consumer limit for unsent output (default 1048576)\n"
+		<<"  --slow=drop|disconnect\n"
+		<<"                       what to do at the high watermark (default drop)\n"
+		<<"  --zerocopy=BYTES     use MSG_ZEROCOPY for sends of at least BYTES (epoll only,\n"
+		<<"                       default 0 = off)\n"
+		<<"  --max-line=BYTES     longest accepted command line (default 16384)\n"
+		<<"  --hash-threads=N     password hashing worker threads (default 2)\n"
+		<<"  --hash-queue=N       hashing jobs allowed to wait (default 1024)\n"
+		<<"  --kdf-budget=MS      time one password check may take; the KDF's memory\n"
+		<<"                       and passes are measured to fit at startup (default 50)\n"
+		<<"  --snapshot-interval=SECONDS\n"
+		<<"                       background snapshot period if the journal is not\n"
+		<<"                       empty (default 300, 0 = off)\n"
+		<<"  --snapshot-journal=BYTES\n"
+		<<"                       also snapshot once the journal reaches BYTES\n"
+		<<"                       (default 16777216, 0 = off)\n"
+		<<"  --commit-window=USEC|off\n"
+		<<"                       group journal writes into one fdatasync per window;\n"
+		<<"                       replies wait until durable (default 2000, 0 = sync\n"
+		<<"                       as soon as the last sync is done, off = write\n"
+		<<"                       through without syncing)\n"
+		<<"  --commit-batch=N     sync early once N records are waiting (default 256)\n"
+		<<"  --profile-cache=BYTES\n"
+		<<"                       memory for display names and login history of\n"
+		<<"                       recently used accounts (default 67108864)\n"
+		<<"  --archive-dir=PATH   where chat history is kept (default <db_path>.archive)\n"
+		<<"  --archive-segment=BYTES\n"
+		<<"                       size of each chat history file (default 67108864,\n"
+		<<"                       0 = keep no history)\n"
+		<<"  --archive-keep=N     delete the oldest chat history files beyond the\n"
+		<<"                       newest N (default 0 = keep all)\n"
+		<<"  --offline-cap=BYTES  private messages kept for each offline user\n"
+		<<"                       (default 65536, 0 = refuse messages to offline users)\n";
+}
+
+bool parseSize(const std::string &v,std::size_t &out) {
+	try{
+		std::size_t pos=0;
+		unsigned long long n=std::stoull(v,&pos);
+		if(pos!=v.size())return false;
+		out=static_cast<std::size_t>(n);
+		return true;
+	}catch(const std::exception&){
+		return false;
+	}
+}
+
+} // namespace
 
 int main(int argc,char **argv) {
 	unsigned short port=5555;
 	std::string dbPath="qchat.db";
-	if(argc>=2){
-		port=static_cast<unsigned short>(std::stoi(argv[1]));
+	std::size_t shards=1;
+	qchat::ServerOptions opts;
+	qchat::HubOptions hubOpts;
+
+	std::vector<std::string> positional;
+	for(int i=1;i<argc;++i){
+		std::string arg=argv[i];
+		if(arg.rfind("--",0)!=0){
+			positional.push_back(arg);
+			continue;
+		}
+		std::size_t eq=arg.find('=');
+		std::string key=arg.substr(0,eq);
+		std::string val=(eq==std::string::npos)?std::string():arg.substr(eq+1);
+		bool ok=false;
+		if(key=="--low-water"){
+			ok=parseSize(val,opts.lowWatermark);
+		}else if(key=="--high-water"){
+			ok=parseSize(val,opts.highWatermark);
+		}else if(key=="--slow"){
+			ok=qchat::parseSlowConsumerPolicy(val,opts.slowPolicy);
+		}else if(key=="--zerocopy"){
+			ok=parseSize(val,opts.zeroCopyMin);
+		}else if(key=="--max-line"){
+			ok=parseSize(val,opts.maxLine) && opts.maxLine>0;
+		}else if(key=="--hash-threads"){
+			ok=parseSize(val,hubOpts.hashThreads) && hubOpts.hashThreads>0;
+		}else if(key=="--hash-queue"){
+			ok=parseSize(val,hubOpts.hashQueue) && hubOpts.hashQueue>0;
+		}else if(key=="--kdf-budget"){
+			ok=parseSize(val,hubOpts.kdfBudgetMs);
+		}else if(key=="--snapshot-interval"){
+			ok=parseSize(val,hubOpts.snapshotInterval);
+		}else if(key=="--snapshot-journal"){
+			ok=parseSize(val,hubOpts.snapshotJournalBytes);
+		}else if(key=="--commit-window"){
+			hubOpts.groupCommit=(val!="off");
+			ok=!hubOpts.groupCommit || parseSize(val,hubOpts.commitWindowUs);
+		}else if(key=="--commit-batch"){
+			ok=parseSize(val,hubOpts.commitBatch) && hubOpts.commitBatch>0;
+		}else if(key=="--profile-cache"){
+			ok=parseSize(val,hubOpts.profileCacheBytes);
+		}else if(key=="--archive-dir"){
+			hubOpts.archiveDir=val;
+			ok=!val.empty();
+		}else if(key=="--archive-segment"){
+			ok=parseSize(val,hubOpts.archiveSegmentBytes);
+		}else if(key=="--archive-keep"){
+			ok=parseSize(val,hubOpts.archiveKeepSegments);
+		}else if(key=="--offline-cap"){
+			ok=parseSize(val,hubOpts.offlineCapBytes);
+		}
+		if(!ok){
+			std::cerr<<"Bad option '"<<arg<<"'\n";
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(positional.size()>=1){
+		port=static_cast<unsigned short>(std::stoi(positional[0]));
 	}
-	if(argc>=3){
-		dbPath=argv[2];
+	if(positional.size()>=2){
+		dbPath=positional[1];
 	}
-	qchat::Server srv(port,dbPath);
-	if(!srv.init()){
+	if(positional.size()>=3 && !qchat::parseIoBackend(positional[2],opts.backend)){
+		std::cerr<<"Unknown I/O backend '"<<positional[2]<<"' (expected epoll or uring)\n";
+		return 1;
+	}
+	if(positional.size()>=4){
+		int n=std::stoi(positional[3]);
+		if(n<=0)n=static_cast<int>(std::thread::hardware_concurrency());
+		shards=static_cast<std::size_t>(n>0?n:1);
+	}
+	if(opts.lowWatermark>opts.highWatermark){
+		std::cerr<<"--low-water must not exceed --high-water\n";
+		return 1;
+	}
+
+	qchat::Hub hub(dbPath,hubOpts);
+	if(!hub.init()){
 		std::cerr<<"Failed to initialize server\n";
 		return 1;
 	}
-	srv.run();
+	std::vector<std::unique_ptr<qchat::Server>> servers;
+	for(std::size_t i=0;i<shards;++i){
+		servers.push_back(std::make_unique<qchat::Server>(hub,i,port,opts));
+		hub.addShard(servers.back().get());
+	}
+	for(auto &srv:servers){
+		if(!srv->init()){
+			std::cerr<<"Failed to initialize server\n";
+			return 1;
+		}
+	}
+	std::vector<std::jthread> threads;
+	for(std::size_t i=1;i<servers.size();++i){
+		qchat::Server *srv=servers[i].get();
+		threads.emplace_back([srv](){srv->run();});
+	}
+	servers[0]->run();
 	return 0;
 }
@@ -35,6 +35,9 @@ static constexpr const char *FG_LOCAL="\x1b[38;2;255;180;128m";
 static constexpr const char *BG_INPUT="\x1b[48;2;30;30;30m";
 static constexpr const char *BG_MENU="\x1b[48;2;0;70;140m";
 
+// messages replayed right after logging in
+static constexpr int JOIN_SCROLLBACK=20;
+
 std::string colorizeMessage(const std::string &line) {
 	if(line.size()>=4u && line.compare(0,4,"SYS ")==0){
 		return std::string(FG_SYS)+line+ESC_RESET;
@@ -51,9 +54,18 @@ std::string colorizeMessage(const std::string &line) {
 	if(line.size()>=7u && line.compare(0,7,"PRIVATE")==0){
 		return std::string(FG_MSG)+line+ESC_RESET;
 	}
+	if(line.size()>=7u && line.compare(0,7,"OFFLINE")==0){
+		return std::string(FG_MSG)+line+ESC_RESET;
+	}
 	if(line.size()>=4u && line.compare(0,4,"HIST")==0){
 		return std::string(FG_HIST)+line+ESC_RESET;
 	}
+	if(line.size()>=6u && line.compare(0,6,"ONLINE")==0){
+		return std::string(FG_HIST)+line+ESC_RESET;
+	}
+	if(line.size()>=10u && line.compare(0,10,"SCROLLBACK")==0){
+		return std::string(FG_HIST)+line+ESC_RESET;
+	}
 	if(line.size()>=6u && line.compare(0,6,"LOCAL:")==0){
 		return std::string(FG_LOCAL)+line+ESC_RESET;
 	}
@@ -156,13 +168,19 @@ void Tui::handleSigInt(int sig) {
 }
 
 void Tui::drainServerMessages() {
-	std::lock_guard<std::mutex> lock(stateMutex_);
-	if(pendingFromServer_.empty())return;
-	for(const std::string &s:pendingFromServer_){
-		messages_.push_back(s);
+	bool joined=false;
+	{
+		std::lock_guard<std::mutex> lock(stateMutex_);
+		if(pendingFromServer_.empty())return;
+		for(const std::string &s:pendingFromServer_){
+			if(s.rfind("OK Login successful",0)==0)joined=true;
+			messages_.push_back(s);
+		}
+		pendingFromServer_.clear();
+		if(scrollOffset_<0)scrollOffset_=0;
 	}
-	pendingFromServer_.clear();
-	if(scrollOffset_<0)scrollOffset_=0;
+	// show what was said before we joined
+	if(joined && client_!=nullptr)client_->sendLine("SCROLLBACK "+std::to_string(JOIN_SCROLLBACK));
 }
 
 void Tui::addLocalMessage(const std::string &msg) {
@@ -239,7 +257,7 @@ void Tui::render() {
 	std::cout<<ESC_RESET<<"\n";
 
 	// menu bar (bottom line)
-	std::string menu=" /signup /login /all /to /chpass /chhandle /chname /setmulti /history /logout /quit  ↑/↓ scroll";
+	std::string menu=" /signup /login /all /to /chpass /chhandle /chname /setmulti /history /scrollback /who /logout /quit  ↑/↓ scroll";
 	if(static_cast<int>(menu.size())>termCols_){
 		menu=menu.substr(0,static_cast<std::size_t>(termCols_));
 	}
@@ -394,6 +412,18 @@ void Tui::handleCommand(const std::string &cmdLine) {
 		}
 		return;
 	}
+	if(cmd=="scrollback" || cmd=="SCROLLBACK"){
+		if(client_!=nullptr){
+			client_->sendLine(toks.size()>=2u?"SCROLLBACK "+toks[1]:std::string("SCROLLBACK"));
+		}
+		return;
+	}
+	if(cmd=="who" || cmd=="WHO" || cmd=="online" || cmd=="ONLINE"){
+		if(client_!=nullptr){
+			client_->sendLine("WHO");
+		}
+		return;
+	}
 	if(cmd=="logout" || cmd=="LOGOUT"){
 		if(client_!=nullptr){
 			client_->sendLine("LOGOUT");
@@ -416,7 +446,7 @@ void Tui::handleCommand(const std::string &cmdLine) {
 		return;
 	}
 	if(cmd=="help"){
-		addLocalMessage("Commands: /signup /login /all /to /chpass /chhandle /chname /setmulti /history /logout /quit");
+		addLocalMessage("Commands: /signup /login /all /to /chpass /chhandle /chname /setmulti /history /scrollback /who /logout /quit");
 		return;
 	}
 
@@ -0,0 +1,632 @@
+#include "event_loop.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+namespace qchat {
+
+namespace {
+
+int sysSetup(unsigned entries,io_uring_params *p) {
+	return static_cast<int>(::syscall(__NR_io_uring_setup,entries,p));
+}
+
+int sysEnter(int fd,unsigned toSubmit,unsigned minComplete,unsigned flags,const void *arg,std::size_t argSz) {
+	return static_cast<int>(::syscall(__NR_io_uring_enter,fd,toSubmit,minComplete,flags,arg,argSz));
+}
+
+int sysRegister(int fd,unsigned op,void *arg,unsigned nrArgs) {
+	return static_cast<int>(::syscall(__NR_io_uring_register,fd,op,arg,nrArgs));
+}
+
+template<class T>
+T loadAcquire(T *p) {
+	return std::atomic_ref<T>(*p).load(std::memory_order_acquire);
+}
+
+template<class T>
+void storeRelease(T *p,T v) {
+	std::atomic_ref<T>(*p).store(v,std::memory_order_release);
+}
+
+// Multishot recv landed in 6.0; multishot accept and buffer rings in 5.19.
+bool kernelAtLeast(int major,int minor) {
+	utsname u{};
+	if(::uname(&u)!=0)return false;
+	int ma=0;
+	int mi=0;
+	if(std::sscanf(u.release,"%d.%d",&ma,&mi)!=2)return false;
+	return ma>major || (ma==major && mi>=minor);
+}
+
+class UringLoop final : public EventLoop {
+public:
+	explicit UringLoop(Handler &handler):handler_(handler) {}
+
+	~UringLoop() override {
+		// tear the ring down first so the kernel drops its references
+		if(ringFd_>=0)::close(ringFd_);
+		if(bufRing_!=nullptr)::munmap(bufRing_,bufRingSz_);
+		if(sqes_!=nullptr)::munmap(sqes_,sqesSz_);
+		if(cqPtr_!=nullptr && cqPtr_!=sqPtr_)::munmap(cqPtr_,cqSz_);
+		if(sqPtr_!=nullptr)::munmap(sqPtr_,sqSz_);
+		for(auto &kv:conns_)delete kv.second;
+		for(Conn *c:zombies_)delete c;
+	}
+
+	const char *name() const override {return "io_uring";}
+
+	// Sets up the ring and buffer pool without touching any socket, so the
+	// caller can fall back to epoll if the kernel refuses.
+	bool setup() {
+		if(!kernelAtLeast(6,0))return false;
+		io_uring_params p{};
+		p.flags=IORING_SETUP_CQSIZE|IORING_SETUP_SUBMIT_ALL|IORING_SETUP_COOP_TASKRUN;
+		p.cq_entries=RING_ENTRIES*4;
+		ringFd_=sysSetup(RING_ENTRIES,&p);
+		if(ringFd_<0){
+			p=io_uring_params{};
+			p.flags=IORING_SETUP_CQSIZE;
+			p.cq_entries=RING_ENTRIES*4;
+			ringFd_=sysSetup(RING_ENTRIES,&p);
+		}
+		if(ringFd_<0)return false;
+		if(!mapRings(p))return false;
+		if(!probeOps())return false;
+		return setupBuffers();
+	}
+
+	bool init(int listenFd) override {
+		listenFd_=listenFd;
+		armAccept();
+		return submit(0,0)>=0;
+	}
+
+	bool addNotifier(int fd) override {
+		notifiers_.push_back(std::make_unique<Notifier>());
+		notifiers_.back()->fd=fd;
+		armNotifier(notifiers_.back().get());
+		return true;
+	}
+
+	bool addClient(int fd,OutQueue &out) override {
+		Conn *c=new Conn();
+		c->fd=fd;
+		c->out=&out;
+		auto res=conns_.emplace(fd,c);
+		if(!res.second){
+			delete c;
+			return false;
+		}
+		armRecv(c);
+		return true;
+	}
+
+	void removeClient(int fd) override {
+		auto it=conns_.find(fd);
+		if(it==conns_.end())return;
+		Conn *c=it->second;
+		conns_.erase(it);
+		c->dead=true;
+		c->out=nullptr;
+		if(c->recvArmed)cancel(c,TAG_RECV);
+		if(c->sending)cancel(c,TAG_SEND);
+		// the caller closes fd right after us; get the cancels in first
+		submit(0,0);
+		zombies_.push_back(c);
+	}
+
+	void flush(int fd) override {
+		auto it=conns_.find(fd);
+		if(it==conns_.end())return;
+		scheduleFlush(it->second);
+	}
+
+	// IORING_OP_SEND_ZC would need its own notification CQE handling; the
+	// copying SENDMSG is kept for now.
+	void setZeroCopy(std::size_t) override {}
+
+	bool poll(int timeoutMs) override {
+		flushSends();
+		io_uring_getevents_arg arg{};
+		__kernel_timespec ts{};
+		ts.tv_sec=timeoutMs/1000;
+		ts.tv_nsec=static_cast<long long>(timeoutMs%1000)*1000000LL;
+		arg.ts=reinterpret_cast<std::uint64_t>(&ts);
+		int ret=submit(1,&arg);
+		if(ret<0 && ret!=-ETIME && ret!=-EINTR && ret!=-EBUSY){
+			errno=-ret;
+			std::perror("io_uring_enter");
+			return false;
+		}
+		drainCq();
+		flushSends();
+		reapZombies();
+		return true;
+	}
+
+private:
+	static constexpr unsigned RING_ENTRIES=1024;
+	static constexpr unsigned BUF_COUNT=512;   // power of two
+	static constexpr unsigned BUF_SIZE=4096;
+	static constexpr unsigned BUF_GROUP=0;
+	static constexpr unsigned MAX_IOV=64;      // buffers per SENDMSG
+	static constexpr unsigned CQE_BUDGET=16;   // completions per poll()
+
+	static constexpr std::uint64_t TAG_ACCEPT=1;
+	static constexpr std::uint64_t TAG_RECV=2;
+	static constexpr std::uint64_t TAG_SEND=3;
+	static constexpr std::uint64_t TAG_CANCEL=4;
+	static constexpr std::uint64_t TAG_PROVIDE=5;
+	static constexpr std::uint64_t TAG_NOTIFY=6;
+	static constexpr std::uint64_t TAG_MASK=7;
+
+	struct alignas(8) Conn {
+		int fd{-1};
+		bool dead{false};
+		bool recvArmed{false};
+		bool pendingFlush{false};
+		unsigned inflight{0};
+		OutQueue *out{nullptr};
+		// the SENDMSG in flight; pins keep its buffers alive even if the
+		// connection is closed before the kernel is done with them
+		bool sending{false};
+		msghdr msg{};
+		iovec iov[MAX_IOV];
+		OutBuf pins[MAX_IOV];
+	};
+
+	struct alignas(8) Notifier {
+		int fd{-1};
+		std::uint64_t counter{0};
+	};
+
+	Handler &handler_;
+	int listenFd_{-1};
+	int ringFd_{-1};
+
+	void *sqPtr_{nullptr};
+	std::size_t sqSz_{0};
+	void *cqPtr_{nullptr};
+	std::size_t cqSz_{0};
+	io_uring_sqe *sqes_{nullptr};
+	std::size_t sqesSz_{0};
+
+	unsigned *sqHead_{nullptr};
+	unsigned *sqTail_{nullptr};
+	unsigned sqMask_{0};
+	unsigned sqEntries_{0};
+	unsigned *sqArray_{nullptr};
+	unsigned sqLocalTail_{0};
+	unsigned toSubmit_{0};
+
+	unsigned *cqHead_{nullptr};
+	unsigned *cqTail_{nullptr};
+	unsigned cqMask_{0};
+	io_uring_cqe *cqes_{nullptr};
+
+	io_uring_buf_ring *bufRing_{nullptr};
+	std::size_t bufRingSz_{0};
+	std::vector<char> bufPool_;
+	unsigned short bufTail_{0};
+
+	std::unordered_map<int,Conn*> conns_;
+	std::vector<Conn*> zombies_;    // removed, waiting for in-flight ops
+	std::vector<Conn*> flushList_;
+	std::vector<std::unique_ptr<Notifier>> notifiers_;
+
+	bool mapRings(const io_uring_params &p) {
+		sqSz_=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+		cqSz_=p.cq_off.cqes+p.cq_entries*sizeof(io_uring_cqe);
+		const bool single=(p.features&IORING_FEAT_SINGLE_MMAP)!=0;
+		if(single){
+			if(cqSz_>sqSz_)sqSz_=cqSz_;
+			cqSz_=sqSz_;
+		}
+		sqPtr_=::mmap(nullptr,sqSz_,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringFd_,IORING_OFF_SQ_RING);
+		if(sqPtr_==MAP_FAILED){
+			sqPtr_=nullptr;
+			return false;
+		}
+		if(single){
+			cqPtr_=sqPtr_;
+		}else{
+			cqPtr_=::mmap(nullptr,cqSz_,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringFd_,IORING_OFF_CQ_RING);
+			if(cqPtr_==MAP_FAILED){
+				cqPtr_=nullptr;
+				return false;
+			}
+		}
+		sqesSz_=p.sq_entries*sizeof(io_uring_sqe);
+		void *sq=::mmap(nullptr,sqesSz_,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ringFd_,IORING_OFF_SQES);
+		if(sq==MAP_FAILED)return false;
+		sqes_=static_cast<io_uring_sqe*>(sq);
+
+		char *sqb=static_cast<char*>(sqPtr_);
+		sqHead_=reinterpret_cast<unsigned*>(sqb+p.sq_off.head);
+		sqTail_=reinterpret_cast<unsigned*>(sqb+p.sq_off.tail);
+		sqMask_=*reinterpret_cast<unsigned*>(sqb+p.sq_off.ring_mask);
+		sqEntries_=*reinterpret_cast<unsigned*>(sqb+p.sq_off.ring_entries);
+		sqArray_=reinterpret_cast<unsigned*>(sqb+p.sq_off.array);
+		sqLocalTail_=*sqTail_;
+
+		char *cqb=static_cast<char*>(cqPtr_);
+		cqHead_=reinterpret_cast<unsigned*>(cqb+p.cq_off.head);
+		cqTail_=reinterpret_cast<unsigned*>(cqb+p.cq_off.tail);
+		cqMask_=*reinterpret_cast<unsigned*>(cqb+p.cq_off.ring_mask);
+		cqes_=reinterpret_cast<io_uring_cqe*>(cqb+p.cq_off.cqes);
+		return true;
+	}
+
+	bool probeOps() {
+		const std::size_t sz=sizeof(io_uring_probe)+256*sizeof(io_uring_probe_op);
+		std::vector<unsigned char> mem(sz,0);
+		auto *probe=reinterpret_cast<io_uring_probe*>(mem.data());
+		if(sysRegister(ringFd_,IORING_REGISTER_PROBE,probe,256)<0)return false;
+		const unsigned needed[]={
+			IORING_OP_ACCEPT,IORING_OP_RECV,IORING_OP_SENDMSG,
+			IORING_OP_ASYNC_CANCEL,IORING_OP_PROVIDE_BUFFERS
+		};
+		for(unsigned op:needed){
+			if(op>probe->last_op)return false;
+			if((probe->ops[op].flags&IO_URING_OP_SUPPORTED)==0)return false;
+		}
+		return true;
+	}
+
+	// Prefers a registered buffer ring; kernels (or VMs) where the ring is
+	// accepted but never yields buffers get the older PROVIDE_BUFFERS path.
+	bool setupBuffers() {
+		bufPool_.resize(static_cast<std::size_t>(BUF_COUNT)*BUF_SIZE);
+		if(setupBufRing() && bufRingWorks())return true;
+		if(bufRing_!=nullptr){
+			io_uring_buf_reg reg{};
+			reg.bgid=BUF_GROUP;
+			sysRegister(ringFd_,IORING_UNREGISTER_PBUF_RING,&reg,1);
+			::munmap(bufRing_,bufRingSz_);
+			bufRing_=nullptr;
+		}
+		io_uring_sqe *sqe=getSqe();
+		if(sqe==nullptr)return false;
+		sqe->opcode=IORING_OP_PROVIDE_BUFFERS;
+		sqe->fd=static_cast<int>(BUF_COUNT);
+		sqe->addr=reinterpret_cast<std::uint64_t>(bufPool_.data());
+		sqe->len=BUF_SIZE;
+		sqe->off=0;
+		sqe->buf_group=BUF_GROUP;
+		io_uring_cqe cqe{};
+		return waitOne(cqe) && cqe.res>=0;
+	}
+
+	bool setupBufRing() {
+		bufRingSz_=BUF_COUNT*sizeof(io_uring_buf);
+		void *mem=::mmap(nullptr,bufRingSz_,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+		if(mem==MAP_FAILED)return false;
+		bufRing_=static_cast<io_uring_buf_ring*>(mem);
+		io_uring_buf_reg reg{};
+		reg.ring_addr=reinterpret_cast<std::uint64_t>(bufRing_);
+		reg.ring_entries=BUF_COUNT;
+		reg.bgid=BUF_GROUP;
+		if(sysRegister(ringFd_,IORING_REGISTER_PBUF_RING,&reg,1)<0){
+			::munmap(bufRing_,bufRingSz_);
+			bufRing_=nullptr;
+			return false;
+		}
+		for(unsigned bid=0;bid<BUF_COUNT;++bid)provideBuffer(static_cast<unsigned short>(bid));
+		storeRelease(&bufRing_->tail,bufTail_);
+		return true;
+	}
+
+	bool bufRingWorks() {
+		int sv[2];
+		if(::socketpair(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0,sv)<0)return false;
+		bool ok=false;
+		if(::write(sv[1],"x",1)==1){
+			io_uring_sqe *sqe=getSqe();
+			if(sqe!=nullptr){
+				sqe->opcode=IORING_OP_RECV;
+				sqe->fd=sv[0];
+				sqe->flags=IOSQE_BUFFER_SELECT;
+				sqe->buf_group=BUF_GROUP;
+				io_uring_cqe cqe{};
+				if(waitOne(cqe) && cqe.res==1 && (cqe.flags&IORING_CQE_F_BUFFER)){
+					recycleBuffer(static_cast<unsigned short>(cqe.flags>>IORING_CQE_BUFFER_SHIFT));
+					ok=true;
+				}
+			}
+		}
+		::close(sv[0]);
+		::close(sv[1]);
+		return ok;
+	}
+
+	// Only used during setup, before anything else is in flight.
+	bool waitOne(io_uring_cqe &out) {
+		if(submit(1,nullptr)<0)return false;
+		unsigned head=*cqHead_;
+		if(head==loadAcquire(cqTail_))return false;
+		out=cqes_[head&cqMask_];
+		storeRelease(cqHead_,head+1);
+		return true;
+	}
+
+	void provideBuffer(unsigned short bid) {
+		// Not bufRing_->bufs: in C++ the header's flexible-array wrapper puts
+		// it 8 bytes past where the kernel reads entries.
+		io_uring_buf &b=reinterpret_cast<io_uring_buf*>(bufRing_)[bufTail_&(BUF_COUNT-1)];
+		b.addr=reinterpret_cast<std::uint64_t>(bufPool_.data()+static_cast<std::size_t>(bid)*BUF_SIZE);
+		b.len=BUF_SIZE;
+		b.bid=bid;
+		++bufTail_;
+	}
+
+	void recycleBuffer(unsigned short bid) {
+		if(bufRing_!=nullptr){
+			provideBuffer(bid);
+			storeRelease(&bufRing_->tail,bufTail_);
+			return;
+		}
+		io_uring_sqe *sqe=getSqe();
+		if(sqe==nullptr)return;
+		sqe->opcode=IORING_OP_PROVIDE_BUFFERS;
+		sqe->fd=1;
+		sqe->addr=reinterpret_cast<std::uint64_t>(bufPool_.data()+static_cast<std::size_t>(bid)*BUF_SIZE);
+		sqe->len=BUF_SIZE;
+		sqe->off=bid;
+		sqe->buf_group=BUF_GROUP;
+		sqe->user_data=TAG_PROVIDE;
+	}
+
+	io_uring_sqe *getSqe() {
+		unsigned head=loadAcquire(sqHead_);
+		if(sqLocalTail_-head>=sqEntries_){
+			submit(0,0);
+			head=loadAcquire(sqHead_);
+			if(sqLocalTail_-head>=sqEntries_)return nullptr;
+		}
+		unsigned idx=sqLocalTail_&sqMask_;
+		io_uring_sqe *sqe=&sqes_[idx];
+		std::memset(sqe,0,sizeof(*sqe));
+		sqArray_[idx]=idx;
+		++sqLocalTail_;
+		++toSubmit_;
+		return sqe;
+	}
+
+	// Publishes queued SQEs and optionally waits for completions.
+	int submit(unsigned minComplete,const io_uring_getevents_arg *arg) {
+		storeRelease(sqTail_,sqLocalTail_);
+		unsigned flags=0;
+		if(minComplete>0)flags|=IORING_ENTER_GETEVENTS;
+		if(arg!=nullptr)flags|=IORING_ENTER_EXT_ARG;
+		int ret;
+		do{
+			ret=sysEnter(ringFd_,toSubmit_,minComplete,flags,arg,arg!=nullptr?sizeof(*arg):0);
+		}while(ret<0 && errno==EINTR && minComplete==0);
+		if(ret<0)return -errno;
+		toSubmit_=(static_cast<unsigned>(ret)>=toSubmit_)?0:toSubmit_-static_cast<unsigned>(ret);
+		return ret;
+	}
+
+	static std::uint64_t tagOf(Conn *c,std::uint64_t tag) {
+		return reinterpret_cast<std::uint64_t>(c)|tag;
+	}
+
+	void armAccept() {
+		io_uring_sqe *sqe=getSqe();
+		if(sqe==nullptr)return;
+		sqe->opcode=IORING_OP_ACCEPT;
+		sqe->fd=listenFd_;
+		sqe->ioprio=IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags=SOCK_CLOEXEC;
+		sqe->user_data=TAG_ACCEPT;
+	}
+
+	void armRecv(Conn *c) {
+		io_uring_sqe *sqe=getSqe();
+		if(sqe==nullptr)return;
+		sqe->opcode=IORING_OP_RECV;
+		sqe->fd=c->fd;
+		sqe->ioprio=IORING_RECV_MULTISHOT;
+		sqe->flags=IOSQE_BUFFER_SELECT;
+		sqe->buf_group=BUF_GROUP;
+		sqe->user_data=tagOf(c,TAG_RECV);
+		c->recvArmed=true;
+		++c->inflight;
+	}
+
+	void armNotifier(Notifier *n) {
+		io_uring_sqe *sqe=getSqe();
+		if(sqe==nullptr)return;
+		sqe->opcode=IORING_OP_READ;
+		sqe->fd=n->fd;
+		sqe->addr=reinterpret_cast<std::uint64_t>(&n->counter);
+		sqe->len=sizeof(n->counter);
+		sqe->user_data=reinterpret_cast<std::uint64_t>(n)|TAG_NOTIFY;
+	}
+
+	void cancel(Conn *c,std::uint64_t tag) {
+		io_uring_sqe *sqe=getSqe();
+		if(sqe==nullptr)return;
+		sqe->opcode=IORING_OP_ASYNC_CANCEL;
+		sqe->fd=-1;
+		sqe->addr=tagOf(c,tag);
+		sqe->cancel_flags=IORING_ASYNC_CANCEL_ALL;
+		sqe->user_data=tagOf(c,TAG_CANCEL);
+		++c->inflight;
+	}
+
+	void scheduleFlush(Conn *c) {
+		if(c->sending || c->pendingFlush)return;
+		c->pendingFlush=true;
+		flushList_.push_back(c);
+	}
+
+	// One SENDMSG per connection carries everything queued since the last
+	// completion, instead of a send syscall per line.
+	void flushSends() {
+		if(flushList_.empty())return;
+		std::vector<Conn*> list;
+		list.swap(flushList_);
+		for(Conn *c:list){
+			c->pendingFlush=false;
+			if(c->dead || c->sending || c->out->empty())continue;
+			io_uring_sqe *sqe=getSqe();
+			if(sqe==nullptr){
+				scheduleFlush(c);
+				break;
+			}
+			c->msg=msghdr{};
+			c->msg.msg_iov=c->iov;
+			c->msg.msg_iovlen=c->out->fillIov(c->iov,MAX_IOV,c->pins);
+			sqe->opcode=IORING_OP_SENDMSG;
+			sqe->fd=c->fd;
+			sqe->addr=reinterpret_cast<std::uint64_t>(&c->msg);
+			sqe->len=1;
+			sqe->msg_flags=MSG_NOSIGNAL;
+			sqe->user_data=tagOf(c,TAG_SEND);
+			c->sending=true;
+			++c->inflight;
+		}
+	}
+
+	// Handles at most CQE_BUDGET completions so queued replies get submitted
+	// between bursts of input; leftovers make the next poll() return at once.
+	void drainCq() {
+		unsigned head=*cqHead_;
+		unsigned budget=CQE_BUDGET;
+		while(budget>0){
+			unsigned tail=loadAcquire(cqTail_);
+			if(head==tail)break;
+			while(head!=tail && budget>0){
+				const io_uring_cqe cqe=cqes_[head&cqMask_];
+				++head;
+				--budget;
+				storeRelease(cqHead_,head);
+				dispatch(cqe);
+			}
+		}
+	}
+
+	void dispatch(const io_uring_cqe &cqe) {
+		const std::uint64_t tag=cqe.user_data&TAG_MASK;
+		Conn *c=reinterpret_cast<Conn*>(cqe.user_data&~TAG_MASK);
+		switch(tag){
+		case TAG_ACCEPT:
+			onAcceptCqe(cqe);
+			break;
+		case TAG_RECV:
+			onRecvCqe(c,cqe);
+			break;
+		case TAG_SEND:
+			onSendCqe(c,cqe);
+			break;
+		case TAG_CANCEL:
+			--c->inflight;
+			break;
+		case TAG_NOTIFY:
+			onNotifyCqe(reinterpret_cast<Notifier*>(cqe.user_data&~TAG_MASK),cqe);
+			break;
+		default:
+			break;
+		}
+	}
+
+	void onAcceptCqe(const io_uring_cqe &cqe) {
+		if(cqe.res>=0){
+			int fd=cqe.res;
+			sockaddr_in addr{};
+			socklen_t alen=sizeof(addr);
+			if(::getpeername(fd,reinterpret_cast<sockaddr*>(&addr),&alen)<0){
+				addr=sockaddr_in{};
+			}
+			handler_.onAccept(fd,addr);
+		}else if(cqe.res!=-ECANCELED){
+			errno=-cqe.res;
+			std::perror("accept");
+		}
+		if((cqe.flags&IORING_CQE_F_MORE)==0)armAccept();
+	}
+
+	void onNotifyCqe(Notifier *n,const io_uring_cqe &cqe) {
+		if(cqe.res<0 && cqe.res!=-EINTR && cqe.res!=-EAGAIN){
+			errno=-cqe.res;
+			std::perror("eventfd read");
+			return;
+		}
+		handler_.onNotify(n->fd);
+		armNotifier(n);
+	}
+
+	void onRecvCqe(Conn *c,const io_uring_cqe &cqe) {
+		const bool more=(cqe.flags&IORING_CQE_F_MORE)!=0;
+		if(cqe.flags&IORING_CQE_F_BUFFER){
+			const unsigned short bid=static_cast<unsigned short>(cqe.flags>>IORING_CQE_BUFFER_SHIFT);
+			if(cqe.res>0 && !c->dead){
+				const char *data=bufPool_.data()+static_cast<std::size_t>(bid)*BUF_SIZE;
+				handler_.onData(c->fd,data,static_cast<std::size_t>(cqe.res));
+			}
+			recycleBuffer(bid);
+		}
+		if(more)return;
+		c->recvArmed=false;
+		--c->inflight;
+		if(!c->dead){
+			if(cqe.res>0 || cqe.res==-ENOBUFS){
+				armRecv(c);
+			}else{
+				handler_.onHangup(c->fd);
+			}
+		}
+	}
+
+	void onSendCqe(Conn *c,const io_uring_cqe &cqe) {
+		--c->inflight;
+		c->sending=false;
+		for(OutBuf &p:c->pins)p.reset();
+		if(c->dead)return;
+		if(cqe.res>0){
+			c->out->consume(static_cast<std::size_t>(cqe.res));
+		}else if(cqe.res!=-EAGAIN && cqe.res!=-EINTR){
+			handler_.onHangup(c->fd);
+			return;
+		}
+		if(!c->out->empty())scheduleFlush(c);
+	}
+
+	// Frees removed connections once the kernel no longer references them.
+	// Runs after flushSends so nothing else still points at them.
+	void reapZombies() {
+		std::size_t keep=0;
+		for(Conn *c:zombies_){
+			if(c->inflight>0)zombies_[keep++]=c;
+			else delete c;
+		}
+		zombies_.resize(keep);
+	}
+};
+
+} // namespace
+
+std::unique_ptr<EventLoop> makeUringLoop(EventLoop::Handler &handler) {
+	auto loop=std::make_unique<UringLoop>(handler);
+	if(!loop->setup())return nullptr;
+	return loop;
+}
+
+} // namespace qchat
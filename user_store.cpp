@@ -0,0 +1,339 @@
+#include "user_store.hpp"
+
+#include <cstring>
+#include <utility>
+
+namespace qchat {
+
+namespace {
+
+const UserProfile EMPTY_PROFILE{};
+
+} // namespace
+
+std::string_view UserStore::ProfileRef::displayName() const {
+	if(mem_!=nullptr)return mem_->displayName;
+	if(view_!=nullptr)return view_->displayName(index_);
+	return std::string_view();
+}
+
+std::size_t UserStore::ProfileRef::historyCount() const {
+	if(mem_!=nullptr)return mem_->history.size();
+	if(view_!=nullptr)return view_->historyCount(index_);
+	return 0;
+}
+
+LoginRecord UserStore::ProfileRef::history(std::size_t k) const {
+	if(mem_!=nullptr)return mem_->history[k];
+	return view_->history(index_,k);
+}
+
+std::string_view StringArena::intern(std::string_view s) {
+	if(s.empty())return std::string_view();
+	char *p;
+	if(s.size()>CHUNK/4){
+		// gets a block of its own; the current chunk keeps filling
+		chunks_.push_back(std::make_unique<char[]>(s.size()));
+		p=chunks_.back().get();
+		bytes_+=s.size();
+	}else{
+		if(CHUNK-used_<s.size()){
+			chunks_.push_back(std::make_unique<char[]>(CHUNK));
+			cur_=chunks_.back().get();
+			used_=0;
+			bytes_+=CHUNK;
+		}
+		p=cur_+used_;
+		used_+=s.size();
+	}
+	std::memcpy(p,s.data(),s.size());
+	return std::string_view(p,s.size());
+}
+
+void StringArena::clear() {
+	chunks_.clear();
+	cur_=nullptr;
+	used_=CHUNK;
+	bytes_=0;
+}
+
+void UserStore::attach(SnapshotView view) {
+	flags_.clear();
+	hash_.clear();
+	handle_.clear();
+	count_=0;
+	arena_.clear();
+	byHandle_.clear();
+	profiles_.clear();
+	lru_.clear();
+	cachedBytes_=0;
+	dirtyCount_=0;
+	view_=std::make_shared<const SnapshotView>(std::move(view));
+	const std::size_t n=view_->userCount();
+	if(n==0)return;
+	const std::size_t cols=static_cast<std::size_t>(view_->uid(n-1))+1;
+	flags_.reserve(cols);
+	hash_.reserve(cols);
+	handle_.reserve(cols);
+	for(std::size_t i=0;i<n;++i){
+		const u64 uid=view_->uid(i);
+		grow(uid);
+		flags_[uid]=PRESENT|(view_->allowMultiLogin(i)?MULTI_LOGIN:0);
+		hash_[uid]=view_->passwordHash(i);
+		handle_[uid]=view_->handle(i);
+		++count_;
+	}
+}
+
+void UserStore::add(UserAuth auth,UserProfile profile,u64 seq) {
+	const u64 uid=auth.uid;
+	if(contains(uid)){
+		releaseHandle(uid);
+	}else{
+		grow(uid);
+		++count_;
+	}
+	flags_[uid]=PRESENT|(auth.allowMultiLogin?MULTI_LOGIN:0);
+	hash_[uid]=auth.passwordHash;
+	handle_[uid]=arena_.intern(auth.handle);
+	byHandle_[handle_[uid]]=uid;
+
+	auto [it,inserted]=profiles_.try_emplace(uid);
+	CachedProfile &p=it->second;
+	if(!p.dirty){
+		if(!inserted){
+			cachedBytes_-=p.bytes;
+			lru_.erase(p.lru);
+		}
+		p.dirty=true;
+		++dirtyCount_;
+	}
+	p.profile=std::move(profile);
+	p.dirtySeq=seq;
+	p.bytes=0;
+}
+
+// Columns are indexed by uid; uids are handed out in sequence, so they stay
+// dense.
+void UserStore::grow(u64 uid) {
+	if(uid<flags_.size())return;
+	const std::size_t n=static_cast<std::size_t>(uid)+1;
+	flags_.resize(n,0);
+	hash_.resize(n);
+	handle_.resize(n);
+}
+
+void UserStore::setAllowMultiLogin(u64 uid,bool allow) {
+	if(allow){
+		flags_[uid]|=MULTI_LOGIN;
+	}else{
+		flags_[uid]&=static_cast<u8>(~MULTI_LOGIN);
+	}
+}
+
+void UserStore::changeHandle(u64 uid,std::string_view handle) {
+	releaseHandle(uid);
+	handle_[uid]=arena_.intern(handle);
+	byHandle_[handle_[uid]]=uid;
+}
+
+// The old handle may still be in the snapshot's index, so it stays in
+// byHandle_ as free rather than being erased.
+void UserStore::releaseHandle(u64 uid) {
+	auto it=byHandle_.find(handle_[uid]);
+	if(it!=byHandle_.end()){
+		it->second=FREED;
+	}else{
+		byHandle_.try_emplace(arena_.intern(handle_[uid]),FREED);
+	}
+}
+
+std::optional<u64> UserStore::findHandle(std::string_view handle) const {
+	auto it=byHandle_.find(handle);
+	if(it!=byHandle_.end()){
+		if(it->second==FREED)return std::nullopt;
+		return it->second;
+	}
+	if(auto idx=view_->findHandle(handle))return view_->uid(*idx);
+	return std::nullopt;
+}
+
+// Points the handle column at the new view_ and keeps in byHandle_ only
+// what it does not already say: handles set or freed after the freeze it
+// was written from. They move to a fresh arena.
+void UserStore::rebaseHandles() {
+	std::vector<std::pair<std::string_view,u64>> kept;
+	for(const auto &[handle,uid]:byHandle_){
+		if(uid==FREED){
+			if(view_->findHandle(handle))kept.emplace_back(handle,uid);
+			continue;
+		}
+		const std::optional<std::size_t> idx=view_->findUid(uid);
+		if(!idx || view_->handle(*idx)!=handle)kept.emplace_back(handle,uid);
+	}
+	const std::size_t n=view_->userCount();
+	for(std::size_t i=0;i<n;++i){
+		const u64 uid=view_->uid(i);
+		if(contains(uid))handle_[uid]=view_->handle(i);
+	}
+	StringArena fresh;
+	FlatMap<std::string_view,u64> changed;
+	changed.reserve(kept.size());
+	for(const auto &[handle,uid]:kept){
+		const std::string_view h=fresh.intern(handle);
+		if(uid!=FREED)handle_[uid]=h;
+		changed.try_emplace(h,uid);
+	}
+	arena_=std::move(fresh);
+	byHandle_=std::move(changed);
+}
+
+const UserProfile &UserStore::profile(u64 uid) {
+	auto it=profiles_.find(uid);
+	if(it!=profiles_.end()){
+		++hits_;
+		CachedProfile &p=it->second;
+		if(!p.dirty)lru_.splice(lru_.begin(),lru_,p.lru);
+		return p.profile;
+	}
+	if(!view_->isOpen() || !view_->findUid(uid))return EMPTY_PROFILE;
+	return load(uid).profile;
+}
+
+UserProfile &UserStore::editProfile(u64 uid,u64 seq) {
+	auto it=profiles_.find(uid);
+	CachedProfile &p=(it!=profiles_.end())?it->second:load(uid);
+	if(!p.dirty){
+		cachedBytes_-=p.bytes;
+		lru_.erase(p.lru);
+		p.bytes=0;
+		p.dirty=true;
+		++dirtyCount_;
+	}
+	p.dirtySeq=seq;
+	return p.profile;
+}
+
+// Copies a profile out of the snapshot into the LRU.
+UserStore::CachedProfile &UserStore::load(u64 uid) {
+	++misses_;
+	CachedProfile &p=profiles_[uid];
+	if(auto idx=view_->isOpen()?view_->findUid(uid):std::nullopt){
+		p.profile.displayName=view_->displayName(*idx);
+		const std::size_t n=view_->historyCount(*idx);
+		for(std::size_t k=0;k<n;++k)p.profile.history.push(view_->history(*idx,k));
+	}
+	lru_.push_front(uid);
+	p.lru=lru_.begin();
+	p.bytes=footprint(p.profile);
+	cachedBytes_+=p.bytes;
+	evict(uid);
+	return p;
+}
+
+void UserStore::makeClean(u64 uid,CachedProfile &p) {
+	p.dirty=false;
+	p.dirtySeq=0;
+	--dirtyCount_;
+	lru_.push_front(uid);
+	p.lru=lru_.begin();
+	p.bytes=footprint(p.profile);
+	cachedBytes_+=p.bytes;
+}
+
+// Drops least recently used clean profiles until under the limit; never the
+// one just used.
+void UserStore::evict(u64 keep) {
+	while(cachedBytes_>cacheLimit_ && !lru_.empty() && lru_.back()!=keep){
+		auto it=profiles_.find(lru_.back());
+		cachedBytes_-=it->second.bytes;
+		lru_.pop_back();
+		profiles_.erase(it);
+		++evictions_;
+	}
+}
+
+std::size_t UserStore::footprint(const UserProfile &p) {
+	std::size_t n=sizeof(CachedProfile)+sizeof(u64)*4; // entry, map and list nodes
+	n+=p.displayName.capacity();
+	return n;
+}
+
+UserStore::ProfileRef UserStore::profileRef(u64 uid) const {
+	ProfileRef ref;
+	auto it=profiles_.find(uid);
+	if(it!=profiles_.end()){
+		ref.mem_=&it->second.profile;
+	}else if(view_->isOpen()){
+		if(auto idx=view_->findUid(uid)){
+			ref.view_=view_.get();
+			ref.index_=*idx;
+		}
+	}
+	return ref;
+}
+
+void UserStore::freeze(DbImage &out) const {
+	out.uids.clear();
+	out.handles.clear();
+	out.hashes.clear();
+	out.multiLogin.clear();
+	out.uids.reserve(count_);
+	out.handles.reserve(count_);
+	out.hashes.reserve(count_);
+	out.multiLogin.reserve(count_);
+	for(u64 uid=0;uid<flags_.size();++uid){
+		if((flags_[uid]&PRESENT)==0)continue;
+		out.uids.push_back(uid);
+		out.handles.push_back(handle_[uid]);
+		out.hashes.push_back(hash_[uid]);
+		out.multiLogin.push_back((flags_[uid]&MULTI_LOGIN)!=0?1:0);
+	}
+	// clean cached profiles match the snapshot, so only dirty ones are copied
+	out.changed.clear();
+	out.changed.reserve(dirtyCount_);
+	for(const auto &kv:profiles_){
+		if(kv.second.dirty)out.changed.emplace(kv.first,kv.second.profile);
+	}
+	out.view=view_;
+}
+
+UserStore::ProfileRef DbImage::profileRef(u64 uid) const {
+	UserStore::ProfileRef ref;
+	auto it=changed.find(uid);
+	if(it!=changed.end()){
+		ref.mem_=&it->second;
+	}else if(view && view->isOpen()){
+		if(auto idx=view->findUid(uid)){
+			ref.view_=view.get();
+			ref.index_=*idx;
+		}
+	}
+	return ref;
+}
+
+void UserStore::snapshotWritten(SnapshotView view,u64 seq) {
+	view_=std::make_shared<const SnapshotView>(std::move(view));
+	rebaseHandles();
+	for(auto &kv:profiles_){
+		CachedProfile &p=kv.second;
+		if(p.dirty && p.dirtySeq<=seq)makeClean(kv.first,p);
+	}
+	evict(0);
+}
+
+UserStoreStats UserStore::stats() const {
+	UserStoreStats s;
+	s.users=count_;
+	s.tableBytes=flags_.capacity()*sizeof(u8)+hash_.capacity()*sizeof(PasswordHash)
+		+handle_.capacity()*sizeof(std::string_view)+byHandle_.tableBytes()+arena_.bytes();
+	s.cached=lru_.size();
+	s.cachedBytes=cachedBytes_;
+	s.dirty=dirtyCount_;
+	s.hits=hits_;
+	s.misses=misses_;
+	s.evictions=evictions_;
+	return s;
+}
+
+} // namespace qchat
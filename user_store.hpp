@@ -0,0 +1,230 @@
+#ifndef QCHAT_USER_STORE_HPP
+#define QCHAT_USER_STORE_HPP
+
+#include "chat_common.hpp"
+#include "db_file.hpp"
+#include "flat_map.hpp"
+#include "password_kdf.hpp"
+
+#include <array>
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace qchat {
+
+// A new account as handed to UserStore::add(); the table keeps it split
+// into columns.
+struct UserAuth {
+	u64 uid{};
+	std::string handle;       // unique, ASCII, no whitespace
+	PasswordHash passwordHash;
+	bool allowMultiLogin{false};
+};
+
+// Paged in from the snapshot on demand.
+struct UserProfile {
+	std::string displayName;  // UTF-8, arbitrary
+	LoginHistory history;
+};
+
+struct UserStoreStats {
+	std::size_t users{0};
+	std::size_t tableBytes{0};  // columns, handle index and arena
+	std::size_t cached{0};      // clean profiles in the LRU
+	std::size_t cachedBytes{0};
+	std::size_t dirty{0};       // profiles changed since the last snapshot
+	u64 hits{0};
+	u64 misses{0};              // profiles read from the snapshot
+	u64 evictions{0};
+};
+
+// Append-only storage for short strings. Memory comes in fixed chunks that
+// never move, so the views handed out stay valid until clear().
+class StringArena {
+public:
+	std::string_view intern(std::string_view s);
+	void clear();
+	std::size_t bytes() const {return bytes_;}
+
+private:
+	static constexpr std::size_t CHUNK=64*1024;
+	std::vector<std::unique_ptr<char[]>> chunks_;
+	char *cur_{nullptr};
+	std::size_t used_{CHUNK}; // in cur_
+	std::size_t bytes_{0};
+};
+
+class UserRow;
+struct DbImage;
+
+// Two tiers of user data. Auth data is resident as a struct-of-arrays table
+// indexed by uid; handles point into the mmapped snapshot and are looked up
+// through its index, behind a FlatMap of those changed since it was written
+// (kept in a StringArena). Profiles stay in the snapshot and are copied into
+// a byte-bounded LRU when used. A profile changed since the last snapshot is
+// pinned as dirty until a snapshot that includes it is durable, since the
+// old file cannot serve it.
+//
+// Not thread-safe; DbState users are guarded by the Hub mutex. Handle views
+// stay valid until the next changeHandle() or snapshotWritten(). References
+// returned by profile() and editProfile() stay valid until the next call
+// that may page a profile in.
+class UserStore {
+public:
+	// A profile as it would be written to a snapshot: resident or still in
+	// the mapped file.
+	class ProfileRef {
+	public:
+		std::string_view displayName() const;
+		std::size_t historyCount() const;
+		LoginRecord history(std::size_t k) const;
+
+	private:
+		friend class UserStore;
+		friend struct DbImage;
+		const UserProfile *mem_{nullptr};
+		const SnapshotView *view_{nullptr};
+		std::size_t index_{0};
+	};
+
+	void setCacheLimit(std::size_t bytes) {cacheLimit_=bytes;}
+
+	// Replaces the contents with the users of a snapshot.
+	void attach(SnapshotView view);
+	// Adds a user that is not in the attached snapshot (creation, journal
+	// replay, old snapshot formats). seq is the journal record, 0 if none.
+	void add(UserAuth auth,UserProfile profile,u64 seq);
+
+	std::size_t size() const {return count_;}
+	std::optional<UserRow> byHandle(std::string_view handle);
+	std::optional<UserRow> byUid(u64 uid);
+	bool handleTaken(std::string_view handle) const {return findHandle(handle).has_value();}
+
+	// Columns. uid must be contains()ed; uidEnd() bounds every uid in use.
+	u64 uidEnd() const {return flags_.size();}
+	bool contains(u64 uid) const {return uid<flags_.size() && (flags_[uid]&PRESENT)!=0;}
+	std::string_view handle(u64 uid) const {return handle_[uid];}
+	const PasswordHash &passwordHash(u64 uid) const {return hash_[uid];}
+	bool allowMultiLogin(u64 uid) const {return (flags_[uid]&MULTI_LOGIN)!=0;}
+	void setPasswordHash(u64 uid,const PasswordHash &hash) {hash_[uid]=hash;}
+	void setAllowMultiLogin(u64 uid,bool allow);
+	void changeHandle(u64 uid,std::string_view handle);
+
+	const UserProfile &profile(u64 uid);
+	// Pins the profile as changed by journal record seq.
+	UserProfile &editProfile(u64 uid,u64 seq);
+
+	// For writing a snapshot; does not page anything in.
+	ProfileRef profileRef(u64 uid) const;
+	bool hasDirty() const {return dirtyCount_>0;}
+	// Fills out's user part. Costs a copy of the auth columns and of the
+	// dirty profiles; nothing is read from the snapshot file.
+	void freeze(DbImage &out) const;
+
+	// A snapshot holding every change up to seq is durable at view's file:
+	// serve from it and let the profiles it covers be evicted.
+	void snapshotWritten(SnapshotView view,u64 seq);
+
+	UserStoreStats stats() const;
+
+private:
+	struct CachedProfile {
+		UserProfile profile;
+		bool dirty{false};
+		u64 dirtySeq{0};
+		std::size_t bytes{0};           // counted in cachedBytes_ while clean
+		std::list<u64>::iterator lru;   // valid while clean
+	};
+
+	static constexpr u8 PRESENT=1;
+	static constexpr u8 MULTI_LOGIN=2;
+
+	std::shared_ptr<const SnapshotView> view_=std::make_shared<const SnapshotView>();
+	// auth columns, indexed by uid
+	std::vector<u8> flags_;
+	std::vector<PasswordHash> hash_;
+	std::vector<std::string_view> handle_; // into view_ or arena_
+	std::size_t count_{0};
+	// handles set or freed since view_ was written, checked before its index
+	static constexpr u64 FREED=0; // no user has uid 0
+	StringArena arena_;
+	FlatMap<std::string_view,u64> byHandle_;
+	std::unordered_map<u64,CachedProfile> profiles_;
+	std::list<u64> lru_; // clean profiles, most recent first
+	std::size_t cacheLimit_{64u*1024u*1024u};
+	std::size_t cachedBytes_{0};
+	std::size_t dirtyCount_{0};
+	u64 hits_{0};
+	u64 misses_{0};
+	u64 evictions_{0};
+
+	void grow(u64 uid);
+	void releaseHandle(u64 uid);
+	std::optional<u64> findHandle(std::string_view handle) const;
+	void rebaseHandles();
+	CachedProfile &load(u64 uid);
+	void makeClean(u64 uid,CachedProfile &p);
+	void evict(u64 keep);
+	static std::size_t footprint(const UserProfile &p);
+};
+
+// One account in the table; a view, not a copy.
+class UserRow {
+public:
+	UserRow(UserStore &store,u64 uid):store_(&store),uid_(uid) {}
+
+	u64 uid() const {return uid_;}
+	std::string_view handle() const {return store_->handle(uid_);}
+	const PasswordHash &passwordHash() const {return store_->passwordHash(uid_);}
+	bool allowMultiLogin() const {return store_->allowMultiLogin(uid_);}
+
+private:
+	UserStore *store_;
+	u64 uid_;
+};
+
+inline std::optional<UserRow> UserStore::byUid(u64 uid) {
+	if(!contains(uid))return std::nullopt;
+	return UserRow(*this,uid);
+}
+
+inline std::optional<UserRow> UserStore::byHandle(std::string_view handle) {
+	const std::optional<u64> uid=findHandle(handle);
+	if(!uid)return std::nullopt;
+	return UserRow(*this,*uid);
+}
+
+struct DbState {
+	u64 nextUid{1};
+	u64 journalSeq{0}; // last journal record reflected in this state
+	UserStore users;
+};
+
+// A DbState frozen for writing a snapshot, so the encode can run without the
+// DB lock. Profiles not in changed are read from view, the snapshot they
+// were current in, which the image keeps mapped. Handles point into that
+// file or the store's arena, which snapshotWritten() replaces; the image
+// must be encoded before that is called.
+struct DbImage {
+	u64 nextUid{1};
+	u64 journalSeq{0};
+	// users present, by ascending uid
+	std::vector<u64> uids;
+	std::vector<std::string_view> handles;
+	std::vector<PasswordHash> hashes;
+	std::vector<u8> multiLogin;
+	std::unordered_map<u64,UserProfile> changed;
+	std::shared_ptr<const SnapshotView> view;
+
+	UserStore::ProfileRef profileRef(u64 uid) const;
+};
+
+} // namespace qchat
+
+#endif